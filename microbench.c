@@ -0,0 +1,382 @@
+/*
+  Microbenchmarks for the kernels pngstego runs over decoded pixels: embedding,
+    extraction, sanitizing and the analysis, quality, diff and bit plane loops.
+
+  Each kernel is timed on its own, on a buffer that fits in cache and on one
+  that has to come from DRAM, and compared with memcpy() on a buffer of the same
+  size. Kernels below a target fraction of memcpy's bandwidth are flagged, and
+  the exit status is non-zero if any are.
+
+  Usage: $ ./microbench [dram_megabytes] [target_fraction]
+
+  Dependencies: Compiled using libpng version 1.6.37
+*/
+
+#define PNGSTEGO_NO_MAIN
+#include "pngstego.c"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+    This is the size of the buffer that stays in cache, and the default size of the
+    one that doesn't, in bytes.
+*/
+#define CACHE_BUFFER_LENGTH (128 * 1024)
+#define DRAM_BUFFER_LENGTH (128 * 1024 * 1024)
+
+/**
+    Kernels see the buffer as rows of an RGB image this many pixels wide, or as
+    planes of this many samples.
+*/
+#define MICROBENCH_WIDTH 4096
+
+/**
+    Each measurement is repeated until it has taken this long, and at least this
+    many times, keeping the fastest.
+*/
+#define MICROBENCH_MIN_SECONDS 0.2
+#define MICROBENCH_MIN_RUNS 3
+
+/**
+    Kernels are flagged below this fraction of memcpy's bandwidth unless told
+    otherwise.
+*/
+#define MICROBENCH_DEFAULT_TARGET 0.10
+
+/**
+    This struct is the working set a kernel runs over. rows point into samples,
+    other is a second image of the same size for the kernels that compare two,
+    clean is a copy of samples for undoing the kernels that write to them, and
+    scratch holds anything else a kernel writes.
+*/
+typedef struct kernel_buffers {
+    png_bytep samples;
+    png_bytep other;
+    png_bytep clean;
+    png_bytep scratch;
+    png_bytep* rows;
+    png_bytep payload;
+    size_t length;
+    int width;
+    int height;
+    memory_buffer output;
+} kernel_buffers;
+
+/**
+    This struct describes one kernel. traffic is the bytes it moves to and from
+    memory for each byte of the buffer, as memcpy() moves 2. writes_samples is
+    set for the kernels that change samples in place.
+*/
+typedef struct kernel {
+    const char* name;
+    double traffic;
+    bool writes_samples;
+    void (*run)(kernel_buffers* buffers);
+} kernel;
+
+/**
+    This struct is the best of the repeated runs of one measurement.
+*/
+typedef struct measurement {
+    double seconds;
+    double cycles;
+} measurement;
+
+/**
+    This function fills in buffers for length bytes, returning false if it can't.
+    free_kernel_buffers() frees them.
+*/
+bool allocate_kernel_buffers(kernel_buffers* buffers, size_t length);
+void free_kernel_buffers(kernel_buffers* buffers);
+
+/**
+    This function runs a kernel, or memcpy() if it is NULL, until
+    MICROBENCH_MIN_SECONDS have passed and returns its fastest run. Samples are
+    restored from the clean copy between runs of a kernel that writes them, outside
+    the timed region, so every run and every later kernel sees the same data.
+*/
+measurement measure_kernel(const kernel* kernel, kernel_buffers* buffers);
+
+/**
+    This function prints one line of the table. It returns true if the kernel is
+    below target of roofline, the memcpy() bandwidth in bytes moved per second.
+*/
+bool print_measurement(const char* name, const char* level, const kernel_buffers* buffers, double traffic,
+                       measurement result, double roofline, double target);
+
+/**
+    This function returns the value of the cycle counter. It counts the reference
+    cycles of the time stamp counter on x86, and nanoseconds elsewhere.
+*/
+uint64_t read_cycle_counter();
+
+/**
+    These functions run one kernel over the whole buffer.
+*/
+void run_embed_rows(kernel_buffers* buffers);
+void run_extract_rows(kernel_buffers* buffers);
+void run_sanitize_row(kernel_buffers* buffers);
+void run_count_plane_statistics(kernel_buffers* buffers);
+void run_squared_error_row(kernel_buffers* buffers);
+void run_compare_diff_row(kernel_buffers* buffers);
+void run_slice_bit_plane(kernel_buffers* buffers);
+
+/**
+    This is where kernels that return a result leave it, so the compiler can't
+    drop their work.
+*/
+volatile uint64_t kernel_sink;
+
+/**
+    These are the kernels, in the order they are printed.
+*/
+const kernel kernels[] = {
+    {"embed_rows", 2, true, run_embed_rows},
+    {"extract_rows", 1, false, run_extract_rows},
+    {"sanitize_row", 2, true, run_sanitize_row},
+    {"count_plane_statistics", 1, false, run_count_plane_statistics},
+    {"squared_error_row", 2, false, run_squared_error_row},
+    {"compare_diff_row", 2, false, run_compare_diff_row},
+    {"slice_bit_plane", 1.125, false, run_slice_bit_plane},
+};
+
+int main(int argc, char* argv[]){
+    size_t lengths[2] = {CACHE_BUFFER_LENGTH, DRAM_BUFFER_LENGTH};
+    const char* levels[2] = {"cache", "dram"};
+    double target = MICROBENCH_DEFAULT_TARGET;
+    int flagged = 0;
+    int level;
+    size_t i;
+
+    if(argc >= 2 && atof(argv[1]) > 0){
+        lengths[1] = (size_t)(atof(argv[1]) * 1024 * 1024);
+    }
+    if(argc >= 3 && atof(argv[2]) > 0){
+        target = atof(argv[2]);
+    }
+
+    fprintf(stdout, "%-24s %-6s %10s %10s %10s %10s %9s\n",
+            "kernel", "buffer", "bytes", "cycles/B", "GB/s", "moved GB/s", "roofline");
+    for(level = 0; level < 2; level++){
+        kernel_buffers buffers;
+        if(!allocate_kernel_buffers(&buffers, lengths[level])){
+            fprintf(stderr, "Error in main(): %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        //memcpy() reads and writes each byte once, and memset() only writes them,
+        // which is as fast as this host moves bytes at this buffer size
+        measurement copy = measure_kernel(NULL, &buffers);
+        double roofline = 2 * buffers.length / copy.seconds;
+        print_measurement("memcpy", levels[level], &buffers, 2, copy, roofline, 0);
+
+        measurement set = {1e30, 1e30};
+        for(int run = 0; run < MICROBENCH_MIN_RUNS; run++){
+            uint64_t cycles = read_cycle_counter();
+            double start = monotonic_seconds();
+            memset(buffers.scratch, run, buffers.length);
+            double seconds = monotonic_seconds() - start;
+            cycles = read_cycle_counter() - cycles;
+            if(seconds < set.seconds){
+                set.seconds = seconds;
+                set.cycles = cycles;
+            }
+        }
+        print_measurement("memset", levels[level], &buffers, 1, set, roofline, 0);
+
+        for(i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++){
+            measurement result = measure_kernel(&kernels[i], &buffers);
+            if(print_measurement(kernels[i].name, levels[level], &buffers, kernels[i].traffic,
+                                 result, roofline, target)){
+                flagged++;
+            }
+        }
+        free_kernel_buffers(&buffers);
+    }
+
+    if(flagged > 0){
+        fprintf(stdout, "%d kernel%s below %.0f%% of memcpy bandwidth\n",
+                flagged, flagged == 1 ? "" : "s", 100 * target);
+        return EXIT_FAILURE;
+    }
+    fprintf(stdout, "All kernels at or above %.0f%% of memcpy bandwidth\n", 100 * target);
+    return EXIT_SUCCESS;
+}
+
+bool allocate_kernel_buffers(kernel_buffers* buffers, size_t length){
+    uint64_t random_state = BENCH_SEED;
+    size_t row_bytes = (size_t)MICROBENCH_WIDTH * 3;
+    size_t i;
+    int row;
+
+    memset(buffers, 0, sizeof(kernel_buffers));
+    buffers->width = MICROBENCH_WIDTH;
+    buffers->height = (int)(length / row_bytes);
+    buffers->height = buffers->height > 1 ? buffers->height : 1;
+    buffers->length = row_bytes * buffers->height;
+
+    //Kernels that read a row of planes ahead may run past the end by a padding's worth
+    buffers->samples = malloc(buffers->length + ANALYSIS_PLANE_PADDING);
+    buffers->other = malloc(buffers->length + ANALYSIS_PLANE_PADDING);
+    buffers->clean = malloc(buffers->length);
+    buffers->scratch = malloc(buffers->length);
+    buffers->rows = malloc(buffers->height * sizeof(png_bytep));
+    buffers->payload = malloc(payload_capacity(buffers->width, buffers->height) + 1);
+    if(buffers->samples == NULL || buffers->other == NULL || buffers->clean == NULL || buffers->scratch == NULL
+       || buffers->rows == NULL || buffers->payload == NULL){
+        free_kernel_buffers(buffers);
+        return false;
+    }
+
+    //Noise, and a copy of it with every 64th sample changed for the diff kernel.
+    // Writing every page here also means no kernel pays for first touches.
+    for(i = 0; i < buffers->length + ANALYSIS_PLANE_PADDING; i++){
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 7;
+        random_state ^= random_state << 17;
+        buffers->samples[i] = (png_byte)random_state;
+        buffers->other[i] = buffers->samples[i] ^ (i % 64 == 0);
+    }
+    memcpy(buffers->clean, buffers->samples, buffers->length);
+    memset(buffers->scratch, 0, buffers->length);
+    for(i = 0; i < payload_capacity(buffers->width, buffers->height); i++){
+        buffers->payload[i] = (png_byte)(i * 131);
+    }
+    for(row = 0; row < buffers->height; row++){
+        buffers->rows[row] = buffers->samples + row_bytes * row;
+    }
+    return true;
+}
+
+void free_kernel_buffers(kernel_buffers* buffers){
+    free(buffers->samples);
+    free(buffers->other);
+    free(buffers->clean);
+    free(buffers->scratch);
+    free(buffers->rows);
+    free(buffers->payload);
+    free_memory_buffer(&buffers->output);
+}
+
+measurement measure_kernel(const kernel* kernel, kernel_buffers* buffers){
+    measurement best = {1e30, 1e30};
+    double started = monotonic_seconds();
+    int runs;
+
+    for(runs = 0; runs < MICROBENCH_MIN_RUNS || monotonic_seconds() - started < MICROBENCH_MIN_SECONDS; runs++){
+        if(kernel != NULL && kernel->writes_samples){
+            memcpy(buffers->samples, buffers->clean, buffers->length);
+        }
+        uint64_t cycles = read_cycle_counter();
+        double start = monotonic_seconds();
+        if(kernel == NULL){
+            memcpy(buffers->scratch, buffers->samples, buffers->length);
+        }else{
+            kernel->run(buffers);
+        }
+        double seconds = monotonic_seconds() - start;
+        cycles = read_cycle_counter() - cycles;
+        if(seconds < best.seconds){
+            best.seconds = seconds;
+            best.cycles = cycles;
+        }
+    }
+    if(kernel != NULL && kernel->writes_samples){
+        memcpy(buffers->samples, buffers->clean, buffers->length);
+    }
+    return best;
+}
+
+bool print_measurement(const char* name, const char* level, const kernel_buffers* buffers, double traffic,
+                       measurement result, double roofline, double target){
+    double rate = buffers->length / result.seconds;
+    double fraction = traffic * rate / roofline;
+    bool below = fraction < target;
+
+    fprintf(stdout, "%-24s %-6s %10zu %10.3f %10.2f %10.2f %8.1f%%%s\n",
+            name, level, buffers->length, result.cycles / buffers->length, rate / 1e9,
+            traffic * rate / 1e9, 100 * fraction, below ? " below target" : "");
+    return below;
+}
+
+uint64_t read_cycle_counter(){
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+void run_embed_rows(kernel_buffers* buffers){
+    embed_rows(buffers->rows, buffers->width, buffers->height, buffers->payload,
+               payload_capacity(buffers->width, buffers->height));
+}
+
+void run_extract_rows(kernel_buffers* buffers){
+    buffers->output.length = 0;
+    extract_rows(buffers->rows, buffers->width, buffers->height, &buffers->output);
+    kernel_sink += buffers->output.length;
+}
+
+void run_sanitize_row(kernel_buffers* buffers){
+    png_byte mask[16];
+    uint64_t random_state[2] = {BENCH_SEED, BENCH_SEED >> 1 | 1};
+    size_t row_bytes = (size_t)buffers->width * 3;
+    int row;
+
+    memset(mask, 1, sizeof(mask));
+    for(row = 0; row < buffers->height; row++){
+        sanitize_row(buffers->rows[row], row_bytes, mask, random_state);
+    }
+}
+
+void run_count_plane_statistics(kernel_buffers* buffers){
+    channel_statistics statistics;
+    size_t offset;
+
+    memset(&statistics, 0, sizeof(statistics));
+    for(offset = 0; offset + buffers->width <= buffers->length; offset += buffers->width){
+        count_plane_statistics(&statistics, buffers->samples + offset, buffers->width);
+    }
+    kernel_sink += statistics.spa_pairs;
+}
+
+void run_squared_error_row(kernel_buffers* buffers){
+    size_t row_bytes = (size_t)buffers->width * 3;
+    uint64_t sum = 0;
+    int row;
+
+    for(row = 0; row < buffers->height; row++){
+        sum += squared_error_row(buffers->samples + row_bytes * row, buffers->other + row_bytes * row, row_bytes);
+    }
+    kernel_sink += sum;
+}
+
+void run_compare_diff_row(kernel_buffers* buffers){
+    diff_summary summary = {0};
+    size_t row_bytes = (size_t)buffers->width * 3;
+    int row;
+
+    summary.first_sample = -1;
+    summary.range_start = -1;
+    for(row = 0; row < buffers->height; row++){
+        compare_diff_row(&summary, buffers->samples + row_bytes * row, buffers->other + row_bytes * row,
+                         row_bytes, row);
+    }
+    compare_diff_row(&summary, NULL, NULL, 0, row);
+    kernel_sink += summary.changed;
+}
+
+void run_slice_bit_plane(kernel_buffers* buffers){
+    size_t offset;
+    png_bytep packed = buffers->scratch;
+
+    for(offset = 0; offset + buffers->width <= buffers->length; offset += buffers->width){
+        slice_bit_plane(buffers->samples + offset, buffers->width, 0, packed);
+        packed += buffers->width / BYTE_SIZE;
+    }
+}
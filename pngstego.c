@@ -12,6 +12,8 @@
   Dependencies: Compiled using libpng version 1.6.37
 */
 
+#define _GNU_SOURCE
+
 #include <png.h>
 #include <zlib.h>
 #include <stdio.h>
@@ -24,6 +26,31 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/random.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
+#include <stddef.h>
+#include <execinfo.h>
+#include <dlfcn.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /**
     If the user enters a variation of this word as the third command line
@@ -37,6 +64,218 @@
 */
 #define EXTRACT_TEXT "EXTRACT"
 
+/**
+    If the user enters a variation of this word as the third command line
+    argument, the program will try many ways of reading bits out of a PNG
+*/
+#define SCAN_TEXT "SCAN"
+
+/**
+    If the user enters a variation of this word as the third command line
+    argument, the program will test a PNG for LSB embedding by any tool
+*/
+#define ANALYZE_TEXT "ANALYZE"
+
+/**
+    If the user enters a variation of this word as the third command line
+    argument, the program will destroy anything hidden in the low bit planes of a
+    PNG. By default the planes are randomized, or cleared if the fifth argument is
+    a variation of SANITIZE_CLEAR_TEXT.
+*/
+#define SANITIZE_TEXT "SANITIZE"
+#define SANITIZE_CLEAR_TEXT "CLEAR"
+
+/**
+    Sanitized images are compressed at this zlib level. Randomized bit planes don't
+    compress, and deflate's time at the default level dwarfs the rest of the work,
+    so speed is traded for files around a seventh larger.
+*/
+#define SANITIZE_COMPRESSION_LEVEL Z_BEST_SPEED
+
+/**
+    A sanitized image is written under its name with this added, then renamed into
+    place once it is complete.
+*/
+#define SANITIZE_PARTIAL_SUFFIX ".partial"
+
+/**
+    If the user enters a variation of this word as the third command line
+    argument, the program will write chosen bit planes of a PNG out as 1 bit
+    grayscale PNGs
+*/
+#define BITPLANES_TEXT "BITPLANES"
+
+/**
+    Bit plane images are compressed at this zlib level. The planes worth looking
+    at are mostly noise and barely compress at any level.
+*/
+#define BITPLANE_COMPRESSION_LEVEL Z_BEST_SPEED
+
+/**
+    If the user enters a variation of this word as the third command line
+    argument, the program will compare a PNG with a copy that may have had data
+    hidden in it
+*/
+#define DIFF_TEXT "DIFF"
+
+/**
+    Diff decodes both images this many rows at a time.
+*/
+#define DIFF_BLOCK_ROWS 64
+
+/**
+    Diff lists at most this many runs of changed rows.
+*/
+#define DIFF_MAX_RANGES 16
+
+/**
+    If the user enters a variation of this word as the first command line
+    argument, the program will listen on a Unix socket for embed and extract requests
+*/
+#define SERVE_TEXT "SERVE"
+
+/**
+    If the user enters a variation of this word as the first command line
+    argument, the program will embed into or extract from a list of PNGs
+*/
+#define BATCH_TEXT "BATCH"
+
+/**
+    If the user enters a variation of this word as the first command line
+    argument, the program will process PNGs as they arrive in a directory
+*/
+#define WATCH_TEXT "WATCH"
+
+/**
+    If the user enters a variation of this word as the first command line
+    argument, the program will check a list of PNGs for an embedded message
+*/
+#define PROBE_TEXT "PROBE"
+
+/**
+    If the user enters a variation of this word as the first command line
+    argument, the program will estimate from a sample of rows whether each of a
+    list of PNGs has LSB embedding
+*/
+#define TRIAGE_TEXT "TRIAGE"
+
+/**
+    If the user enters a variation of this word as the first command line
+    argument, the program will rank a pool of PNGs as covers for a message
+*/
+#define SELECT_TEXT "SELECT"
+
+/**
+    If the first argument is this, pngstego predicts what embedding a message into
+    each listed PNG would cost, from headers alone.
+*/
+#define PLAN_TEXT "PLAN"
+
+/**
+    If the first argument is this, pngstego times each step of embedding into and
+    extracting from each listed PNG. If the next is BENCH_CORPUS_TEXT, it writes the
+    synthetic covers to time instead.
+*/
+#define BENCH_TEXT "BENCH"
+#define BENCH_CORPUS_TEXT "CORPUS"
+
+/**
+    If any argument after the message filename is this, embed prints the mean
+    squared error and PSNR between the original and modified image, and the SSIM
+    too if the argument is QUALITY_REPORT_SSIM_FLAG.
+*/
+#define QUALITY_REPORT_FLAG "--quality-report"
+#define QUALITY_REPORT_SSIM_FLAG "--quality-report=ssim"
+
+/**
+    If any argument after the message filename is this, embed encodes the image in
+    memory and reads the message back out of it before writing it to disk.
+*/
+#define VERIFY_FLAG "--verify"
+
+/**
+    If any argument after the message filename is this, embed places its changes
+    to keep the output file small, and compresses it as hard as zlib can.
+*/
+#define COMPACT_FLAG "--compact"
+
+/**
+    If any argument after the message or output filename is this, embed and extract
+    time each phase and write the counts as a line of JSON to stderr, or to the
+    filename after a colon.
+*/
+#define STATS_FLAG "--stats=json"
+
+/**
+    These are the phases of an embed or extract that the stats are kept for. IO is
+    taken out of whichever phase it happens in.
+*/
+#define STATS_PHASE_OTHER 0
+#define STATS_PHASE_HEADER 1
+#define STATS_PHASE_INFLATE 2
+#define STATS_PHASE_EMBED 3
+#define STATS_PHASE_EXTRACT 4
+#define STATS_PHASE_DEFLATE 5
+#define STATS_PHASE_VERIFY 6
+#define STATS_PHASE_IO 7
+#define STATS_PHASE_COUNT 8
+
+/**
+    If any argument after the message or output filename is this, the stats also
+    count hardware events in each phase through perf_event_open(). It turns the
+    stats on by itself. There are this many counters: cycles, instructions, last
+    level cache misses, branch misses and data TLB read misses.
+*/
+#define PERF_COUNTERS_FLAG "--perf-counters"
+#define PERF_COUNTER_COUNT 5
+
+/**
+    If any argument after the message or output filename is this, the stats also
+    count the memory libpng, zlib and this program allocate, by phase and by
+    component. It turns the stats on by itself.
+*/
+#define ALLOC_STATS_FLAG "--alloc-stats"
+
+/**
+    If any argument after the message or output filename starts with this, the
+    allocations are counted as for ALLOC_STATS_FLAG, and the run fails if more bytes
+    than the number after the equals sign were ever allocated at once.
+*/
+#define ALLOC_BUDGET_FLAG "--alloc-budget="
+
+/**
+    These are the components allocations are charged to: libpng's own structs and
+    buffers, the zlib streams libpng runs, the decoded image rows, and this
+    program's own buffers.
+*/
+#define ALLOC_COMPONENT_LIBPNG 0
+#define ALLOC_COMPONENT_ZLIB 1
+#define ALLOC_COMPONENT_ROWS 2
+#define ALLOC_COMPONENT_BUFFERS 3
+#define ALLOC_COMPONENT_COUNT 4
+
+/**
+    libpng hands zlib its own allocator, so zlib's allocations are told apart from
+    libpng's by looking this many calls up the stack for zlib.
+*/
+#define ALLOC_BACKTRACE_DEPTH 8
+
+/**
+    Compact embedding chooses a placement strategy for each band of this many rows.
+*/
+#define COMPACT_BAND_ROWS 16
+
+/**
+    This is the number of compact placement strategies: plain flips, and steps
+    towards each of the four predictors PNG filters use.
+*/
+#define COMPACT_STRATEGY_COUNT 5
+
+/**
+    SSIM is averaged over non-overlapping windows of this many samples square.
+*/
+#define SSIM_WINDOW_SIZE 8
+
 /**
     The program builds the filename for the modified PNG programatically.
     This is the maximum filename length for that file.
@@ -65,422 +304,7807 @@
 #define BYTE_SIZE 8
 
 /**
-    This is an array of pointers to all the rows of the image. It is used to
-    traverse the image in the embed and extract functions.
+    When embedding into an in-memory carrier, the output buffer is pre-sized to the
+    carrier's length plus this fraction of it (as a divisor). LSB noise makes the
+    re-encoded image slightly larger than the original, so this avoids regrowing the
+    buffer while libpng writes.
 */
-png_bytep* row_pointers;
+#define OUTPUT_SLACK_DIVISOR 8
 
 /**
-    This struct stores the metadata from the PNG.
+    This is the most file descriptors a serve client can pass with one request
+    (carrier, message and output for EMBED_FD).
 */
-png_infop info_ptr;
+#define MAX_PASSED_FDS 3
 
 /**
-    This struct stores data related to the reading of the image. It is used
-    to access properties like the width and height of the image.
+    This struct is a growable byte buffer. It is used to hold PNG data or an
+    extracted message in memory instead of in a file. If mapped is set, the bytes
+    live in a shared mapping of the memfd in fd, which grows with ftruncate(),
+    so the PNG is written straight into memory the client can see.
 */
-png_structp read_ptr;
+typedef struct memory_buffer {
+    png_bytep data;
+    size_t length;
+    size_t capacity;
+    bool mapped;
+    int fd;
+} memory_buffer;
 
 /**
-    This struct stores data related to writing to a PNG.
+    This is how many accepted connections can wait for a free worker thread before
+    the serve loop stops accepting more.
 */
-png_structp write_ptr;
+#define SERVE_QUEUE_LENGTH 64
 
 /**
-    This is the name of the original PNG image, provided on the command line,
-    that the user's message will be embedded into.
+    This is the most bytes a serve request can ask a worker to receive for one
+    carrier or payload. Larger requests are refused before anything is reserved.
 */
-const char* PNG_filename;
+#define SERVE_MAX_REQUEST_LENGTH ((size_t)512 * 1024 * 1024)
 
 /**
-    This is the name, provided on the command line, of the file that the extracted
-    message will be written to.
+    This is the longest request line, including the file paths in it, that the serve
+    loop will accept.
 */
-const char* output_filename;
+#define REQUEST_LINE_MAX_LENGTH 4096
 
 /**
-    This is a file pointer for the above output_filename file.
+    Worker threads keep their buffers between requests so a warm worker doesn't
+    allocate. A buffer that grew past this many bytes for one large image is
+    released afterwards instead of being held forever.
 */
-FILE* output_fp;
+#define WORKER_BUFFER_RETAIN_LIMIT (64 * 1024 * 1024)
 
 /**
-    This value is provided on the command line and is either EMBED_TEXT or
-    EXTRACT_TEXT. It is used to decide whether to extract or embed data.
+    The serve loop receives streamed carriers in chunks of this many bytes and feeds
+    each chunk to the progressive decoder as it arrives.
 */
-const char* method;
+#define STREAM_CHUNK_LENGTH (64 * 1024)
 
 /**
-    This is the filename of the file containing the message to embed in the provided
-    PNG image. This is provided on the command line.
+    In batch mode, this is how many images beyond the ones being worked on are
+    read ahead, so the workers never wait for IO.
 */
-const char* message_filename;
+#define BATCH_PREFETCH_DEPTH 8
 
 /**
-    This is a file pointer to the above message file.
-    ------------------------------------------------------------------------------
-    WARNING: Non-ASCII values in the message are not supported and will result in
-              undefined behaviour!
-    ------------------------------------------------------------------------------
+    In watch mode, a file is queued once it has gone this long without another
+    write event, so a writer that closes and reopens it isn't caught part way.
 */
-FILE* message_fp;
+#define WATCH_DEBOUNCE_MILLISECONDS 2
 
 /**
-    This is the length, in characters (bytes), of the message contained in the
-    provided message file.
+    This is the size of the buffer inotify events are read into.
 */
-size_t message_length;
+#define WATCH_EVENT_BUFFER_LENGTH 4096
 
 /**
-    This is the space, in bytes, available in the image for embedding. This program
-    uses the LSB method, so only one bit in each byte is being used.
+    If the first argument after batch or watch starts with this, every thread of the
+    batch engine records when each stage of each image begins and ends, and the
+    timeline is written as trace-event JSON to the filename after the equals sign.
 */
-int available_space;
+#define TRACE_FLAG "--trace="
 
 /**
-    This is the filename of the modified PNG file. This program will write the modified
-    data to this file when it is done embedding the message.
+    Each thread keeps its trace events in a ring of this many. Once it wraps, the
+    oldest events are dropped.
 */
-char* PNG_output_filename;
+#define TRACE_BUFFER_EVENTS 65536
 
 /**
-    This function opens the provided PNG image and performs prelimiary checks.
-    It reads the header, initializes IO and data structures, then reads the entire
-    image into memory.
+    These are the trace-event phases that are recorded: the beginning and end of a
+    span on one thread, and of an async span, such as a job waiting in a queue or its
+    IO in flight, which can begin on one thread and end on another.
 */
-void open_png_file(const char* PNG_filename);
+#define TRACE_BEGIN 'B'
+#define TRACE_END 'E'
+#define TRACE_ASYNC_BEGIN 'b'
+#define TRACE_ASYNC_END 'e'
 
 /**
-    This function modifies the least significant bit of each byte of the provided
-    image to hide a provided message. The first BITS_NEEDED_TO_STORE_MESSAGE_LENGTH are
-    reserved for holding the size of the message. This function modifies the minimum
-    number of bytes to embed the message, the rest are left alone.
+    When probing, this is how many message bytes are extracted to judge whether the
+    message looks like text.
 */
-void embed_data();
+#define PROBE_SAMPLE_LENGTH 64
 
 /**
-    This function combines the least significant bits of each byte of the provided
-    image and writes them to the provided output file. It first reads the first
-    BITS_NEEDED_TO_STORE_MESSAGE_LENGTH to see how many bytes to extract, then
-    extracts them. It stops when the specified number of bytes are read, and does
-    not interact with the rest of the image.
+    When probing, files are read in chunks of this many bytes. Only the first rows
+    are needed, so this is kept small.
 */
-void extract_data();
+#define PROBE_CHUNK_LENGTH 8192
 
 /**
-    This function writes the modified PNG data to a new file to keep it independent
-    from the original. This is done once all the embedding is finished.
+    Worker threads format errno into a buffer this long with strerror_r(), since
+    strerror() isn't thread safe.
 */
-void output_embedded_png();
+#define ERROR_REASON_LENGTH 128
 
 /**
-    This function calculates the number of bits that the user can embed within
-    the provided image.
+    When scanning, this is how many bytes each layout extracts to be scored.
 */
-void calculate_available_space(png_structp read_ptr, png_infop info_ptr);
+#define SCAN_SAMPLE_LENGTH 256
 
 /**
-    This function compares the provided message length with the amount of available
-    space. If there is not enough space, the user will be prompted to either
-    chop off the end of the message or exit the program.
+    This is the most layouts a scan can try: the program's own layout, plus
+    8 bit planes, 6 channel sets, 2 bit orders and 2 traversals.
 */
-bool check_message_size();
+#define MAX_SCAN_LAYOUTS (1 + BYTE_SIZE * 6 * 2 * 2)
 
 /**
-    This function frees up the data structures that were made and exits the program.
+    The per-channel plane buffer has this many spare bytes, so the vector kernels
+    can read one past the end of a row.
 */
-void exit_cleanly();
+#define ANALYSIS_PLANE_PADDING 16
 
 /**
-    This function pulls in the arguments from the command line, then decides whether
-    to embed or extract data using the provided image.
+    Analyze worker threads claim rows in chunks of this many.
 */
-int main(int argc, char* argv[]){
+#define ANALYSIS_ROW_CHUNK 32
 
-    //Check number of command line arguments
-    if(argc < 4){
-        fprintf(stderr, "Usage: \t$ ./pngstego filename.png embed message_filename\n"
-                        "\t$ ./pngstego filename.png extract output_filename\n");
-        exit_cleanly();
-    }
+/**
+    Analyze splits the image into at most this many bands of rows, since every
+    thread keeps statistics for each band of each channel.
+*/
+#define ANALYSIS_MAX_REGIONS 256
 
-    //Get the PNG filename from the command line
-    PNG_filename = argv[1];
+/**
+    Triage reads at least this many samples from the top of each image, in whole
+    rows, and decodes no further.
+*/
+#define TRIAGE_SAMPLE_LENGTH (1 << 16)
 
-    //Uncompress and unfilter the PNG
-    open_png_file(PNG_filename);
+/**
+    Triage deals its sample out to this many blocks, a run of samples from one
+    channel at a time, and estimates the embedding rate in each to put bounds on
+    the estimate for the whole sample.
+*/
+#define TRIAGE_BLOCK_COUNT 16
 
-    //Get the method being requested (embed or extract)
-    method = argv[2];
+/**
+    Triage flags an image for full analysis when the upper bound of its estimated
+    embedding rate reaches TRIAGE_FLAG_RATE, or the chi-square attack's probability
+    of embedding reaches TRIAGE_FLAG_PROBABILITY.
+*/
+#define TRIAGE_FLAG_RATE 0.25
+#define TRIAGE_FLAG_PROBABILITY 0.95
 
-    //If embed, embed the message from the provided file into the PNG
-    if(strncasecmp(method, EMBED_TEXT, strlen(EMBED_TEXT)) == 0){
+/**
+    If select's first argument is this, each cover's texture is measured from a
+    sample of SELECT_TEXTURE_SAMPLE_LENGTH samples from its first rows.
+*/
+#define SELECT_TEXTURE_FLAG "--texture"
+#define SELECT_TEXTURE_SAMPLE_LENGTH (1 << 16)
 
-        //Calculate the amount of data able to be embedded
-        calculate_available_space(read_ptr, info_ptr);
+/**
+    Select ranks a cover below the rest if the message would fill more than
+    SELECT_MAX_FILL of its capacity, or if its texture, the mean difference between
+    neighbouring samples, is below SELECT_MIN_TEXTURE. LSB noise stands out in both.
+*/
+#define SELECT_MAX_FILL 0.5
+#define SELECT_MIN_TEXTURE 2.0
 
-        //Open the file containing the message to embed
-        message_filename = argv[3];
-        message_fp = fopen(message_filename, "rb");
-        if(message_fp == NULL){
-            fprintf(stderr, "Error opening message file(): %s\n", strerror(errno));
-            exit_cleanly();
-        }
+/**
+    Select puts covers in size classes, each this many times the decoded size of
+    the one below. Covers in the same class cost about the same to embed into, so
+    they are ranked by how noisy they are rather than by the last byte of size.
+*/
+#define SELECT_SIZE_CLASS_RATIO 2.0
 
-        if(check_message_size()){
-            //Create the output png's filename
-            char temp[FILENAME_MAX_LENGTH] = "embedded_";
-            strcat(temp, PNG_filename);
-            PNG_output_filename = temp;
-            embed_data();
-        }else{
-            exit_cleanly();
-        }
-    }
-    //If extract, extract the message from the PNG image and write it to a file.
-    else if(strncasecmp(method, EXTRACT_TEXT, strlen(EXTRACT_TEXT)) == 0){
-        output_filename = argv[3];
-        output_fp = fopen(output_filename, "wb");
-        if(output_fp == NULL){
-            fprintf(stderr, "Error opening output file(): %s\n", strerror(errno));
-            exit_cleanly();
-        }
+/**
+    Select lists this many of the best covers.
+*/
+#define SELECT_TOP_COUNT 10
 
-        extract_data();
-    }
+/**
+    The plan throughput model is calibrated on two synthetic images of this size,
+    timing each step this many times and keeping the fastest.
+*/
+#define PLAN_CALIBRATION_WIDTH 1024
+#define PLAN_CALIBRATION_HEIGHT 512
+#define PLAN_CALIBRATION_RUNS 3
 
-    return 0;
-}
+/**
+    Plan counts this many rows for libpng's row and filter buffers while encoding,
+    and this many bytes for zlib's deflate state at its default settings.
+*/
+#define PLAN_FILTER_ROWS 6
+#define PLAN_CODEC_MEMORY (256 * 1024)
 
-void open_png_file(const char* PNG_filename){
-    FILE* PNG_file;
-    unsigned char header[BYTE_SIZE];
+/**
+    The bench corpus holds covers up to this many megapixels unless told otherwise.
+    There are this many kinds of content: noise, gradient, flat and photo-like.
+*/
+#define BENCH_DEFAULT_MEGAPIXELS 200
+#define BENCH_CONTENT_COUNT 4
 
-    //Open the file
-    PNG_file = fopen(PNG_filename, "rb");
-    if(PNG_file == NULL){
-        fprintf(stderr, "Error in open_png_file(): %s\n", strerror(errno));
-        exit_cleanly();
-    }
+/**
+    This seeds the bench corpus and payloads, so every run times the same bytes.
+*/
+#define BENCH_SEED 0x9E3779B97F4A7C15ULL
 
-    //Start reading the file
-    fread(header, 1, HEADER_LENGTH, PNG_file);
+/**
+    A bench cover is written under its name with this added, then renamed into place.
+*/
+#define BENCH_PARTIAL_SUFFIX ".partial"
 
-    //Check if the file is actually a PNG
-    if(png_sig_cmp(header, 0, HEADER_LENGTH)){
-        fprintf(stderr, "Error in open_png_file(): File is not a .PNG."
-                        " Only .PNG files are supported\n");
-        exit_cleanly();
-    }
+/**
+    Each bench process writes its embedded image to a new file made from this
+    mkstemps() template, and reports back a table row of at most this length.
+*/
+#define BENCH_SCRATCH_TEMPLATE "/tmp/pngstego_bench_XXXXXX.png"
+#define BENCH_ROW_MAX_LENGTH 1024
 
-    //Initialize data structures
-    //  Nulls are for optional custom error handlers. I am using the defaults.
-    read_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if(read_ptr == NULL){
-        fprintf(stderr, "Error in open_png_file(): png_create_read_struct() returned NULL\n");
-        exit_cleanly();
-    }
+/**
+    This struct holds the STATS_FLAG counts. wall and cpu are seconds spent in each
+    phase, phase is the one running now and phase_wall and phase_cpu when it began.
+    kernel names the function that did the embedding or extraction. counters are
+    the PERF_COUNTERS_FLAG events in each phase, and phase_counters their values
+    when it began.
+*/
+typedef struct run_stats {
+    double wall[STATS_PHASE_COUNT];
+    double cpu[STATS_PHASE_COUNT];
+    int phase;
+    double phase_wall;
+    double phase_cpu;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t rows_decoded;
+    uint64_t rows_total;
+    const char* kernel;
+    uint64_t counters[STATS_PHASE_COUNT][PERF_COUNTER_COUNT];
+    uint64_t phase_counters[PERF_COUNTER_COUNT];
+} run_stats;
+
+/**
+    This struct holds the ALLOC_STATS_FLAG counts for the whole run, a component or
+    a phase: the bytes live now and at most, and how many allocations were made,
+    their total bytes and the largest. An allocation can outlive its phase, so for
+    a phase live isn't kept and peak is the most the whole run had live during it.
+*/
+typedef struct alloc_usage {
+    uint64_t live;
+    uint64_t peak;
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t largest;
+} alloc_usage;
+
+/**
+    This is put in front of every allocation account_png_malloc() makes, so
+    account_png_free() knows its size and component. The union keeps what follows
+    it aligned for any type.
+*/
+typedef union alloc_header {
+    struct {
+        size_t size;
+        int component;
+    } block;
+    max_align_t align;
+} alloc_header;
+
+/**
+    This struct tracks how much of an in-memory PNG libpng has consumed. It is
+    handed to libpng through png_set_read_fn().
+*/
+typedef struct memory_source {
+    const png_byte* data;
+    size_t length;
+    size_t offset;
+} memory_source;
+
+/**
+    This is an array of pointers to all the rows of the image. It is used to
+    traverse the image in the embed and extract functions.
+*/
+png_bytep* row_pointers;
+
+/**
+    This struct stores the metadata from the PNG.
+*/
+png_infop info_ptr;
+
+/**
+    This struct stores data related to the reading of the image. It is used
+    to access properties like the width and height of the image.
+*/
+png_structp read_ptr;
+
+/**
+    This struct stores data related to writing to a PNG.
+*/
+png_structp write_ptr;
+
+/**
+    This struct carries extraction from one row to the next, so rows can be handed
+    over one at a time as they are decoded.
+*/
+typedef struct extract_state {
+    int width;
+    int height;
+    int row;
+    bool length_known;
+    size_t length;
+    size_t end_position;
+    bool done;
+} extract_state;
+
+/**
+    This struct is a push-mode extractor. PNG bytes are fed to it as they arrive and
+    libpng's progressive reader hands each decoded row to extract_row(), so no full
+    image is ever held and no thread blocks waiting on input. If stream is set, the
+    bytes from each row are written to it and dropped from output right away, and
+    streamed counts them.
+*/
+typedef struct progressive_extractor {
+    png_structp png_ptr;
+    png_infop info_ptr;
+    extract_state state;
+    memory_buffer* output;
+    FILE* stream;
+    bool flush_rows;
+    size_t streamed;
+    bool interlaced;
+    bool failed;
+} progressive_extractor;
+
+/**
+    This struct holds the buffers a serve worker thread reuses from one request
+    to the next. client_fd is the connection it is serving, or -1, and is only
+    changed under the pending_connections lock.
+*/
+typedef struct worker_state {
+    pthread_t thread;
+    int client_fd;
+    memory_buffer carrier;
+    memory_buffer payload;
+    memory_buffer output;
+} worker_state;
+
+/**
+    This struct buffers the bytes read from a serve connection. Requests are read
+    with recvmsg() so that file descriptors passed with SCM_RIGHTS can be picked up
+    alongside the request line they were sent with.
+*/
+typedef struct connection {
+    int fd;
+    char buffer[REQUEST_LINE_MAX_LENGTH];
+    size_t start;
+    size_t end;
+    int passed_fds[MAX_PASSED_FDS];
+    int passed_fd_count;
+} connection;
+
+/**
+    This struct is the queue of accepted connections waiting for a worker thread.
+*/
+typedef struct connection_queue {
+    int fds[SERVE_QUEUE_LENGTH];
+    int head;
+    int count;
+    bool closing;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} connection_queue;
+
+/**
+    These are the connections accepted by serve() and consumed by serve_worker().
+*/
+connection_queue pending_connections = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER
+};
+
+/**
+    This is set by the signal handler to make serve() stop accepting connections,
+    and run_watch() stop watching.
+*/
+volatile sig_atomic_t stop_serving;
+
+/**
+    This struct is a minimal io_uring, set up with raw system calls. Only the batch
+    IO thread submits to it and reaps from it.
+*/
+typedef struct io_ring {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_map;
+    void* cq_map;
+    size_t sq_map_length;
+    size_t cq_map_length;
+    size_t sqes_length;
+    unsigned to_submit;
+} io_ring;
+
+/**
+    This struct is one image in a batch. It is read into input by the IO thread,
+    turned into output by a worker, then written out by the IO thread.
+*/
+typedef struct batch_job {
+    char input_filename[FILENAME_MAX_LENGTH];
+    char output_filename[FILENAME_MAX_LENGTH];
+    int fd;
+    bool writing;
+    bool success;
+    size_t offset;
+    memory_buffer input;
+    memory_buffer output;
+    struct batch_job* next;
+} batch_job;
+
+/**
+    This struct is a queue of batch jobs handed between the IO thread and the workers.
+*/
+typedef struct job_queue {
+    batch_job* head;
+    batch_job* tail;
+    bool closing;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+} job_queue;
+
+/**
+    This struct holds everything shared by a batch run. Jobs wait in waiting until
+    fewer than live_limit images have been started but not finished.
+*/
+typedef struct batch_context {
+    bool embedding;
+    memory_buffer payload;
+    pthread_t* threads;
+    int thread_count;
+    job_queue waiting;
+    job_queue work;
+    job_queue done;
+    int event_fd;
+    uint64_t event_count;
+    bool use_ring;
+    io_ring ring;
+    int live;
+    int live_limit;
+    int added;
+    int finished;
+    int failed;
+} batch_context;
+
+/**
+    This struct is a file in the watched directory that is waiting out
+    WATCH_DEBOUNCE_MILLISECONDS before being queued.
+*/
+typedef struct watched_file {
+    char filename[FILENAME_MAX_LENGTH];
+    long due;
+    struct watched_file* next;
+} watched_file;
+
+/**
+    This struct is one trace event. name is always a string literal, and id tells
+    apart async spans with the same name, or is NULL. timestamp is in nanoseconds on
+    the monotonic clock.
+*/
+typedef struct trace_event {
+    const char* name;
+    const void* id;
+    uint64_t timestamp;
+    char phase;
+} trace_event;
+
+/**
+    This struct is one thread's ring of trace events. count is how many have been
+    recorded, so the ring has wrapped once it passes TRACE_BUFFER_EVENTS.
+*/
+typedef struct trace_buffer {
+    trace_event events[TRACE_BUFFER_EVENTS];
+    uint64_t count;
+    pid_t tid;
+    struct trace_buffer* next;
+} trace_buffer;
+
+/**
+    This struct is what probe_file() found out about one file. reason says why the
+    file is not plausible, or is NULL if it is, and may point into error.
+*/
+typedef struct probe_result {
+    bool decoded;
+    int width;
+    int height;
+    size_t capacity;
+    size_t length;
+    size_t sample_length;
+    double printable_ratio;
+    bool plausible;
+    const char* reason;
+    char error[ERROR_REASON_LENGTH];
+} probe_result;
+
+/**
+    This struct is shared by the probe worker threads. next is the index of the
+    next file to probe.
+*/
+typedef struct probe_context {
+    char** filenames;
+    int count;
+    int next;
+    int plausible;
+    pthread_mutex_t output_lock;
+} probe_context;
+
+/**
+    This struct is one way another tool might have hidden bits in an image: one bit
+    plane of the listed channels, packed most or least significant bit first, read
+    across rows or down columns. native is this program's own layout, which has a
+    length field. The rest is filled in by score_scan_sample().
+*/
+typedef struct scan_layout {
+    char name[32];
+    bool native;
+    int channels[4];
+    int channel_count;
+    int bit;
+    bool msb_first;
+    bool column_major;
+    double score;
+    double printable_ratio;
+    double entropy;
+    const char* magic;
+} scan_layout;
+
+/**
+    This struct is shared by the scan worker threads. next is the index of the
+    next layout to score.
+*/
+typedef struct scan_context {
+    scan_layout* layouts;
+    int count;
+    int next;
+    png_bytep* rows;
+    int width;
+    int height;
+    int channels;
+} scan_context;
+
+/**
+    This struct holds the counts behind the steganalysis of one channel of one
+    region. The histogram is kept four ways for speed and summed when read. The
+    spa_ fields count sample pairs for sample pair analysis, and rs_regular and
+    rs_singular count RS groups, indexed by whether every LSB was flipped and then
+    by the sign of the mask.
+*/
+typedef struct channel_statistics {
+    uint64_t histogram[4][256];
+    uint64_t spa_x;
+    uint64_t spa_y;
+    uint64_t spa_k;
+    uint64_t spa_pairs;
+    uint64_t rs_groups;
+    uint64_t rs_regular[2][2];
+    uint64_t rs_singular[2][2];
+} channel_statistics;
+
+/**
+    This struct is shared by the analyze worker threads. Each thread claims
+    ANALYSIS_ROW_CHUNK rows at a time from next_row, counts them into its own
+    statistics, and adds those into statistics under lock when the rows run out.
+    A thread that can't allocate its own sets failed under lock and stops.
+*/
+typedef struct analyze_context {
+    png_bytep* rows;
+    int width;
+    int height;
+    int channels;
+    int region_count;
+    int next_row;
+    bool failed;
+    channel_statistics* statistics;
+    pthread_mutex_t lock;
+} analyze_context;
+
+/**
+    This struct is one bit plane to export: bit of channel, named like r0.
+*/
+typedef struct bitplane {
+    int channel;
+    int bit;
+    char name[4];
+} bitplane;
+
+/**
+    This struct is shared by the bit plane worker threads. next is the index of the
+    next plane to write.
+*/
+typedef struct bitplane_context {
+    bitplane* planes;
+    int count;
+    int next;
+    png_bytep* rows;
+    int width;
+    int height;
+    int channels;
+    pthread_mutex_t output_lock;
+} bitplane_context;
+
+/**
+    This struct is one of the two images being compared by diff_png(), decoded
+    row_count rows at a time into rows. If either image is interlaced both are
+    read whole.
+*/
+typedef struct diff_reader {
+    const char* filename;
+    FILE* fp;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_uint_32 width;
+    png_uint_32 height;
+    int bit_depth;
+    int color_type;
+    bool interlaced;
+    size_t row_bytes;
+    png_bytep data;
+    png_bytep* rows;
+    int row_count;
+    bool failed;
+} diff_reader;
+
+/**
+    This struct is what diff_png() has found so far. Samples are numbered from the
+    start of the image in bytes. bit_changes counts the changes in each bit, and
+    ranges holds the first DIFF_MAX_RANGES runs of changed rows, range_start being
+    the first row of a run still going.
+*/
+typedef struct diff_summary {
+    uint64_t changed;
+    uint64_t bit_changes[BYTE_SIZE];
+    int64_t first_sample;
+    int64_t last_sample;
+    int ranges[DIFF_MAX_RANGES][2];
+    int range_count;
+    int range_start;
+} diff_summary;
+
+/**
+    This struct is one triage worker's decoder for the image being triaged.
+    Decoded rows are counted into blocks, next_block being the next to deal a run
+    of samples to, until rows_wanted rows are in. Then done is set so the rest of
+    the file is never read.
+*/
+typedef struct triage_state {
+    png_structp png_ptr;
+    png_infop info_ptr;
+    int width;
+    int height;
+    int channels;
+    int rows_wanted;
+    int rows_seen;
+    int next_block;
+    bool done;
+    bool interlaced;
+    png_bytep plane;
+    channel_statistics blocks[TRIAGE_BLOCK_COUNT];
+} triage_state;
+
+/**
+    This struct is what triage_file() found out about one file. rate is the sample
+    pair analysis estimate of the embedding rate over the whole sample, and low
+    and high bound it at about 95% confidence. reason says why a file was flagged
+    without an estimate, or could not be triaged, and may point into error.
+*/
+typedef struct triage_result {
+    bool decoded;
+    int width;
+    int height;
+    int rows;
+    double rate;
+    double low;
+    double high;
+    double chi_square;
+    bool flagged;
+    const char* reason;
+    char error[ERROR_REASON_LENGTH];
+} triage_result;
+
+/**
+    This struct is shared by the triage worker threads. next is the index of the
+    next file to triage, and unreadable counts the flagged files that couldn't be
+    opened or decoded at all.
+*/
+typedef struct triage_context {
+    char** filenames;
+    int count;
+    int next;
+    int flagged;
+    int unreadable;
+    pthread_mutex_t output_lock;
+} triage_context;
+
+/**
+    This struct is what evaluate_cover() found out about one cover. fill is the
+    fraction of its capacity the message would use, hint is the file size over
+    raw_bytes, the size of its decoded pixels, and texture is -1 if it wasn't
+    measured. reason says why the cover is not usable, unless error holds the errno
+    it couldn't be opened with, which is formatted once the worker threads are done
+    since the candidates are sorted and strerror() isn't thread safe.
+*/
+typedef struct cover_candidate {
+    const char* filename;
+    bool usable;
+    const char* reason;
+    int error;
+    int width;
+    int height;
+    int channels;
+    size_t capacity;
+    uint64_t raw_bytes;
+    uint64_t file_bytes;
+    bool interlaced;
+    double fill;
+    double hint;
+    double texture;
+} cover_candidate;
+
+/**
+    This struct is shared by the select worker threads. next is the index of the
+    next cover to evaluate.
+*/
+typedef struct select_context {
+    cover_candidate* candidates;
+    int count;
+    int next;
+    size_t payload_length;
+    bool with_texture;
+} select_context;
+
+/**
+    This struct is the per-host cost model plan predicts with, in seconds per byte.
+    Decoding and encoding cost some per raw pixel byte plus some per compressed byte,
+    embedding some per raw byte of the rows it touches. The ratios are how well the
+    two calibration images compressed.
+*/
+typedef struct throughput_model {
+    double decode_raw;
+    double decode_compressed;
+    double encode_raw;
+    double encode_compressed;
+    double embed;
+    double noise_ratio;
+    double smooth_ratio;
+} throughput_model;
+
+/**
+    This struct is what plan predicts for one job. The memory figures are peaks in
+    bytes for embed without and with --verify, the times are in seconds.
+*/
+typedef struct plan_estimate {
+    int rows;
+    uint64_t embed_memory;
+    uint64_t verify_memory;
+    double decode;
+    double embed;
+    double encode;
+    double extract;
+} plan_estimate;
+
+/**
+    This is the name of the original PNG image, provided on the command line,
+    that the user's message will be embedded into.
+*/
+const char* PNG_filename;
+
+/**
+    This is the name, provided on the command line, of the file that the extracted
+    message will be written to.
+*/
+const char* output_filename;
+
+/**
+    This is a file pointer for the above output_filename file.
+*/
+FILE* output_fp;
+
+/**
+    This value is provided on the command line and is either EMBED_TEXT or
+    EXTRACT_TEXT. It is used to decide whether to extract or embed data.
+*/
+const char* method;
+
+/**
+    This is the filename of the file containing the message to embed in the provided
+    PNG image. This is provided on the command line.
+*/
+const char* message_filename;
+
+/**
+    This is a file pointer to the above message file.
+    ------------------------------------------------------------------------------
+    WARNING: Non-ASCII values in the message are not supported and will result in
+              undefined behaviour!
+    ------------------------------------------------------------------------------
+*/
+FILE* message_fp;
+
+/**
+    This is the length, in characters (bytes), of the message contained in the
+    provided message file.
+*/
+size_t message_length;
+
+/**
+    This is the space, in bytes, available in the image for embedding. This program
+    uses the LSB method, so only one bit in each byte is being used.
+*/
+int available_space;
+
+/**
+    This is the filename of the modified PNG file. This program will write the modified
+    data to this file when it is done embedding the message.
+*/
+char* PNG_output_filename;
+
+/**
+    These are set by QUALITY_REPORT_FLAG and QUALITY_REPORT_SSIM_FLAG.
+*/
+bool quality_report;
+bool quality_ssim;
+
+/**
+    This is set by VERIFY_FLAG.
+*/
+bool verify_output;
+
+/**
+    This is set by COMPACT_FLAG.
+*/
+bool compact_embedding;
+
+/**
+    These are set by STATS_FLAG. stats_filename is NULL for stderr.
+*/
+bool stats_enabled;
+const char* stats_filename;
+run_stats stats;
+
+/**
+    These are set by PERF_COUNTERS_FLAG. perf_fds are the counters' file descriptors,
+    -1 where a counter couldn't be opened, and perf_counters_user_only is set if
+    only user space events could be counted. The open counters are one group led
+    by perf_group_fd, the first of them, so they are scheduled together and read at
+    once.
+*/
+bool perf_counters_enabled;
+bool perf_counters_user_only;
+int perf_fds[PERF_COUNTER_COUNT];
+int perf_group_fd = -1;
+
+/**
+    These are set by ALLOC_STATS_FLAG and ALLOC_BUDGET_FLAG. alloc_budget is 0 for
+    no budget. alloc_component is what libpng's allocations are charged to when
+    they don't come from zlib. zlib_base is where the shared object holding zlib is
+    loaded, or NULL if zlib isn't one of its own and can't be told apart.
+*/
+bool alloc_stats_enabled;
+uint64_t alloc_budget;
+int alloc_component = ALLOC_COMPONENT_LIBPNG;
+void* zlib_base;
+alloc_usage alloc_total;
+alloc_usage alloc_components[ALLOC_COMPONENT_COUNT];
+alloc_usage alloc_phases[STATS_PHASE_COUNT];
+
+/**
+    These are the names of the allocation components in the stats.
+*/
+const char* alloc_component_names[ALLOC_COMPONENT_COUNT] = {
+    "libpng", "zlib", "rows", "buffers"
+};
+
+/**
+    These are set by TRACE_FLAG. trace_start is when tracing began and trace_buffers
+    lists every thread's buffer, guarded by trace_lock. thread_trace is the calling
+    thread's own buffer, allocated when it records its first event.
+*/
+bool tracing;
+const char* trace_filename;
+uint64_t trace_start;
+trace_buffer* trace_buffers;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread trace_buffer* thread_trace;
+
+/**
+    These are the names of the perf counters in the stats.
+*/
+const char* perf_counter_names[PERF_COUNTER_COUNT] = {
+    "cycles", "instructions", "llc_misses", "branch_misses", "dtlb_misses"
+};
+
+/**
+    This function calculates how many whole message bytes fit in an image of the given
+    size, after the BITS_NEEDED_TO_STORE_MESSAGE_LENGTH bytes reserved for the length.
+*/
+size_t payload_capacity(int width, int height);
+
+/**
+    This function returns how many rows from the top embed_rows() changes to embed
+    a payload of the given length.
+*/
+int embedded_row_count(int width, int height, size_t payload_length);
+
+/**
+    This function copies the first count rows into one new allocation, to compare
+    with after they are changed. It returns NULL if there is no memory for it.
+*/
+png_bytep copy_rows(png_bytep* rows, int count, size_t row_bytes);
+
+/**
+    This function prints the mean squared error and PSNR, and the SSIM if with_ssim
+    is set, of rows against original, a copy of their first row_count rows from
+    before they were changed. The rest of the rows are known to be unchanged.
+*/
+void measure_quality(const png_byte* original, png_bytep* rows, int width, int height, int channels,
+                     int row_count, bool with_ssim);
+
+/**
+    This function returns the sum of the squared differences between two rows.
+*/
+uint64_t squared_error_row(const png_byte* a, const png_byte* b, size_t length);
+
+/**
+    This function returns the mean SSIM, over SSIM_WINDOW_SIZE square windows of
+    each channel, of rows against original. Windows that start at or below
+    row_count are unchanged and count as 1 without being read.
+*/
+double structural_similarity(const png_byte* original, png_bytep* rows, int width, int height, int channels,
+                             int row_count);
+
+/**
+    This function writes the length and then the bits of the payload into the
+    least significant bits of the given rows. It returns the number of payload
+    bytes embedded, which is less than payload_length if the image is too small.
+*/
+size_t embed_rows(png_bytep* rows, int width, int height,
+                  const png_byte* payload, size_t payload_length);
+
+/**
+    This function reads the length stored in the given rows and appends that many
+    message bytes to the output buffer. It returns false if the buffer could not grow.
+*/
+bool extract_rows(png_bytep* rows, int width, int height, memory_buffer* output);
+
+/**
+    These functions run extraction one row at a time. start_extract_state() sets
+    up state for an image of the given size, then extract_row() is called on each
+    row in order until state->done is set.
+*/
+void start_extract_state(extract_state* state, int width, int height);
+bool extract_row(extract_state* state, png_const_bytep row, memory_buffer* output);
+
+/**
+    These functions drive a progressive_extractor. Call start_progressive_extract(),
+    then feed_progressive_extract() with each chunk of the PNG as it arrives. The
+    message is complete in output once extractor->state.done is set, and any further
+    chunks are ignored. feed_progressive_extract() returns false, after printing the
+    reason, if the data can't be decoded. Interlaced images fail quietly with
+    extractor->interlaced set, so the caller can decode them whole instead. finish_progressive_extract() frees libpng's
+    structs but leaves the output buffer to the caller.
+*/
+bool start_progressive_extract(progressive_extractor* extractor, memory_buffer* output);
+bool feed_progressive_extract(progressive_extractor* extractor, const png_byte* data, size_t length);
+void finish_progressive_extract(progressive_extractor* extractor);
+
+/**
+    These are the libpng progressive reader callbacks used by the progressive_extractor.
+*/
+void progressive_info_callback(png_structp png_ptr, png_infop png_info);
+void progressive_row_callback(png_structp png_ptr, png_bytep new_row, png_uint_32 row_num, int pass);
+
+/**
+    This function embeds the payload into a PNG held in memory and writes the
+    resulting PNG into the output buffer. No files are touched. It returns false,
+    after printing the reason, if the carrier can't be decoded or encoded.
+*/
+bool embed_buffer(const png_byte* carrier, size_t carrier_length,
+                  const png_byte* payload, size_t payload_length,
+                  memory_buffer* output);
+
+/**
+    This function extracts the message from a PNG held in memory into the output
+    buffer. It returns false, after printing the reason, on failure.
+*/
+bool extract_buffer(const png_byte* carrier, size_t carrier_length, memory_buffer* output);
+
+/**
+    This function decodes an in-memory PNG into the given read and info structs.
+    It also rejects images that the embed and extract functions can't handle.
+*/
+bool decode_png_memory(png_structp png_ptr, png_infop png_info, memory_source* source);
+
+/**
+    This function encodes the rows attached to png_info into the output buffer
+    using the given write struct.
+*/
+bool encode_png_memory(png_structp png_ptr, png_infop png_info, memory_buffer* output);
+
+/**
+    These are the libpng IO callbacks used by decode_png_memory() and
+    encode_png_memory() in place of png_init_io().
+*/
+void read_memory_source(png_structp png_ptr, png_bytep data, png_size_t length);
+void write_memory_buffer(png_structp png_ptr, png_bytep data, png_size_t length);
+void flush_memory_buffer(png_structp png_ptr);
+
+/**
+    These functions manage a memory_buffer. reserve_memory_buffer() grows the
+    buffer to hold at least the requested number of bytes.
+*/
+bool reserve_memory_buffer(memory_buffer* buffer, size_t capacity);
+bool append_memory_buffer(memory_buffer* buffer, const png_byte* data, size_t length);
+void free_memory_buffer(memory_buffer* buffer);
+
+/**
+    This function opens the provided PNG image and performs prelimiary checks.
+    It reads the header, initializes IO and data structures, then reads the entire
+    image into memory.
+*/
+void open_png_file(const char* PNG_filename);
+
+/**
+    This function modifies the least significant bit of each byte of the provided
+    image to hide a provided message. The first BITS_NEEDED_TO_STORE_MESSAGE_LENGTH are
+    reserved for holding the size of the message. This function modifies the minimum
+    number of bytes to embed the message, the rest are left alone. It returns the
+    message, for output_verified_png() and then the caller to free, and sets
+    bytes_embedded.
+*/
+png_bytep embed_data(size_t* bytes_embedded);
+
+/**
+    This function combines the least significant bits of each byte of the provided
+    image and writes them to the provided output file. It first reads the first
+    BITS_NEEDED_TO_STORE_MESSAGE_LENGTH to see how many bytes to extract, then
+    extracts them. It stops when the specified number of bytes are read, and does
+    not interact with the rest of the image.
+    The image is decoded progressively and each row's bytes are written out as soon
+    as the row is decoded, so only one row is held in memory and the file is only
+    read up to the last row of the message. It returns false, after printing the
+    reason, if the image isn't a PNG or ends or fails to decode before the message
+    is out. Whatever was written by then is left for the caller to remove.
+*/
+bool extract_data();
+
+/**
+    This function writes the modified PNG data to a new file to keep it independent
+    from the original. This is done once all the embedding is finished.
+*/
+void output_embedded_png();
+
+/**
+    This function is output_embedded_png() for VERIFY_FLAG. The image is encoded
+    into memory, the message is extracted from the encoded bytes, stopping at the
+    last message row, and its CRC-32 and length are compared with the payload's.
+    The output file is only written if they match. It returns false if it wasn't.
+*/
+bool output_verified_png(const png_byte* payload, size_t payload_length);
+
+/**
+    This function extracts the message from an encoded PNG into extracted, decoding
+    no further than it has to. It returns false if the message couldn't be read.
+*/
+bool verify_embedded_png(const memory_buffer* encoded, memory_buffer* extracted);
+
+/**
+    This function reworks the first row_count rows after embed_rows(), given a copy
+    of them from before, so they compress better without changing a single LSB.
+    A changed sample can go up or down by one to get the same LSB, and each band of
+    COMPACT_BAND_ROWS rows takes whichever strategy for choosing gives the smallest
+    estimate_compressed_size(). The choices and estimates are printed.
+*/
+void compact_embedded_rows(png_bytep* rows, const png_byte* original, int width, int channels, int row_count);
+
+/**
+    This function sets each changed sample of row, compared with original, by one
+    strategy: 0 flips its LSB, and 1 to 4 step it towards the left, up, average or
+    Paeth prediction from its neighbours. above is the row above, or NULL.
+*/
+void apply_compact_strategy(png_bytep row, const png_byte* original, const png_byte* above,
+                            size_t row_bytes, int bpp, int strategy);
+
+/**
+    This function is the PNG Paeth predictor.
+*/
+int paeth_predictor(int left, int up, int upper_left);
+
+/**
+    This function estimates how many bytes deflate would need for count rows, from
+    the order-0 entropy of their residuals under the filters libpng would choose.
+    above is the row before the first, or NULL. scratch holds two rows.
+*/
+double estimate_compressed_size(png_bytep* rows, const png_byte* above, int count, size_t row_bytes, int bpp,
+                                png_bytep scratch);
+
+/**
+    This function sets the stats up from one embed or extract argument: STATS_FLAG,
+    PERF_COUNTERS_FLAG, ALLOC_STATS_FLAG or ALLOC_BUDGET_FLAG. It returns false if
+    the argument is none of them, and exits if the budget isn't a number of bytes.
+*/
+bool parse_stats_option(const char* option);
+
+/**
+    This function charges the time since the last call to the running stats phase,
+    starts phase, and returns the phase that was running. It does nothing unless
+    stats_enabled is set, so it is cheap to call on every path.
+*/
+int switch_stats_phase(int phase);
+
+/**
+    This function returns the CPU time used by the process in seconds.
+*/
+double process_cpu_seconds();
+
+/**
+    These are the libpng IO callbacks used in place of png_init_io() when stats are
+    on. They count the bytes and charge the time to STATS_PHASE_IO.
+*/
+void stats_read_data(png_structp png_ptr, png_bytep data, png_size_t length);
+void stats_write_data(png_structp png_ptr, png_bytep data, png_size_t length);
+void stats_flush_data(png_structp png_ptr);
+
+/**
+    This function opens the PERF_COUNTERS_FLAG counters for this process as one
+    group led by cycles, warning about any that can't be, and starts them from the
+    current phase.
+*/
+void open_perf_counters();
+
+/**
+    This function reads the current value of each perf counter into values, or 0
+    for counters that aren't open. Values are scaled up by the share of the time
+    the group was enabled that it actually ran, in case the kernel multiplexed it.
+*/
+void read_perf_counters(uint64_t* values);
+
+/**
+    This function writes the stats for command as a line of JSON.
+*/
+void write_stats(const char* command);
+
+/**
+    These are the libpng memory callbacks, set with png_create_read_struct_2() and
+    png_create_write_struct_2() wherever the embed and extract commands make a
+    png_struct. Unless alloc_stats_enabled is set they are plain malloc() and free().
+*/
+png_voidp account_png_malloc(png_structp png_ptr, png_alloc_size_t size);
+void account_png_free(png_structp png_ptr, png_voidp ptr);
+
+/**
+    These functions charge an allocation of size bytes to component and the running
+    stats phase, and take it off again once it is freed. They do nothing unless
+    alloc_stats_enabled is set.
+*/
+void count_allocation(int component, size_t size);
+void count_release(int component, size_t size);
+
+/**
+    This function sets zlib_base if zlib is a shared object apart from libpng and
+    this program, which is when called_from_zlib() can tell its allocations apart.
+*/
+void find_zlib_object();
+
+/**
+    This function returns true if zlib is among the callers of the calling function.
+    It is always false if find_zlib_object() couldn't find zlib.
+*/
+bool called_from_zlib();
+
+/**
+    This function writes one alloc_usage as a JSON object.
+*/
+void print_alloc_usage(FILE* fp, const alloc_usage* usage);
+
+/**
+    This function returns false, with a message, if the allocations went over the
+    ALLOC_BUDGET_FLAG budget. The caller then removes the output it wrote.
+*/
+bool check_alloc_budget();
+
+/**
+    This function calculates the number of bits that the user can embed within
+    the provided image.
+*/
+void calculate_available_space(png_structp read_ptr, png_infop info_ptr);
+
+/**
+    This function compares the provided message length with the amount of available
+    space. If there is not enough space, the user will be prompted to either
+    chop off the end of the message or exit the program.
+*/
+bool check_message_size();
+
+/**
+    This function frees up the data structures that were made and exits the program.
+*/
+void exit_cleanly();
+
+/**
+    This function runs worker on a thread per CPU, at most max_threads, all sharing
+    context, and returns once they have all finished. If no thread can be started
+    the work is done on the calling thread instead.
+*/
+void run_worker_threads(void* (*worker)(void*), void* context, int max_threads);
+
+/**
+    This function runs the chi-square attack, RS analysis and sample pair analysis
+    on each channel of the decoded image, for the whole image and for region_count
+    bands of rows, and prints a table. These detect LSB embedding by any tool, not
+    just this one. Each estimate is the fraction of samples thought to carry
+    embedded bits; the chi-square column is the probability that the image was
+    embedded into, which is near 1 for sequentially embedded regions.
+*/
+void analyze_data(int region_count);
+
+/**
+    This function is run by each analyze thread until every row is counted.
+*/
+void* analyze_worker(void* arg);
+
+/**
+    These functions add one row's plane of one channel to its statistics: the
+    histogram, the sample pairs, and the RS groups.
+*/
+void count_plane_statistics(channel_statistics* statistics, const png_byte* plane, int width);
+void count_sample_pairs(channel_statistics* statistics, const png_byte* plane, int width);
+void count_rs_group(channel_statistics* statistics, const png_byte* group);
+
+/**
+    This function adds the counts in part to total.
+*/
+void merge_channel_statistics(channel_statistics* total, const channel_statistics* part);
+
+/**
+    This function prints one line of the analyze_data() table.
+*/
+void print_channel_statistics(const char* region, int first_row, int last_row, int channel,
+                              const channel_statistics* statistics);
+
+/**
+    These functions turn a channel's counts into the chi-square attack's probability
+    of embedding, and RS and sample pair analysis estimates of the embedding rate.
+*/
+double chi_square_probability(const channel_statistics* statistics);
+double rs_embedding_rate(const channel_statistics* statistics);
+double spa_embedding_rate(const channel_statistics* statistics);
+
+/**
+    This function is the regularized lower incomplete gamma function P(a, x), which
+    gives the chi-square distribution's CDF.
+*/
+double regularized_gamma_p(double a, double x);
+
+/**
+    This function writes a copy of input_filename to output_filename with the low
+    planes bit planes of every sample randomized, or cleared if randomize is false,
+    so that nothing hidden in them survives. Rows are streamed from the decoder to
+    the encoder one at a time unless the input is interlaced. Only chunks that
+    affect how the image looks are copied, and the output is never interlaced. It
+    returns false, leaving no output behind, if the image fails to decode or encode
+    once writing has begun.
+*/
+bool sanitize_png(const char* input_filename, const char* output_filename, int planes, bool randomize);
+
+/**
+    This function frees what sanitize_png() had made for writing and removes the
+    partial output file, when it has to give up part way.
+*/
+void discard_sanitized_png(FILE* output_fp, const char* partial, png_bytep row, png_bytep* rows, png_infop* write_info);
+
+/**
+    This function copies the gamma, colour space, resolution and transparency
+    chunks from a PNG being read to one being written.
+*/
+void copy_colour_chunks(png_structp read_ptr, png_infop read_info, png_structp write_ptr, png_infop write_info);
+
+/**
+    This function replaces the bits of row set in mask, a pattern repeating every 16
+    bytes, with random bits from the two xorshift64 states in random_state, or
+    clears them if random_state is NULL.
+*/
+void sanitize_row(png_bytep row, size_t length, const png_byte* mask, uint64_t* random_state);
+
+/**
+    This function writes each bit plane of the decoded image named in spec to
+    bitplane_filename.png.r0.png and so on, one pixel per sample, white where the
+    bit is set. spec is a comma separated list of a channel and a bit (r0, a7), a
+    bit on its own for every channel (0), or all. Planes are spread over a thread
+    per CPU.
+*/
+void export_bitplanes(const char* spec);
+
+/**
+    This function fills planes with the planes spec names, in channel then bit
+    order, and returns how many. It returns 0 if spec is malformed.
+*/
+int parse_bitplane_spec(const char* spec, int channels, bitplane* planes);
+
+/**
+    This function is the body of a bit plane worker thread.
+*/
+void* bitplane_worker(void* arg);
+
+/**
+    This function writes one plane's PNG a row at a time. samples and packed are
+    the worker's scratch rows.
+*/
+void write_bitplane(bitplane_context* context, const bitplane* plane, png_bytep samples, png_bytep packed);
+
+/**
+    This function packs bit of each of width samples into packed, eight to a byte
+    with the first sample in the top bit, as 1 bit PNG rows are laid out.
+*/
+void slice_bit_plane(const png_byte* samples, int width, int bit, png_bytep packed);
+
+/**
+    This function compares a cover image with a stego copy of it, sample by sample,
+    and prints how many samples changed, which bits, and which rows. The lowest
+    changed bit plane of the stego image, from the first changed sample to the
+    last, is written to diff_stego_filename.bin, packed least significant bit
+    first. Only DIFF_BLOCK_ROWS rows of each image are held at a time, and the two
+    are decoded side by side.
+*/
+void diff_png(const char* cover_filename, const char* stego_filename);
+
+/**
+    These functions drive a diff_reader. open_diff_reader() reads the header,
+    allocate_diff_rows() makes room for a block, read_diff_block() decodes the next
+    row_count rows, setting failed if it can't, and close_diff_reader() frees it all.
+    read_diff_block() is also a thread body.
+*/
+bool open_diff_reader(diff_reader* reader, const char* filename);
+bool allocate_diff_rows(diff_reader* reader, int block_rows);
+void* read_diff_block(void* arg);
+void close_diff_reader(diff_reader* reader);
+
+/**
+    This function adds the differences between one row of each image to summary.
+    It is called once more past the last row, with NULL rows, to close any run.
+*/
+void compare_diff_row(diff_summary* summary, const png_byte* cover, const png_byte* stego, size_t length, int row);
+
+/**
+    This function adds one changed sample to summary.
+*/
+void count_diff_sample(diff_summary* summary, png_byte difference, int64_t sample);
+
+/**
+    This function writes the diff_png() bitstream from bit plane bit.
+*/
+void write_diff_bitstream(const char* stego_filename, const diff_summary* summary, int bit);
+
+/**
+    This function reads the decoded image in every layout built by
+    build_scan_layouts(), scores a sample of each, prints a ranked table, and writes
+    the top_count best layouts in full next to the image as
+    extracted_filename.png.layout.bin. The image is only decoded once.
+*/
+void scan_data(int top_count);
+
+/**
+    This function fills layouts with every layout to try for an image with the given
+    number of channels, and returns how many there are.
+*/
+int build_scan_layouts(scan_layout* layouts, int channels);
+
+/**
+    This function is the body of a scan worker thread.
+*/
+void* scan_worker(void* arg);
+
+/**
+    This function reads up to max_length bytes out of the image in the given layout.
+*/
+size_t read_scan_layout(const scan_context* context, const scan_layout* layout,
+                        png_bytep output, size_t max_length);
+
+/**
+    This function scores how likely a sample is to be hidden data rather than noise,
+    from known file signatures, how much of it is printable, and its entropy.
+*/
+void score_scan_sample(scan_layout* layout, const png_byte* sample, size_t length);
+
+/**
+    This function returns the name of the file type the sample starts with, or
+    NULL if it doesn't start with a known signature.
+*/
+const char* identify_magic(const png_byte* sample, size_t length);
+
+/**
+    This function orders layouts by descending score for qsort().
+*/
+int compare_layout_scores(const void* a, const void* b);
+
+/**
+    This function writes everything a layout holds to its output file.
+*/
+void write_scan_layout(const scan_context* context, const scan_layout* layout);
+
+/**
+    This function listens on a Unix socket at socket_path and hands each connection
+    to a pool of thread_count workers. It runs until SIGINT or SIGTERM.
+    Each connection sends one request line at a time:
+        EMBED carrier.png message output.png
+        EXTRACT carrier.png output
+        EMBED_BYTES carrier_length message_length, then the carrier and message bytes
+        EXTRACT_BYTES carrier_length, then the carrier bytes
+        EMBED_FD, passing carrier and message memfds (and optionally an output memfd)
+        EXTRACT_FD, passing a carrier memfd (and optionally an output memfd)
+    and gets back "OK length" or "ERROR reason". For the _BYTES requests the OK line
+    is followed by length bytes of PNG or message. For the _FD requests the OK line
+    carries the sealed output memfd instead.
+*/
+int serve(const char* socket_path, int thread_count);
+
+/**
+    This function is the body of a serve worker thread. It takes connections off
+    pending_connections until the queue is closed.
+*/
+void* serve_worker(void* arg);
+
+/**
+    This function answers requests on one connection until the client hangs up.
+*/
+void handle_connection(worker_state* worker, int fd);
+
+/**
+    This function answers a single request line. It returns false if the connection
+    can no longer be used.
+*/
+bool handle_request(worker_state* worker, connection* client, char* line);
+
+/**
+    This function answers EMBED_FD and EXTRACT_FD requests. The carrier (and message)
+    memfds are mapped read-only and decoded in place, and the PNG or message is
+    written into a mapping of a memfd the worker owns, which is sealed and passed
+    back. No PNG or message bytes cross the socket.
+*/
+bool handle_fd_request(connection* client, bool embedding);
+
+/**
+    This function answers EXTRACT_BYTES requests. The carrier is fed to a
+    progressive_extractor as it is received, and the reply is sent as soon as the
+    last message row is decoded. The rest of the carrier is then read and dropped.
+*/
+bool handle_streamed_extract(worker_state* worker, connection* client, size_t carrier_length);
+
+/**
+    This function maps the whole of the file descriptor read-only into buffer if it
+    is a memfd, which passed_fd_unsealed() has checked is sealed. Any other file
+    could be truncated under the mapping, so it is copied in instead.
+*/
+bool map_passed_fd(int fd, memory_buffer* buffer);
+
+/**
+    This function returns true if fd is a memfd without all of seals. A client that
+    could still shrink a mapped memfd would kill the worker with SIGBUS.
+*/
+bool passed_fd_unsealed(int fd, int seals);
+
+/**
+    This function makes buffer write into a shared mapping of a new sealable memfd.
+    A memfd the client passed is never mapped for output, since the client could
+    still shrink it under the mapping.
+*/
+bool map_output_fd(memory_buffer* buffer);
+
+/**
+    This function copies the length bytes of buffer into the client's output fd with
+    pwrite(), which fails rather than faulting if the client resizes it, and seals
+    it if it can. It returns false if the copy fails.
+*/
+bool copy_to_passed_fd(int fd, const memory_buffer* buffer);
+
+/**
+    This function trims a mapped output buffer to its length, unmaps it, and seals
+    the memfd against further changes. It returns the memfd.
+*/
+int seal_output_fd(memory_buffer* buffer);
+
+/**
+    These functions read from a serve connection. read_request_line() returns the
+    next line, without its newline. read_connection() receives more bytes into the
+    connection's buffer, collecting any passed file descriptors.
+*/
+bool read_request_line(connection* client, char** line);
+bool read_connection(connection* client);
+void close_passed_fds(connection* client);
+
+/**
+    This function sends a reply line, with passed_fd attached using SCM_RIGHTS
+    unless it is -1.
+*/
+bool send_reply(connection* client, const char* reply, int passed_fd);
+
+/**
+    This function empties the worker's buffers, releasing any that grew past
+    WORKER_BUFFER_RETAIN_LIMIT.
+*/
+void recycle_worker_buffers(worker_state* worker);
+
+/**
+    These functions move a whole file or a counted run of bytes into or out of a
+    memory_buffer. They return false on any IO error.
+*/
+bool read_file_into_buffer(const char* filename, memory_buffer* buffer);
+bool write_buffer_to_file(const char* filename, const memory_buffer* buffer);
+bool read_exact(connection* client, memory_buffer* buffer, size_t length);
+bool write_all(int fd, const void* data, size_t length);
+
+/**
+    This function is the SIGINT and SIGTERM handler for serve() and run_watch().
+*/
+void handle_stop_signal(int signal_number);
+
+/**
+    This function embeds one message into, or extracts from, every PNG listed on the
+    command line. argv starts at the method. The calling thread does all the file IO
+    through an io_uring, reading up to BATCH_PREFETCH_DEPTH images ahead, while a
+    worker per CPU embeds or extracts in memory. Outputs are written next to each
+    input as embedded_filename.png or extracted_filename.png.txt. If io_uring is
+    unavailable the same thread does blocking IO instead.
+*/
+int run_batch(int argc, char* argv[]);
+
+/**
+    These functions run the batch engine for run_batch() and run_watch().
+    start_batch() starts the workers and the ring, add_batch_job() queues an image,
+    and stop_batch() waits for the workers and frees everything. wait_for_batch()
+    starts queued images, waits for IO or workers (and for watch_fd to be readable,
+    up to timeout milliseconds, if it isn't -1), and moves finished images along.
+    It returns true if watch_fd is readable.
+*/
+bool start_batch(batch_context* context);
+void stop_batch(batch_context* context);
+void add_batch_job(batch_context* context, const char* filename);
+bool wait_for_batch(batch_context* context, int watch_fd, int timeout);
+
+/**
+    This function watches a directory with inotify and embeds into, or extracts
+    from, each PNG written or moved into it, using the batch engine. argv starts
+    at the directory. It runs until SIGINT or SIGTERM.
+*/
+int run_watch(int argc, char* argv[]);
+
+/**
+    This function decides whether a file in the watched directory should be
+    processed. Our own embedded_ outputs are skipped.
+*/
+bool is_watched_png(const char* name, bool embedding);
+
+/**
+    This function adds a file to the pending list, or restarts its wait if it is
+    already there. It returns the new head of the list.
+*/
+watched_file* debounce_watched_file(watched_file* pending, const char* directory, const char* name);
+
+/**
+    This function returns the time in milliseconds on the monotonic clock.
+*/
+long monotonic_milliseconds();
+
+/**
+    This function is the body of a batch worker thread. It only ever sees images
+    that are already in memory.
+*/
+void* batch_worker(void* arg);
+
+/**
+    These functions move a batch job through its IO. start_batch_read() and
+    start_batch_write() open the file and queue the transfer, or do it on the spot
+    without a ring. continue_batch_io() handles a completion, resubmitting short
+    transfers. drain_batch_done() starts writes for the images the workers finished,
+    and finish_batch_job() reports and releases a job.
+*/
+void start_batch_read(batch_context* context, batch_job* job);
+void start_batch_write(batch_context* context, batch_job* job);
+void queue_batch_io(batch_context* context, batch_job* job);
+void continue_batch_io(batch_context* context, batch_job* job, int result);
+void drain_batch_done(batch_context* context);
+void finish_batch_job(batch_context* context, batch_job* job, bool success);
+
+/**
+    This function queues a read of the batch eventfd on the ring, so the IO thread
+    wakes up when a worker finishes an image.
+*/
+void arm_batch_event(batch_context* context);
+
+/**
+    These functions add to and take from a job_queue. pop_batch_job() returns NULL
+    if the queue is empty and wait is false, or once the queue is closed.
+*/
+void push_batch_job(job_queue* queue, batch_job* job);
+batch_job* pop_batch_job(job_queue* queue, bool wait);
+
+/**
+    This function turns on tracing for TRACE_FLAG, to be written to filename.
+*/
+void start_trace(const char* filename);
+
+/**
+    This function records a trace event on the calling thread. id is NULL except for
+    the async phases. It does nothing unless tracing is set, so with tracing off
+    each call costs one well predicted branch.
+*/
+void record_trace_event(char phase, const char* name, const void* id);
+
+/**
+    This function writes every thread's trace events to trace_filename as trace-event
+    JSON, which chrome://tracing and Perfetto can open, and frees the buffers. The
+    traced threads must have stopped. It returns false if the file couldn't be written.
+*/
+bool write_trace();
+
+/**
+    This function returns the time in nanoseconds on the monotonic clock.
+*/
+uint64_t monotonic_nanoseconds();
+
+/**
+    This function checks each PNG listed on the command line for a message embedded
+    by this program and prints one JSON object per file to stdout. argv starts at
+    the first file. Files are spread over a thread per CPU.
+*/
+int run_probe(int argc, char* argv[]);
+
+/**
+    This function is the body of a probe worker thread.
+*/
+void* probe_worker(void* arg);
+
+/**
+    This function decodes only the rows of filename needed to read the stored length
+    and the first PROBE_SAMPLE_LENGTH message bytes, then checks that the length is
+    one this program could have written. chunk is PROBE_CHUNK_LENGTH bytes of scratch.
+*/
+void probe_file(const char* filename, png_bytep chunk, probe_result* result);
+
+/**
+    This function returns true once probe_file() has decoded enough rows.
+*/
+bool probe_sample_complete(const extract_state* state, const memory_buffer* sample);
+
+/**
+    This function estimates, for each PNG listed on the command line, whether it
+    has LSB embedding, from a sample of its first rows, and prints one JSON object
+    per file to stdout. Flagged files are worth a full analyze. argv starts at the
+    first file. Files are spread over a thread per CPU.
+*/
+int run_triage(int argc, char* argv[]);
+
+/**
+    This function is the body of a triage worker thread.
+*/
+void* triage_worker(void* arg);
+
+/**
+    This function decodes the first rows of filename, at least TRIAGE_SAMPLE_LENGTH
+    samples' worth, and fills in result from their statistics. chunk is
+    PROBE_CHUNK_LENGTH bytes of scratch and state is the worker's decoder.
+*/
+void triage_file(const char* filename, png_bytep chunk, triage_state* state, triage_result* result);
+
+/**
+    These are the libpng progressive reader callbacks used by triage_file().
+*/
+void triage_info_callback(png_structp png_ptr, png_infop png_info);
+void triage_row_callback(png_structp png_ptr, png_bytep new_row, png_uint_32 row_num, int pass);
+
+/**
+    This function turns the blocks counted by triage_file() into result's
+    estimates and decides whether the file is flagged.
+*/
+void estimate_triage_result(const triage_state* state, triage_result* result);
+
+/**
+    This function prints a triage_result as a line of JSON.
+*/
+void print_triage_result(FILE* fp, const char* filename, const triage_result* result);
+
+/**
+    This function ranks the PNGs listed on the command line as covers for a message
+    and prints the best SELECT_TOP_COUNT. argv starts at the message filename, or
+    its size in bytes, optionally after SELECT_TEXTURE_FLAG. Only the header of each
+    PNG is read unless texture is asked for. Covers are spread over a thread per CPU.
+*/
+int run_select(int argc, char* argv[]);
+
+/**
+    This function is the body of a select worker thread.
+*/
+void* select_worker(void* arg);
+
+/**
+    This function fills in candidate from its file's IHDR chunk and size, and its
+    texture if with_texture is set.
+*/
+void evaluate_cover(cover_candidate* candidate, size_t payload_length, bool with_texture);
+
+/**
+    This function returns the mean absolute difference between neighbouring samples
+    of a channel in the first rows of a PNG, decoding no further, or -1 if it can't.
+*/
+double sample_cover_texture(const char* filename);
+
+/**
+    This function orders cover_candidates best first for qsort().
+*/
+int compare_cover_candidates(const void* a, const void* b);
+
+/**
+    This function reads the payload length select and plan are given: the size of
+    the message file named by argument, or else argument as a number of bytes. It
+    returns false, after printing the reason, if it is neither.
+*/
+bool parse_payload_length(const char* argument, size_t* length);
+
+/**
+    This function prints, for each PNG listed on the command line, its capacity, the
+    rows a message would touch, the memory embedding it would take and how long each
+    step would take, then totals for the lot. argv starts at the message filename,
+    or its size in bytes. No pixels are decoded, but the throughput model is
+    calibrated with calibrate_throughput() on every run.
+*/
+int run_plan(int argc, char* argv[]);
+
+/**
+    This function fills in estimate for embedding payload_length bytes into candidate.
+*/
+void estimate_plan_job(const cover_candidate* candidate, const throughput_model* model, size_t payload_length,
+                       plan_estimate* estimate);
+
+/**
+    This function times encoding, decoding and embedding on synthetic images in
+    memory and fits model to the results. It returns false if libpng fails.
+*/
+bool calibrate_throughput(throughput_model* model);
+
+/**
+    This function returns the MB/s of pixels a step of the throughput model manages
+    on a file compressed to ratio of its raw size.
+*/
+double plan_throughput(double raw_cost, double compressed_cost, double ratio);
+
+/**
+    This function prints a tab separated table with a row per PNG listed on the
+    command line, timing open_png_file(), embed_data(), output_embedded_png() and
+    extract_data() with a payload that fills the image. Each PNG is run in a child
+    process by bench_image(). argv starts at the first PNG, or at BENCH_CORPUS_TEXT
+    to call generate_bench_corpus() instead.
+*/
+int run_bench(int argc, char* argv[]);
+
+/**
+    This function is the body of a bench child process. It writes one table row to
+    result_fd, or nothing if a step fails.
+*/
+void bench_image(const char* filename, int result_fd);
+
+/**
+    This function returns bytes over seconds in MB/s, or 0 if no time was taken.
+*/
+double bench_rate(double bytes, double seconds);
+
+/**
+    This function writes the bench covers into directory: 1 KP to 16 MP of each kind
+    of content, and a 200 MP photo-like cover, as RGB and RGBA, leaving out any over
+    max_megapixels and any already there.
+*/
+int generate_bench_corpus(const char* directory, double max_megapixels);
+
+/**
+    This function writes one deterministic bench cover. content is an index into
+    the kinds of content. It returns false, leaving no file, if it can't.
+*/
+bool write_bench_cover(const char* filename, int width, int height, int channels, int content);
+
+/**
+    This function returns the CLOCK_MONOTONIC time in seconds.
+*/
+double monotonic_seconds();
+
+/**
+    These functions print a probe_result as a line of JSON.
+*/
+void print_probe_result(FILE* fp, const char* filename, const probe_result* result);
+void print_json_string(FILE* fp, const char* text);
+
+/**
+    These functions drive an io_ring. next_io_submission() returns a cleared entry to
+    fill in, submit_io_ring() submits the queued entries and waits for wait_for
+    completions, and next_io_completion() reaps one completion if there is one.
+*/
+bool setup_io_ring(io_ring* ring, unsigned entries);
+struct io_uring_sqe* next_io_submission(io_ring* ring);
+bool submit_io_ring(io_ring* ring, unsigned wait_for);
+bool next_io_completion(io_ring* ring, struct io_uring_cqe* completion);
+void close_io_ring(io_ring* ring);
+
+//microbench.c includes this file for its kernels and brings its own main()
+#ifndef PNGSTEGO_NO_MAIN
+/**
+    This function pulls in the arguments from the command line, then decides whether
+    to embed or extract data using the provided image.
+*/
+int main(int argc, char* argv[]){
+
+    //The serve mode doesn't take a PNG, so check for it first
+    if(argc >= 3 && strcasecmp(argv[1], SERVE_TEXT) == 0){
+        int thread_count = argc >= 4 ? atoi(argv[3]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        return serve(argv[2], thread_count);
+    }
+
+    if(argc >= 3 && strcasecmp(argv[1], BATCH_TEXT) == 0){
+        return run_batch(argc - 2, argv + 2);
+    }
+    if(argc >= 4 && strcasecmp(argv[1], WATCH_TEXT) == 0){
+        return run_watch(argc - 2, argv + 2);
+    }
+    if(argc >= 3 && strcasecmp(argv[1], PROBE_TEXT) == 0){
+        return run_probe(argc - 2, argv + 2);
+    }
+    if(argc >= 3 && strcasecmp(argv[1], TRIAGE_TEXT) == 0){
+        return run_triage(argc - 2, argv + 2);
+    }
+    if(argc >= 3 && strcasecmp(argv[1], SELECT_TEXT) == 0){
+        return run_select(argc - 2, argv + 2);
+    }
+    if(argc >= 3 && strcasecmp(argv[1], PLAN_TEXT) == 0){
+        return run_plan(argc - 2, argv + 2);
+    }
+    if(argc >= 3 && strcasecmp(argv[1], BENCH_TEXT) == 0){
+        return run_bench(argc - 2, argv + 2);
+    }
+
+    //Check number of command line arguments
+    if(argc < 4){
+        fprintf(stderr, "Usage: \t$ ./pngstego filename.png embed message_filename [--quality-report[=ssim]] [--verify] [--compact]"
+                        " [--stats=json[:stats_filename]] [--perf-counters] [--alloc-stats] [--alloc-budget=bytes]\n"
+                        "\t$ ./pngstego filename.png extract output_filename [--stats=json[:stats_filename]] [--perf-counters]"
+                        " [--alloc-stats] [--alloc-budget=bytes]\n"
+                        "\t$ ./pngstego filename.png scan top_count\n"
+                        "\t$ ./pngstego filename.png analyze region_count\n"
+                        "\t$ ./pngstego filename.png sanitize planes [clear]\n"
+                        "\t$ ./pngstego filename.png bitplanes 0,r1,g7|all\n"
+                        "\t$ ./pngstego filename.png diff stego_filename.png\n"
+                        "\t$ ./pngstego serve socket_path [threads]\n"
+                        "\t$ ./pngstego batch [--trace=trace_filename] embed message_filename filename.png...\n"
+                        "\t$ ./pngstego batch [--trace=trace_filename] extract filename.png...\n"
+                        "\t$ ./pngstego watch [--trace=trace_filename] directory embed message_filename\n"
+                        "\t$ ./pngstego watch [--trace=trace_filename] directory extract\n"
+                        "\t$ ./pngstego probe filename.png...\n"
+                        "\t$ ./pngstego triage filename.png...\n"
+                        "\t$ ./pngstego select [--texture] message_filename|bytes filename.png...\n"
+                        "\t$ ./pngstego plan message_filename|bytes filename.png...\n"
+                        "\t$ ./pngstego bench filename.png...\n"
+                        "\t$ ./pngstego bench corpus directory [max_megapixels]\n");
+        exit_cleanly();
+    }
+
+    //Get the PNG filename from the command line
+    PNG_filename = argv[1];
+
+    //Get the method being requested (embed or extract)
+    method = argv[2];
+
+    //If embed, embed the message from the provided file into the PNG
+    if(strncasecmp(method, EMBED_TEXT, strlen(EMBED_TEXT)) == 0){
+
+        //Options follow the message filename
+        for(int i = 4; i < argc; i++){
+            if(strcmp(argv[i], QUALITY_REPORT_SSIM_FLAG) == 0){
+                quality_report = true;
+                quality_ssim = true;
+            }else if(strcmp(argv[i], QUALITY_REPORT_FLAG) == 0){
+                quality_report = true;
+            }else if(strcmp(argv[i], VERIFY_FLAG) == 0){
+                verify_output = true;
+            }else if(strcmp(argv[i], COMPACT_FLAG) == 0){
+                compact_embedding = true;
+            }else if(!parse_stats_option(argv[i])){
+                fprintf(stderr, "Error: Unknown embed option %s\n", argv[i]);
+                exit_cleanly();
+            }
+        }
+        if(perf_counters_enabled){
+            open_perf_counters();
+        }
+        if(alloc_stats_enabled){
+            find_zlib_object();
+        }
+        switch_stats_phase(STATS_PHASE_OTHER);
+
+        //Uncompress and unfilter the PNG
+        open_png_file(PNG_filename);
+
+        //Calculate the amount of data able to be embedded
+        calculate_available_space(read_ptr, info_ptr);
+
+        //Open the file containing the message to embed
+        message_filename = argv[3];
+        message_fp = fopen(message_filename, "rb");
+        if(message_fp == NULL){
+            fprintf(stderr, "Error opening message file(): %s\n", strerror(errno));
+            exit_cleanly();
+        }
+
+        if(check_message_size()){
+            //Create the output png's filename
+            char temp[FILENAME_MAX_LENGTH] = "embedded_";
+            strcat(temp, PNG_filename);
+            PNG_output_filename = temp;
+            size_t bytes_embedded;
+            png_bytep message = embed_data(&bytes_embedded);
+            if(verify_output){
+                //A script has to be able to tell that nothing was written
+                if(!output_verified_png(message, bytes_embedded)){
+                    free(message);
+                    return EXIT_FAILURE;
+                }
+            }else{
+                output_embedded_png();
+            }
+            count_release(ALLOC_COMPONENT_BUFFERS, message_length > 0 ? message_length : 1);
+            free(message);
+            write_stats("embed");
+
+            //The peak isn't known until the output is written, so an output over
+            // budget is taken back rather than left for a script to pick up
+            if(!check_alloc_budget()){
+                unlink(PNG_output_filename);
+                return EXIT_FAILURE;
+            }
+        }else{
+            exit_cleanly();
+        }
+    }
+    //If extract, extract the message from the PNG image and write it to a file.
+    else if(strncasecmp(method, EXTRACT_TEXT, strlen(EXTRACT_TEXT)) == 0){
+        for(int i = 4; i < argc; i++){
+            if(!parse_stats_option(argv[i])){
+                fprintf(stderr, "Error: Unknown extract option %s\n", argv[i]);
+                exit_cleanly();
+            }
+        }
+        if(perf_counters_enabled){
+            open_perf_counters();
+        }
+        if(alloc_stats_enabled){
+            find_zlib_object();
+        }
+        switch_stats_phase(STATS_PHASE_OTHER);
+
+        //An output filename of - writes the message to stdout
+        output_filename = argv[3];
+        output_fp = strcmp(output_filename, "-") == 0 ? stdout : fopen(output_filename, "wb");
+        if(output_fp == NULL){
+            fprintf(stderr, "Error opening output file(): %s\n", strerror(errno));
+            exit_cleanly();
+        }
+
+        //A partial message is taken back, so a script never picks it up as the whole
+        bool extracted = extract_data();
+        write_stats("extract");
+        if(!extracted || !check_alloc_budget()){
+            if(output_fp != stdout){
+                unlink(output_filename);
+            }
+            return EXIT_FAILURE;
+        }
+    }
+    //If analyze, run steganalysis on the PNG
+    else if(strncasecmp(method, ANALYZE_TEXT, strlen(ANALYZE_TEXT)) == 0){
+        open_png_file(PNG_filename);
+        analyze_data(atoi(argv[3]));
+    }
+    //If sanitize, write a copy of the PNG with its low bit planes destroyed
+    else if(strncasecmp(method, SANITIZE_TEXT, strlen(SANITIZE_TEXT)) == 0){
+        char temp[FILENAME_MAX_LENGTH] = "sanitized_";
+        strncat(temp, PNG_filename, sizeof(temp) - strlen(temp) - 1);
+        bool randomize = argc < 5 || strncasecmp(argv[4], SANITIZE_CLEAR_TEXT, strlen(SANITIZE_CLEAR_TEXT)) != 0;
+        if(!sanitize_png(PNG_filename, temp, atoi(argv[3]), randomize)){
+            return EXIT_FAILURE;
+        }
+    }
+    //If bitplanes, write the chosen bit planes of the PNG out as images
+    else if(strncasecmp(method, BITPLANES_TEXT, strlen(BITPLANES_TEXT)) == 0){
+        open_png_file(PNG_filename);
+        export_bitplanes(argv[3]);
+    }
+    //If diff, compare the PNG with a copy that may have data hidden in it
+    else if(strncasecmp(method, DIFF_TEXT, strlen(DIFF_TEXT)) == 0){
+        diff_png(PNG_filename, argv[3]);
+    }
+    //If scan, try many layouts on the PNG and write out the most likely ones
+    else if(strncasecmp(method, SCAN_TEXT, strlen(SCAN_TEXT)) == 0){
+        open_png_file(PNG_filename);
+        scan_data(atoi(argv[3]));
+    }
+
+    return 0;
+}
+#endif
+
+void open_png_file(const char* PNG_filename){
+    FILE* PNG_file;
+    unsigned char header[BYTE_SIZE];
+
+    //Open the file
+    PNG_file = fopen(PNG_filename, "rb");
+    if(PNG_file == NULL){
+        fprintf(stderr, "Error in open_png_file(): %s\n", strerror(errno));
+        exit_cleanly();
+    }
+
+    //Start reading the file
+    switch_stats_phase(STATS_PHASE_IO);
+    stats.bytes_in += fread(header, 1, HEADER_LENGTH, PNG_file);
+    switch_stats_phase(STATS_PHASE_HEADER);
+
+    //Check if the file is actually a PNG
+    if(png_sig_cmp(header, 0, HEADER_LENGTH)){
+        fprintf(stderr, "Error in open_png_file(): File is not a .PNG."
+                        " Only .PNG files are supported\n");
+        exit_cleanly();
+    }
+
+    //Initialize data structures
+    //  Nulls are for optional custom error handlers. I am using the defaults.
+    read_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+                                        NULL, account_png_malloc, account_png_free);
+    if(read_ptr == NULL){
+        fprintf(stderr, "Error in open_png_file(): png_create_read_struct() returned NULL\n");
+        exit_cleanly();
+    }
 
     info_ptr = png_create_info_struct(read_ptr);
     if(info_ptr == NULL){
-        fprintf(stderr, "Error in open_png_file(): png_create_info_struct() returned NULL\n");
+        fprintf(stderr, "Error in open_png_file(): png_create_info_struct() returned NULL\n");
+        exit_cleanly();
+    }
+
+    //Initialize IO, through the stats callbacks if reads are being timed
+    if(stats_enabled){
+        png_set_read_fn(read_ptr, PNG_file, stats_read_data);
+    }else{
+        png_init_io(read_ptr, PNG_file);
+    }
+
+    //HEADER_LENGTH bytes were read at the beginning, we must let libpng know.
+    png_set_sig_bytes(read_ptr, HEADER_LENGTH);
+
+    //Read the chunks before the image data, then check the image before decoding it
+    png_read_info(read_ptr, info_ptr);
+
+    //Only accept PNGs with depths of 8 bits
+    int bit_depth = png_get_bit_depth(read_ptr, info_ptr);
+    if(bit_depth != BYTE_SIZE){
+        fprintf(stderr, "Error in open_png_file(): File's bit depth is not valid."
+                        " Provided image's bit depth is %d, only 8 bit depths are supported\n",
+                        bit_depth);
+        exit_cleanly();
+    }
+
+    //Only accept RGB and RGBA PNGs, the embedding loops assume 3 or 4 bytes a pixel
+    int color_type = png_get_color_type(read_ptr, info_ptr);
+    if(color_type != PNG_COLOR_TYPE_RGB && color_type != PNG_COLOR_TYPE_RGB_ALPHA){
+        fprintf(stderr, "Error in open_png_file(): Only RGB and RGBA images are supported\n");
+        exit_cleanly();
+    }
+
+    //Read entire PNG into memory, into rows libpng frees with the structs, as
+    // png_read_png() would
+    switch_stats_phase(STATS_PHASE_INFLATE);
+    int height = png_get_image_height(read_ptr, info_ptr);
+    png_set_interlace_handling(read_ptr);
+    png_read_update_info(read_ptr, info_ptr);
+    size_t row_bytes = png_get_rowbytes(read_ptr, info_ptr);
+    alloc_component = ALLOC_COMPONENT_ROWS;
+    row_pointers = png_calloc(read_ptr, height * sizeof(png_bytep));
+    for(int row = 0; row < height; row++){
+        row_pointers[row] = png_malloc(read_ptr, row_bytes);
+    }
+    alloc_component = ALLOC_COMPONENT_LIBPNG;
+    png_set_rows(read_ptr, info_ptr, row_pointers);
+    png_data_freer(read_ptr, info_ptr, PNG_DESTROY_WILL_FREE_DATA, PNG_FREE_ROWS);
+    png_read_image(read_ptr, row_pointers);
+    png_read_end(read_ptr, info_ptr);
+    stats.rows_decoded += height;
+    stats.rows_total = height;
+
+    switch_stats_phase(STATS_PHASE_IO);
+    fclose(PNG_file);
+    switch_stats_phase(STATS_PHASE_OTHER);
+}
+
+png_bytep embed_data(size_t* bytes_embedded){
+    int max_rows = png_get_image_height(read_ptr, info_ptr);
+    int max_cols = png_get_image_width(read_ptr, info_ptr);
+
+    //Pull the whole message into memory so the embedding loop doesn't stop for IO
+    png_bytep message = malloc(message_length > 0 ? message_length : 1);
+    if(message == NULL){
+        fprintf(stderr, "Error in embed_data(): %s\n", strerror(errno));
+        exit_cleanly();
+    }
+    count_allocation(ALLOC_COMPONENT_BUFFERS, message_length > 0 ? message_length : 1);
+    switch_stats_phase(STATS_PHASE_IO);
+    size_t message_read = fread(message, 1, message_length, message_fp);
+    stats.bytes_in += message_read;
+    switch_stats_phase(STATS_PHASE_OTHER);
+
+    //Only the rows the message goes into change, so only they are kept for comparison.
+    // SSIM windows straddling the last of them need whole windows kept.
+    int channels = png_get_channels(read_ptr, info_ptr);
+    int changed_rows = embedded_row_count(max_cols, max_rows, message_read);
+    png_bytep original = NULL;
+    if(quality_report || compact_embedding){
+        if(quality_ssim){
+            changed_rows = (changed_rows + SSIM_WINDOW_SIZE - 1) / SSIM_WINDOW_SIZE * SSIM_WINDOW_SIZE;
+            changed_rows = changed_rows < max_rows ? changed_rows : max_rows;
+        }
+        original = copy_rows(row_pointers, changed_rows, (size_t)max_cols * channels);
+        if(original == NULL){
+            fprintf(stderr, "Error in embed_data(): %s\n", strerror(errno));
+            exit_cleanly();
+        }
+        count_allocation(ALLOC_COMPONENT_BUFFERS, (size_t)changed_rows * max_cols * channels);
+    }
+
+    switch_stats_phase(STATS_PHASE_EMBED);
+    stats.kernel = compact_embedding ? "embed_rows+compact_embedded_rows" : "embed_rows";
+    *bytes_embedded = embed_rows(row_pointers, max_cols, max_rows, message, message_read);
+    if(compact_embedding){
+        compact_embedded_rows(row_pointers, original, max_cols, channels, changed_rows);
+    }
+    switch_stats_phase(STATS_PHASE_OTHER);
+
+    fprintf(stdout, "Message has been embedded!\n%d bytes embedded\n", (int)*bytes_embedded);
+    if(quality_report){
+        measure_quality(original, row_pointers, max_cols, max_rows, channels, changed_rows, quality_ssim);
+    }
+    if(original != NULL){
+        count_release(ALLOC_COMPONENT_BUFFERS, (size_t)changed_rows * max_cols * channels);
+    }
+    free(original);
+
+    fclose(message_fp);
+    return message;
+}
+
+bool extract_data(){
+    progressive_extractor extractor;
+    memory_buffer message = {0};
+    png_bytep chunk;
+    FILE* PNG_file;
+    FILE* status_fp = output_fp == stdout ? stderr : stdout;
+    struct stat st;
+    size_t length;
+    bool extracted;
+
+    PNG_file = fopen(PNG_filename, "rb");
+    chunk = malloc(STREAM_CHUNK_LENGTH);
+    if(PNG_file == NULL || chunk == NULL){
+        fprintf(stderr, "Error in extract_data(): %s\n", strerror(errno));
+        exit_cleanly();
+    }
+
+    //Check the signature first, as open_png_file() does, then start over from it
+    if(fread(chunk, 1, HEADER_LENGTH, PNG_file) != HEADER_LENGTH || png_sig_cmp(chunk, 0, HEADER_LENGTH)
+       || fseek(PNG_file, 0, SEEK_SET) != 0){
+        fprintf(stderr, "Error in extract_data(): File is not a .PNG."
+                        " Only .PNG files are supported\n");
+        free(chunk);
+        fclose(PNG_file);
+        fclose(output_fp);
+        return false;
+    }
+    count_allocation(ALLOC_COMPONENT_BUFFERS, STREAM_CHUNK_LENGTH);
+    if(!start_progressive_extract(&extractor, &message)){
+        exit_cleanly();
+    }
+
+    //Each row's message bytes are written as soon as the row is decoded. Pipes and
+    // sockets are also flushed every row so the reader doesn't wait on stdio.
+    extractor.stream = output_fp;
+    extractor.flush_rows = fstat(fileno(output_fp), &st) == 0 && !S_ISREG(st.st_mode);
+
+    //Stop reading as soon as the last message row is out. The callbacks move the
+    // stats on from the header to inflating once the header is in.
+    stats.kernel = "extract_row";
+    switch_stats_phase(STATS_PHASE_HEADER);
+    while(!extractor.state.done){
+        int phase = switch_stats_phase(STATS_PHASE_IO);
+        length = fread(chunk, 1, STREAM_CHUNK_LENGTH, PNG_file);
+        stats.bytes_in += length;
+        switch_stats_phase(phase);
+        if(length == 0 || !feed_progressive_extract(&extractor, chunk, length)){
+            break;
+        }
+    }
+    switch_stats_phase(STATS_PHASE_OTHER);
+    count_release(ALLOC_COMPONENT_BUFFERS, STREAM_CHUNK_LENGTH);
+    free(chunk);
+    fclose(PNG_file);
+    finish_progressive_extract(&extractor);
+
+    if(extractor.interlaced){
+        //Interlaced rows aren't final until the last pass, so decode the whole image
+        open_png_file(PNG_filename);
+        switch_stats_phase(STATS_PHASE_EXTRACT);
+        if(!extract_rows(row_pointers, png_get_image_width(read_ptr, info_ptr),
+                         png_get_image_height(read_ptr, info_ptr), &message)){
+            fprintf(stderr, "Error in extract_data(): %s\n", strerror(errno));
+            exit_cleanly();
+        }
+        switch_stats_phase(STATS_PHASE_IO);
+        if(fwrite(message.data, 1, message.length, output_fp) != message.length){
+            fprintf(stderr, "Error in extract_data(): %s\n", strerror(errno));
+        }
+        switch_stats_phase(STATS_PHASE_OTHER);
+        extractor.streamed = message.length;
+        extracted = true;
+    }else{
+        //feed_progressive_extract() has already said why if decoding failed
+        extracted = extractor.state.done;
+        if(!extracted && !extractor.failed){
+            fprintf(stderr, "Error in extract_data(): The image ended before the message did\n");
+        }
+    }
+
+    if(extracted){
+        fprintf(status_fp, "Done extracting!\n%d bytes extracted\n", (int)extractor.streamed);
+    }
+    message_length = extractor.streamed;
+    stats.bytes_out += extractor.streamed;
+    free_memory_buffer(&message);
+    switch_stats_phase(STATS_PHASE_IO);
+    fclose(output_fp);
+    switch_stats_phase(STATS_PHASE_OTHER);
+    return extracted;
+}
+
+bool parse_stats_option(const char* option){
+    size_t length = strlen(STATS_FLAG);
+
+    if(strncmp(option, STATS_FLAG, length) == 0 && (option[length] == '\0' || option[length] == ':')){
+        stats_enabled = true;
+        stats_filename = option[length] == ':' ? option + length + 1 : NULL;
+    }else if(strcmp(option, PERF_COUNTERS_FLAG) == 0){
+        stats_enabled = true;
+        perf_counters_enabled = true;
+    }else if(strcmp(option, ALLOC_STATS_FLAG) == 0){
+        stats_enabled = true;
+        alloc_stats_enabled = true;
+    }else if(strncmp(option, ALLOC_BUDGET_FLAG, strlen(ALLOC_BUDGET_FLAG)) == 0){
+        char* end;
+        stats_enabled = true;
+        alloc_stats_enabled = true;
+        alloc_budget = strtoull(option + strlen(ALLOC_BUDGET_FLAG), &end, 10);
+        if(alloc_budget == 0 || *end != '\0'){
+            fprintf(stderr, "Error: Invalid allocation budget %s\n", option);
+            exit_cleanly();
+        }
+    }else{
+        return false;
+    }
+    return true;
+}
+
+int switch_stats_phase(int phase){
+    if(!stats_enabled){
+        return phase;
+    }
+
+    //Everything since the last switch belongs to the phase being left. The first
+    // switch only starts the clock.
+    double wall = monotonic_seconds();
+    double cpu = process_cpu_seconds();
+    int previous = stats.phase;
+    if(stats.phase_wall > 0){
+        stats.wall[previous] += wall - stats.phase_wall;
+        stats.cpu[previous] += cpu - stats.phase_cpu;
+    }
+    if(perf_counters_enabled){
+        uint64_t values[PERF_COUNTER_COUNT];
+        int i;
+        read_perf_counters(values);
+        //Scaled values are estimates and can step back a little, which counts as 0
+        for(i = 0; i < PERF_COUNTER_COUNT; i++){
+            if(values[i] > stats.phase_counters[i]){
+                stats.counters[previous][i] += values[i] - stats.phase_counters[i];
+                stats.phase_counters[i] = values[i];
+            }
+        }
+    }
+    stats.phase_wall = wall;
+    stats.phase_cpu = cpu;
+    stats.phase = phase;
+
+    //Memory still live from earlier phases counts toward this one's peak, even if
+    // it allocates nothing itself
+    if(alloc_stats_enabled && alloc_total.live > alloc_phases[phase].peak){
+        alloc_phases[phase].peak = alloc_total.live;
+    }
+    return previous;
+}
+
+double process_cpu_seconds(){
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+void stats_read_data(png_structp png_ptr, png_bytep data, png_size_t length){
+    int phase = switch_stats_phase(STATS_PHASE_IO);
+    size_t read = fread(data, 1, length, png_get_io_ptr(png_ptr));
+    switch_stats_phase(phase);
+    stats.bytes_in += read;
+    if(read != length){
+        png_error(png_ptr, "Read Error");
+    }
+}
+
+void stats_write_data(png_structp png_ptr, png_bytep data, png_size_t length){
+    int phase = switch_stats_phase(STATS_PHASE_IO);
+    size_t written = fwrite(data, 1, length, png_get_io_ptr(png_ptr));
+    switch_stats_phase(phase);
+    stats.bytes_out += written;
+    if(written != length){
+        png_error(png_ptr, "Write Error");
+    }
+}
+
+void stats_flush_data(png_structp png_ptr){
+    int phase = switch_stats_phase(STATS_PHASE_IO);
+    fflush(png_get_io_ptr(png_ptr));
+    switch_stats_phase(phase);
+}
+
+void open_perf_counters(){
+    static const uint32_t types[PERF_COUNTER_COUNT] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE
+    };
+    static const uint64_t configs[PERF_COUNTER_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    };
+    struct perf_event_attr attr;
+    int i;
+
+    //Counting the kernel as well needs perf_event_paranoid below 2, so fall back to
+    // user space alone when it is refused. Cycles comes first so it leads the group
+    // whenever the host has it.
+    perf_counters_user_only = false;
+    perf_group_fd = -1;
+    for(i = 0; i < PERF_COUNTER_COUNT; i++){
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.exclude_hv = 1;
+        attr.exclude_kernel = perf_counters_user_only;
+        perf_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, perf_group_fd, PERF_FLAG_FD_CLOEXEC);
+        if(perf_fds[i] < 0 && (errno == EACCES || errno == EPERM) && !perf_counters_user_only){
+            perf_counters_user_only = true;
+            attr.exclude_kernel = 1;
+            perf_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, perf_group_fd, PERF_FLAG_FD_CLOEXEC);
+        }
+        if(perf_fds[i] < 0){
+            fprintf(stderr, "Warning: perf counter %s is unavailable: %s\n", perf_counter_names[i], strerror(errno));
+        }else if(perf_group_fd < 0){
+            perf_group_fd = perf_fds[i];
+        }
+    }
+    read_perf_counters(stats.phase_counters);
+}
+
+void read_perf_counters(uint64_t* values){
+    //The group reads as its size, the times enabled and running, then each open
+    // counter's value in the order it joined
+    uint64_t group[3 + PERF_COUNTER_COUNT];
+    ssize_t length = -1;
+    uint64_t next = 0;
+    int i;
+
+    if(perf_group_fd >= 0){
+        length = read(perf_group_fd, group, sizeof(group));
+    }
+    for(i = 0; i < PERF_COUNTER_COUNT; i++){
+        values[i] = 0;
+        if(perf_fds[i] < 0){
+            continue;
+        }
+        if(length >= (ssize_t)(3 * sizeof(uint64_t)) && next < group[0]
+           && (size_t)length >= (4 + next) * sizeof(uint64_t) && group[2] > 0){
+            values[i] = (uint64_t)((double)group[3 + next] * group[1] / group[2]);
+        }
+        next++;
+    }
+}
+
+void write_stats(const char* command){
+    static const char* phase_names[STATS_PHASE_COUNT] = {
+        "other", "header", "inflate", "embed", "extract", "deflate", "verify", "io"
+    };
+    struct rusage usage;
+    double wall = 0;
+    double cpu = 0;
+    FILE* fp = stderr;
+    int phase;
+
+    if(!stats_enabled){
+        return;
+    }
+    switch_stats_phase(STATS_PHASE_OTHER);
+    for(phase = 0; phase < STATS_PHASE_COUNT; phase++){
+        wall += stats.wall[phase];
+        cpu += stats.cpu[phase];
+    }
+    getrusage(RUSAGE_SELF, &usage);
+
+    if(stats_filename != NULL){
+        fp = fopen(stats_filename, "w");
+        if(fp == NULL){
+            fprintf(stderr, "Error in write_stats(): %s: %s\n", stats_filename, strerror(errno));
+            return;
+        }
+    }
+    fprintf(fp, "{\"command\":\"%s\",\"file\":", command);
+    print_json_string(fp, PNG_filename);
+    fprintf(fp, ",\"kernel\":\"%s\",\"simd\":\"%s\",\"bytes_in\":%" PRIu64 ",\"bytes_out\":%" PRIu64
+                ",\"rows_decoded\":%" PRIu64 ",\"rows_total\":%" PRIu64 ",\"peak_rss_kb\":%ld"
+                ",\"wall_s\":%.6f,\"cpu_s\":%.6f,\"phases\":{",
+            stats.kernel != NULL ? stats.kernel : "none",
+#ifdef __SSE2__
+            "sse2",
+#else
+            "scalar",
+#endif
+            stats.bytes_in, stats.bytes_out, stats.rows_decoded, stats.rows_total, usage.ru_maxrss, wall, cpu);
+    for(phase = 0; phase < STATS_PHASE_COUNT; phase++){
+        fprintf(fp, "%s\"%s\":{\"wall_s\":%.6f,\"cpu_s\":%.6f", phase > 0 ? "," : "",
+                phase_names[phase], stats.wall[phase], stats.cpu[phase]);
+
+        //Counters that couldn't be opened are null rather than a misleading 0
+        for(int i = 0; perf_counters_enabled && i < PERF_COUNTER_COUNT; i++){
+            if(perf_fds[i] >= 0){
+                fprintf(fp, ",\"%s\":%" PRIu64, perf_counter_names[i], stats.counters[phase][i]);
+            }else{
+                fprintf(fp, ",\"%s\":null", perf_counter_names[i]);
+            }
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "}");
+    if(perf_counters_enabled){
+        bool any_open = false;
+        for(int i = 0; i < PERF_COUNTER_COUNT; i++){
+            any_open = any_open || perf_fds[i] >= 0;
+        }
+        fprintf(fp, ",\"perf_scope\":\"%s\"", !any_open ? "none" : perf_counters_user_only ? "user" : "user+kernel");
+    }
+    if(alloc_stats_enabled){
+        fprintf(fp, ",\"allocations\":");
+        print_alloc_usage(fp, &alloc_total);
+        if(alloc_budget > 0){
+            fprintf(fp, ",\"alloc_budget_bytes\":%" PRIu64, alloc_budget);
+        }
+        fprintf(fp, ",\"alloc_components\":{");
+        for(int i = 0; i < ALLOC_COMPONENT_COUNT; i++){
+            fprintf(fp, "%s\"%s\":", i > 0 ? "," : "", alloc_component_names[i]);
+
+            //Without a zlib of its own to spot, its allocations are in libpng's
+            if(i == ALLOC_COMPONENT_ZLIB && zlib_base == NULL){
+                fprintf(fp, "null");
+                continue;
+            }
+            print_alloc_usage(fp, &alloc_components[i]);
+        }
+        fprintf(fp, "},\"alloc_phases\":{");
+        for(phase = 0; phase < STATS_PHASE_COUNT; phase++){
+            fprintf(fp, "%s\"%s\":", phase > 0 ? "," : "", phase_names[phase]);
+            print_alloc_usage(fp, &alloc_phases[phase]);
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "}\n");
+    if(fp != stderr){
+        fclose(fp);
+    }
+}
+
+png_voidp account_png_malloc(png_structp png_ptr, png_alloc_size_t size){
+    alloc_header* header;
+
+    if(!alloc_stats_enabled){
+        return malloc(size);
+    }
+    if(size > SIZE_MAX - sizeof(alloc_header)){
+        return NULL;
+    }
+    header = malloc(sizeof(alloc_header) + size);
+    if(header == NULL){
+        return NULL;
+    }
+    header->block.size = size;
+    header->block.component = alloc_component == ALLOC_COMPONENT_LIBPNG && called_from_zlib()
+                            ? ALLOC_COMPONENT_ZLIB : alloc_component;
+    count_allocation(header->block.component, size);
+    return header + 1;
+}
+
+void account_png_free(png_structp png_ptr, png_voidp ptr){
+    alloc_header* header;
+
+    if(!alloc_stats_enabled){
+        free(ptr);
+        return;
+    }
+    if(ptr == NULL){
+        return;
+    }
+    header = (alloc_header*)ptr - 1;
+    count_release(header->block.component, header->block.size);
+    free(header);
+}
+
+void count_allocation(int component, size_t size){
+    alloc_usage* usages[3] = {&alloc_total, &alloc_components[component], &alloc_phases[stats.phase]};
+    int i;
+
+    if(!alloc_stats_enabled){
+        return;
+    }
+    alloc_total.live += size;
+    alloc_components[component].live += size;
+    for(i = 0; i < 3; i++){
+        usages[i]->count++;
+        usages[i]->bytes += size;
+        if(size > usages[i]->largest){
+            usages[i]->largest = size;
+        }
+    }
+
+    //A phase's peak is the whole run's, while it was running
+    if(alloc_total.live > alloc_total.peak){
+        alloc_total.peak = alloc_total.live;
+    }
+    if(alloc_components[component].live > alloc_components[component].peak){
+        alloc_components[component].peak = alloc_components[component].live;
+    }
+    if(alloc_total.live > alloc_phases[stats.phase].peak){
+        alloc_phases[stats.phase].peak = alloc_total.live;
+    }
+}
+
+void count_release(int component, size_t size){
+    if(!alloc_stats_enabled){
+        return;
+    }
+    alloc_total.live -= size;
+    alloc_components[component].live -= size;
+}
+
+void find_zlib_object(){
+    Dl_info zlib;
+    Dl_info libpng;
+    Dl_info program;
+
+    //A zlib linked statically, or bundled into libpng, shares an object with its
+    // callers, and its allocations are left in with libpng's
+    zlib_base = NULL;
+    if(dladdr((void*)inflate, &zlib) && dladdr((void*)png_create_read_struct, &libpng)
+       && dladdr((void*)find_zlib_object, &program)
+       && zlib.dli_fbase != libpng.dli_fbase && zlib.dli_fbase != program.dli_fbase){
+        zlib_base = zlib.dli_fbase;
+    }
+}
+
+bool called_from_zlib(){
+    void* frames[ALLOC_BACKTRACE_DEPTH];
+    int count;
+    Dl_info info;
+    int i;
+
+    if(zlib_base == NULL){
+        return false;
+    }
+
+    //zlib calls libpng's png_zalloc(), which calls back into account_png_malloc()
+    count = backtrace(frames, ALLOC_BACKTRACE_DEPTH);
+    for(i = 0; i < count; i++){
+        if(dladdr(frames[i], &info) && info.dli_fbase == zlib_base){
+            return true;
+        }
+    }
+    return false;
+}
+
+void print_alloc_usage(FILE* fp, const alloc_usage* usage){
+    fprintf(fp, "{\"peak_bytes\":%" PRIu64 ",\"count\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"largest_bytes\":%" PRIu64 "}",
+            usage->peak, usage->count, usage->bytes, usage->largest);
+}
+
+bool check_alloc_budget(){
+    if(alloc_budget == 0 || alloc_total.peak <= alloc_budget){
+        return true;
+    }
+    fprintf(stderr, "Error: Allocations peaked at %" PRIu64 " bytes, over the budget of %" PRIu64 " bytes\n",
+            alloc_total.peak, alloc_budget);
+    return false;
+}
+
+size_t payload_capacity(int width, int height){
+    size_t row_bytes = (size_t)width * 3;
+    if(height <= 0 || row_bytes < BITS_NEEDED_TO_STORE_MESSAGE_LENGTH){
+        return 0;
+    }
+
+    //Every byte of the image holds one bit, minus the bits used for the length
+    size_t capacity = (row_bytes * height - BITS_NEEDED_TO_STORE_MESSAGE_LENGTH) / BYTE_SIZE;
+
+    //The length has to fit in BITS_NEEDED_TO_STORE_MESSAGE_LENGTH bits
+    if(capacity > 0xFFFFFFFF){
+        capacity = 0xFFFFFFFF;
+    }
+    return capacity;
+}
+
+int embedded_row_count(int width, int height, size_t payload_length){
+    size_t row_bytes = (size_t)width * 3;
+    size_t bytes_per_row = (row_bytes + BYTE_SIZE - 1) / BYTE_SIZE;
+    size_t first_row_bytes;
+    size_t rows;
+
+    if(payload_capacity(width, height) == 0){
+        return 0;
+    }
+    if(payload_length > payload_capacity(width, height)){
+        payload_length = payload_capacity(width, height);
+    }
+
+    //The same count of message bytes per row as embed_rows() uses, a partial byte
+    // at the end of a row counting as a whole one
+    first_row_bytes = (row_bytes - BITS_NEEDED_TO_STORE_MESSAGE_LENGTH + BYTE_SIZE - 1) / BYTE_SIZE;
+    if(payload_length <= first_row_bytes){
+        return 1;
+    }
+    rows = 1 + (payload_length - first_row_bytes + bytes_per_row - 1) / bytes_per_row;
+    return rows < (size_t)height ? (int)rows : height;
+}
+
+png_bytep copy_rows(png_bytep* rows, int count, size_t row_bytes){
+    png_bytep copy = malloc(row_bytes * count > 0 ? row_bytes * count : 1);
+    int row;
+
+    if(copy == NULL){
+        return NULL;
+    }
+    for(row = 0; row < count; row++){
+        memcpy(copy + row_bytes * row, rows[row], row_bytes);
+    }
+    return copy;
+}
+
+void measure_quality(const png_byte* original, png_bytep* rows, int width, int height, int channels,
+                     int row_count, bool with_ssim){
+    size_t row_bytes = (size_t)width * channels;
+    uint64_t squared_error = 0;
+    double samples = (double)row_bytes * height;
+    int row;
+
+    //Rows past row_count weren't touched, so they add nothing to the error
+    for(row = 0; row < row_count; row++){
+        squared_error += squared_error_row(original + row_bytes * row, rows[row], row_bytes);
+    }
+    double mse = samples > 0 ? squared_error / samples : 0;
+
+    fprintf(stdout, "Quality: MSE %.6f, PSNR ", mse);
+    if(mse > 0){
+        fprintf(stdout, "%.2f dB", 10 * log10(255.0 * 255.0 / mse));
+    }else{
+        fprintf(stdout, "inf");
+    }
+    if(with_ssim){
+        fprintf(stdout, ", SSIM %.6f", structural_similarity(original, rows, width, height, channels, row_count));
+    }
+    fprintf(stdout, "\n");
+}
+
+uint64_t squared_error_row(const png_byte* a, const png_byte* b, size_t length){
+    uint64_t sum = 0;
+    size_t x = 0;
+
+#ifdef __SSE2__
+    //Widen to 16 bits, subtract, and let madd square and pair up the differences.
+    // A block of 16 bytes adds at most 2 * 255 * 255 to each 32 bit lane, so the
+    // lanes are emptied every 2048 blocks, well before they could wrap.
+    const __m128i zero = _mm_setzero_si128();
+    while(x + 16 <= length){
+        __m128i lanes = zero;
+        size_t block_end = x + 16 * 2048;
+        if(block_end > length){
+            block_end = length;
+        }
+        for(; x + 16 <= block_end; x += 16){
+            __m128i va = _mm_loadu_si128((const __m128i*)(a + x));
+            __m128i vb = _mm_loadu_si128((const __m128i*)(b + x));
+            __m128i low = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+            __m128i high = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+            lanes = _mm_add_epi32(lanes, _mm_madd_epi16(low, low));
+            lanes = _mm_add_epi32(lanes, _mm_madd_epi16(high, high));
+        }
+        uint32_t parts[4];
+        _mm_storeu_si128((__m128i*)parts, lanes);
+        sum += (uint64_t)parts[0] + parts[1] + parts[2] + parts[3];
+    }
+#endif
+
+    for(; x < length; x++){
+        int difference = a[x] - b[x];
+        sum += difference * difference;
+    }
+    return sum;
+}
+
+double structural_similarity(const png_byte* original, png_bytep* rows, int width, int height, int channels,
+                             int row_count){
+    const double c1 = (0.01 * 255) * (0.01 * 255);
+    const double c2 = (0.03 * 255) * (0.03 * 255);
+    size_t row_bytes = (size_t)width * channels;
+    int windows_across = width / SSIM_WINDOW_SIZE;
+    int windows_down = height / SSIM_WINDOW_SIZE;
+    double total;
+    int window_row;
+    int window;
+    int c;
+
+    if(windows_across == 0 || windows_down == 0){
+        return 1;
+    }
+
+    //Windows below row_count weren't touched and score exactly 1
+    total = (double)windows_across * windows_down * channels;
+    for(window_row = 0; window_row * SSIM_WINDOW_SIZE < row_count && window_row < windows_down; window_row++){
+        for(window = 0; window < windows_across; window++){
+            for(c = 0; c < channels; c++){
+                double sum_x = 0, sum_y = 0, sum_xx = 0, sum_yy = 0, sum_xy = 0;
+                double n = SSIM_WINDOW_SIZE * SSIM_WINDOW_SIZE;
+                int y;
+                int x;
+                for(y = 0; y < SSIM_WINDOW_SIZE; y++){
+                    int row = window_row * SSIM_WINDOW_SIZE + y;
+                    const png_byte* a = original + row_bytes * row;
+                    const png_byte* b = rows[row];
+                    for(x = 0; x < SSIM_WINDOW_SIZE; x++){
+                        size_t offset = (size_t)(window * SSIM_WINDOW_SIZE + x) * channels + c;
+                        double va = a[offset];
+                        double vb = b[offset];
+                        sum_x += va;
+                        sum_y += vb;
+                        sum_xx += va * va;
+                        sum_yy += vb * vb;
+                        sum_xy += va * vb;
+                    }
+                }
+                double mean_x = sum_x / n;
+                double mean_y = sum_y / n;
+                double variance_x = sum_xx / n - mean_x * mean_x;
+                double variance_y = sum_yy / n - mean_y * mean_y;
+                double covariance = sum_xy / n - mean_x * mean_y;
+                double ssim = ((2 * mean_x * mean_y + c1) * (2 * covariance + c2))
+                              / ((mean_x * mean_x + mean_y * mean_y + c1) * (variance_x + variance_y + c2));
+                total += ssim - 1;
+            }
+        }
+    }
+    return total / ((double)windows_across * windows_down * channels);
+}
+
+void compact_embedded_rows(png_bytep* rows, const png_byte* original, int width, int channels, int row_count){
+    static const char* strategy_names[COMPACT_STRATEGY_COUNT] = {"flip", "left", "up", "average", "paeth"};
+    size_t row_bytes = (size_t)width * channels;
+    int strategy_bands[COMPACT_STRATEGY_COUNT] = {0};
+    double plain_estimate = 0;
+    double chosen_estimate = 0;
+    png_bytep band;
+    png_bytep band_rows[COMPACT_BAND_ROWS];
+    png_bytep scratch;
+    int first_row;
+    int strategy;
+    int i;
+
+    band = malloc(row_bytes * COMPACT_BAND_ROWS);
+    scratch = malloc(row_bytes * 2);
+    if(band == NULL || scratch == NULL){
+        fprintf(stderr, "Error in compact_embedded_rows(): %s\n", strerror(errno));
+        exit_cleanly();
+    }
+    for(i = 0; i < COMPACT_BAND_ROWS; i++){
+        band_rows[i] = band + row_bytes * i;
+    }
+
+    //Each band is tried with every strategy on a copy, following on from the rows
+    // above as they were finally written, and the smallest estimate is kept
+    for(first_row = 0; first_row < row_count; first_row += COMPACT_BAND_ROWS){
+        int count = row_count - first_row < COMPACT_BAND_ROWS ? row_count - first_row : COMPACT_BAND_ROWS;
+        png_bytep above = first_row > 0 ? rows[first_row - 1] : NULL;
+        const png_byte* band_original = original + row_bytes * first_row;
+        double best_estimate = 0;
+        int best = 0;
+
+        for(strategy = 0; strategy < COMPACT_STRATEGY_COUNT; strategy++){
+            for(i = 0; i < count; i++){
+                memcpy(band_rows[i], rows[first_row + i], row_bytes);
+                apply_compact_strategy(band_rows[i], band_original + row_bytes * i,
+                                       i > 0 ? band_rows[i - 1] : above, row_bytes, channels, strategy);
+            }
+            double estimate = estimate_compressed_size(band_rows, above, count, row_bytes, channels, scratch);
+            if(strategy == 0){
+                plain_estimate += estimate;
+            }
+            if(strategy == 0 || estimate < best_estimate){
+                best_estimate = estimate;
+                best = strategy;
+            }
+        }
+
+        for(i = 0; i < count; i++){
+            apply_compact_strategy(rows[first_row + i], band_original + row_bytes * i,
+                                   first_row + i > 0 ? rows[first_row + i - 1] : NULL, row_bytes, channels, best);
+        }
+        strategy_bands[best]++;
+        chosen_estimate += best_estimate;
+    }
+
+    fprintf(stdout, "Compact placement over %d rows:", row_count);
+    for(strategy = 0; strategy < COMPACT_STRATEGY_COUNT; strategy++){
+        if(strategy_bands[strategy] > 0){
+            fprintf(stdout, " %s %d band%s", strategy_names[strategy], strategy_bands[strategy],
+                    strategy_bands[strategy] == 1 ? "" : "s");
+        }
+    }
+    fprintf(stdout, "\nEstimated size of those rows: %.0f bytes, %.0f bytes with plain LSB flips (%+.1f%%)\n",
+            chosen_estimate, plain_estimate,
+            plain_estimate > 0 ? 100 * (chosen_estimate - plain_estimate) / plain_estimate : 0);
+
+    free(scratch);
+    free(band);
+}
+
+void apply_compact_strategy(png_bytep row, const png_byte* original, const png_byte* above,
+                            size_t row_bytes, int bpp, int strategy){
+    size_t x;
+
+    for(x = 0; x < row_bytes; x++){
+        if(row[x] == original[x]){
+            continue;
+        }
+
+        //Flipping the LSB is one step of 1. A step the other way sets the same LSB.
+        int flipped = original[x] ^ 1;
+        int other = 2 * original[x] - flipped;
+        if(strategy == 0 || other < 0 || other > 255){
+            row[x] = flipped;
+            continue;
+        }
+
+        int left = x >= (size_t)bpp ? row[x - bpp] : 0;
+        int up = above != NULL ? above[x] : 0;
+        int upper_left = above != NULL && x >= (size_t)bpp ? above[x - bpp] : 0;
+        int prediction;
+        if(strategy == 1){
+            prediction = left;
+        }else if(strategy == 2){
+            prediction = up;
+        }else if(strategy == 3){
+            prediction = (left + up) / 2;
+        }else{
+            prediction = paeth_predictor(left, up, upper_left);
+        }
+        row[x] = abs(other - prediction) < abs(flipped - prediction) ? other : flipped;
+    }
+}
+
+int paeth_predictor(int left, int up, int upper_left){
+    int estimate = left + up - upper_left;
+    int distance_left = abs(estimate - left);
+    int distance_up = abs(estimate - up);
+    int distance_upper_left = abs(estimate - upper_left);
+
+    if(distance_left <= distance_up && distance_left <= distance_upper_left){
+        return left;
+    }
+    return distance_up <= distance_upper_left ? up : upper_left;
+}
+
+double estimate_compressed_size(png_bytep* rows, const png_byte* above, int count, size_t row_bytes, int bpp,
+                                png_bytep scratch){
+    uint64_t histogram[256] = {0};
+    png_bytep residuals = scratch;
+    png_bytep best = scratch + row_bytes;
+    double bits = 0;
+    double total;
+    int row;
+    int filter;
+    int i;
+
+    //Pick each row's filter the way libpng does, by the smallest sum of residuals
+    // taken as signed bytes, and tally the chosen residuals
+    for(row = 0; row < count; row++){
+        const png_byte* current = rows[row];
+        const png_byte* previous = row > 0 ? rows[row - 1] : above;
+        uint64_t best_sum = UINT64_MAX;
+
+        for(filter = 0; filter < 5; filter++){
+            uint64_t sum = 0;
+            size_t x;
+            for(x = 0; x < row_bytes; x++){
+                int left = x >= (size_t)bpp ? current[x - bpp] : 0;
+                int up = previous != NULL ? previous[x] : 0;
+                int upper_left = previous != NULL && x >= (size_t)bpp ? previous[x - bpp] : 0;
+                int prediction = filter == 0 ? 0 : filter == 1 ? left : filter == 2 ? up
+                                 : filter == 3 ? (left + up) / 2 : paeth_predictor(left, up, upper_left);
+                png_byte residual = (png_byte)(current[x] - prediction);
+                residuals[x] = residual;
+                sum += residual < 128 ? residual : 256 - residual;
+            }
+            if(sum < best_sum){
+                best_sum = sum;
+                memcpy(best, residuals, row_bytes);
+            }
+        }
+        for(i = 0; i < (int)row_bytes; i++){
+            histogram[best[i]]++;
+        }
+    }
+
+    //Deflate's Huffman stage gets close to the order-0 entropy of what it codes
+    total = (double)count * row_bytes;
+    for(i = 0; i < 256; i++){
+        if(histogram[i] > 0){
+            double p = histogram[i] / total;
+            bits -= histogram[i] * log2(p);
+        }
+    }
+    return bits / BYTE_SIZE;
+}
+
+size_t embed_rows(png_bytep* rows, int width, int height,
+                  const png_byte* payload, size_t payload_length){
+    size_t row_bytes = (size_t)width * 3;
+    size_t embedded = 0;
+    size_t col;
+    int row;
+
+    if(payload_capacity(width, height) == 0){
+        return 0;
+    }
+    if(payload_length > payload_capacity(width, height)){
+        payload_length = payload_capacity(width, height);
+    }
+
+    //Write the size of the message (bytes) into the first BITS_NEEDED_TO_STORE_MESSAGE_LENGTH
+    // bytes of the image, one bit per byte.
+    for(col = 0; col < BITS_NEEDED_TO_STORE_MESSAGE_LENGTH; col++){
+        rows[0][col] = (rows[0][col] & 0xFE) | ((payload_length >> col) & 1);
+    }
+
+    //Each message byte starts on a multiple of BYTE_SIZE within its row. If the row
+    // ends part way through a byte, the rest of that byte is dropped and the next
+    // byte starts on the next row.
+    for(row = 0; row < height && embedded < payload_length; row++){
+        col = (row == 0) ? BITS_NEEDED_TO_STORE_MESSAGE_LENGTH : 0;
+        for(; col < row_bytes && embedded < payload_length; col += BYTE_SIZE){
+            png_byte value = payload[embedded++];
+            png_bytep sample = rows[row] + col;
+            size_t bits = row_bytes - col < BYTE_SIZE ? row_bytes - col : BYTE_SIZE;
+            size_t bit;
+            for(bit = 0; bit < bits; bit++){
+                sample[bit] = (sample[bit] & 0xFE) | ((value >> bit) & 1);
+            }
+        }
+    }
+
+    return embedded;
+}
+
+bool extract_rows(png_bytep* rows, int width, int height, memory_buffer* output){
+    extract_state state;
+    int row;
+
+    start_extract_state(&state, width, height);
+    for(row = 0; row < height && !state.done; row++){
+        if(!extract_row(&state, rows[row], output)){
+            return false;
+        }
+
+        //The whole message is collected here, so make room for it once the length
+        // is known. A corrupt length can't make us read past the end of the image,
+        // so only reserve what the image can actually hold.
+        if(row == 0){
+            size_t capacity = payload_capacity(width, height);
+            if(!reserve_memory_buffer(output, output->length + (state.length < capacity ? state.length : capacity))){
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+void start_extract_state(extract_state* state, int width, int height){
+    state->width = width;
+    state->height = height;
+    state->row = 0;
+    state->length_known = false;
+    state->length = 0;
+    state->end_position = 0;
+
+    //An image too small for the length field holds nothing
+    state->done = payload_capacity(width, height) == 0;
+}
+
+bool extract_row(extract_state* state, png_const_bytep row, memory_buffer* output){
+    size_t row_bytes = (size_t)state->width * 3;
+    size_t col = 0;
+
+    if(state->done){
+        return true;
+    }
+
+    if(state->row == 0){
+        //Extract the size of the message from the first BITS_NEEDED_TO_STORE_MESSAGE_LENGTH bytes
+        for(col = 0; col < BITS_NEEDED_TO_STORE_MESSAGE_LENGTH; col++){
+            state->length |= (size_t)(row[col] & 1) << col;
+        }
+
+        //Extraction stops once length * BYTE_SIZE bits past the length field have been
+        // visited, counting every byte of every row.
+        state->end_position = state->length * BYTE_SIZE + BITS_NEEDED_TO_STORE_MESSAGE_LENGTH;
+        state->length_known = true;
+    }
+
+    for(; col < row_bytes; col += BYTE_SIZE){
+        size_t position = row_bytes * state->row + col;
+        size_t bits = row_bytes - col < BYTE_SIZE ? row_bytes - col : BYTE_SIZE;
+        if(position + bits > state->end_position){
+            state->done = true;
+            return true;
+        }
+
+        png_const_bytep sample = row + col;
+        png_byte value = 0;
+        size_t bit;
+        for(bit = 0; bit < bits; bit++){
+            value |= (sample[bit] & 1) << bit;
+        }
+        if(!append_memory_buffer(output, &value, 1)){
+            return false;
+        }
+    }
+
+    state->row++;
+    if(state->row == state->height){
+        state->done = true;
+    }
+    return true;
+}
+
+bool embed_buffer(const png_byte* carrier, size_t carrier_length,
+                  const png_byte* payload, size_t payload_length,
+                  memory_buffer* output){
+    memory_source source = {carrier, carrier_length, 0};
+    png_structp mem_read_ptr;
+    png_infop mem_info_ptr;
+    png_structp mem_write_ptr;
+    bool success = false;
+
+    mem_read_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if(mem_read_ptr == NULL){
+        fprintf(stderr, "Error in embed_buffer(): png_create_read_struct() returned NULL\n");
+        return false;
+    }
+    mem_info_ptr = png_create_info_struct(mem_read_ptr);
+    if(mem_info_ptr == NULL){
+        fprintf(stderr, "Error in embed_buffer(): png_create_info_struct() returned NULL\n");
+        png_destroy_read_struct(&mem_read_ptr, NULL, NULL);
+        return false;
+    }
+
+    record_trace_event(TRACE_BEGIN, "decode", NULL);
+    bool decoded = decode_png_memory(mem_read_ptr, mem_info_ptr, &source);
+    record_trace_event(TRACE_END, "decode", NULL);
+    if(decoded){
+        int width = png_get_image_width(mem_read_ptr, mem_info_ptr);
+        int height = png_get_image_height(mem_read_ptr, mem_info_ptr);
+        png_bytep* rows = png_get_rows(mem_read_ptr, mem_info_ptr);
+
+        if(payload_length > payload_capacity(width, height)){
+            fprintf(stderr, "Error in embed_buffer(): Message is too large to embed in"
+                            " the provided image (%zu bytes too large)\n",
+                            payload_length - payload_capacity(width, height));
+        }else{
+            record_trace_event(TRACE_BEGIN, "embed", NULL);
+            embed_rows(rows, width, height, payload, payload_length);
+            record_trace_event(TRACE_END, "embed", NULL);
+
+            mem_write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+            if(mem_write_ptr == NULL){
+                fprintf(stderr, "Error in embed_buffer(): png_create_write_struct() returned NULL\n");
+            }else{
+                //Size the output up front so libpng's writes rarely have to regrow it
+                output->length = 0;
+                record_trace_event(TRACE_BEGIN, "encode", NULL);
+                if(reserve_memory_buffer(output, carrier_length + carrier_length / OUTPUT_SLACK_DIVISOR)){
+                    success = encode_png_memory(mem_write_ptr, mem_info_ptr, output);
+                }
+                record_trace_event(TRACE_END, "encode", NULL);
+                png_destroy_write_struct(&mem_write_ptr, NULL);
+            }
+        }
+    }
+
+    png_destroy_read_struct(&mem_read_ptr, &mem_info_ptr, NULL);
+    return success;
+}
+
+bool extract_buffer(const png_byte* carrier, size_t carrier_length, memory_buffer* output){
+    memory_source source = {carrier, carrier_length, 0};
+    png_structp mem_read_ptr;
+    png_infop mem_info_ptr;
+    bool success = false;
+
+    mem_read_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+                                            NULL, account_png_malloc, account_png_free);
+    if(mem_read_ptr == NULL){
+        fprintf(stderr, "Error in extract_buffer(): png_create_read_struct() returned NULL\n");
+        return false;
+    }
+    mem_info_ptr = png_create_info_struct(mem_read_ptr);
+    if(mem_info_ptr == NULL){
+        fprintf(stderr, "Error in extract_buffer(): png_create_info_struct() returned NULL\n");
+        png_destroy_read_struct(&mem_read_ptr, NULL, NULL);
+        return false;
+    }
+
+    record_trace_event(TRACE_BEGIN, "decode", NULL);
+    bool decoded = decode_png_memory(mem_read_ptr, mem_info_ptr, &source);
+    record_trace_event(TRACE_END, "decode", NULL);
+    if(decoded){
+        output->length = 0;
+        record_trace_event(TRACE_BEGIN, "extract", NULL);
+        success = extract_rows(png_get_rows(mem_read_ptr, mem_info_ptr),
+                               png_get_image_width(mem_read_ptr, mem_info_ptr),
+                               png_get_image_height(mem_read_ptr, mem_info_ptr),
+                               output);
+        record_trace_event(TRACE_END, "extract", NULL);
+        if(!success){
+            fprintf(stderr, "Error in extract_buffer(): %s\n", strerror(errno));
+        }
+    }
+
+    png_destroy_read_struct(&mem_read_ptr, &mem_info_ptr, NULL);
+    return success;
+}
+
+bool decode_png_memory(png_structp png_ptr, png_infop png_info, memory_source* source){
+    //Check if the buffer is actually a PNG
+    if(source->length < HEADER_LENGTH || png_sig_cmp(source->data, 0, HEADER_LENGTH)){
+        fprintf(stderr, "Error in decode_png_memory(): Buffer is not a .PNG."
+                        " Only .PNG files are supported\n");
+        return false;
+    }
+
+    //libpng reports errors by jumping back here
+    if(setjmp(png_jmpbuf(png_ptr))){
+        fprintf(stderr, "Error in decode_png_memory(): libpng could not decode the buffer\n");
+        return false;
+    }
+
+    png_set_read_fn(png_ptr, source, read_memory_source);
+    png_read_png(png_ptr, png_info, PNG_TRANSFORM_IDENTITY, NULL);
+
+    //Only accept 8 bit RGB and RGBA PNGs, the embedding loops assume 3 or 4 bytes a pixel
+    int bit_depth = png_get_bit_depth(png_ptr, png_info);
+    int color_type = png_get_color_type(png_ptr, png_info);
+    if(bit_depth != BYTE_SIZE){
+        fprintf(stderr, "Error in decode_png_memory(): Buffer's bit depth is not valid."
+                        " Provided image's bit depth is %d, only 8 bit depths are supported\n",
+                        bit_depth);
+        return false;
+    }
+    if(color_type != PNG_COLOR_TYPE_RGB && color_type != PNG_COLOR_TYPE_RGB_ALPHA){
+        fprintf(stderr, "Error in decode_png_memory(): Only RGB and RGBA images are supported\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool encode_png_memory(png_structp png_ptr, png_infop png_info, memory_buffer* output){
+    //libpng reports errors by jumping back here
+    if(setjmp(png_jmpbuf(png_ptr))){
+        fprintf(stderr, "Error in encode_png_memory(): libpng could not encode the image\n");
+        return false;
+    }
+
+    png_set_write_fn(png_ptr, output, write_memory_buffer, flush_memory_buffer);
+    png_write_png(png_ptr, png_info, PNG_TRANSFORM_IDENTITY, NULL);
+    return true;
+}
+
+void read_memory_source(png_structp png_ptr, png_bytep data, png_size_t length){
+    memory_source* source = png_get_io_ptr(png_ptr);
+    if(length > source->length - source->offset){
+        png_error(png_ptr, "Read past the end of the PNG buffer");
+    }
+    memcpy(data, source->data + source->offset, length);
+    source->offset += length;
+}
+
+void write_memory_buffer(png_structp png_ptr, png_bytep data, png_size_t length){
+    memory_buffer* output = png_get_io_ptr(png_ptr);
+    if(!append_memory_buffer(output, data, length)){
+        png_error(png_ptr, "Out of memory growing the PNG buffer");
+    }
+}
+
+void flush_memory_buffer(png_structp png_ptr){
+    //Nothing is buffered outside of the memory_buffer itself
+}
+
+bool start_progressive_extract(progressive_extractor* extractor, memory_buffer* output){
+    extractor->output = output;
+    extractor->stream = NULL;
+    extractor->flush_rows = false;
+    extractor->streamed = 0;
+    extractor->interlaced = false;
+    extractor->failed = false;
+    memset(&extractor->state, 0, sizeof(extract_state));
+    output->length = 0;
+
+    extractor->png_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+                                                  NULL, account_png_malloc, account_png_free);
+    if(extractor->png_ptr == NULL){
+        fprintf(stderr, "Error in start_progressive_extract(): png_create_read_struct() returned NULL\n");
+        return false;
+    }
+    extractor->info_ptr = png_create_info_struct(extractor->png_ptr);
+    if(extractor->info_ptr == NULL){
+        fprintf(stderr, "Error in start_progressive_extract(): png_create_info_struct() returned NULL\n");
+        png_destroy_read_struct(&extractor->png_ptr, NULL, NULL);
+        return false;
+    }
+
+    png_set_progressive_read_fn(extractor->png_ptr, extractor,
+                                progressive_info_callback, progressive_row_callback, NULL);
+    return true;
+}
+
+bool feed_progressive_extract(progressive_extractor* extractor, const png_byte* data, size_t length){
+    //Once the message is out the rest of the image doesn't need decoding
+    if(extractor->state.done || extractor->failed){
+        return !extractor->failed;
+    }
+
+    //libpng reports errors, including ones raised in the callbacks, by jumping back here
+    if(setjmp(png_jmpbuf(extractor->png_ptr))){
+        if(!extractor->interlaced){
+            fprintf(stderr, "Error in feed_progressive_extract(): libpng could not decode the data\n");
+        }
+        extractor->failed = true;
+        return false;
+    }
+
+    png_process_data(extractor->png_ptr, extractor->info_ptr, (png_bytep)data, length);
+    return true;
+}
+
+void finish_progressive_extract(progressive_extractor* extractor){
+    if(extractor->png_ptr != NULL){
+        png_destroy_read_struct(&extractor->png_ptr, &extractor->info_ptr, NULL);
+    }
+}
+
+void progressive_info_callback(png_structp png_ptr, png_infop png_info){
+    progressive_extractor* extractor = png_get_progressive_ptr(png_ptr);
+
+    //Only accept 8 bit, non-interlaced RGB and RGBA PNGs. Interlaced rows aren't
+    // final until the last pass, so they can't be extracted as they arrive and
+    // feed_progressive_extract() fails with extractor->interlaced set.
+    if(png_get_bit_depth(png_ptr, png_info) != BYTE_SIZE){
+        png_error(png_ptr, "Only 8 bit depths are supported");
+    }
+    int color_type = png_get_color_type(png_ptr, png_info);
+    if(color_type != PNG_COLOR_TYPE_RGB && color_type != PNG_COLOR_TYPE_RGB_ALPHA){
+        png_error(png_ptr, "Only RGB and RGBA images are supported");
+    }
+    //The caller decides what to do with interlaced images, so bail out quietly
+    if(png_get_interlace_type(png_ptr, png_info) != PNG_INTERLACE_NONE){
+        extractor->interlaced = true;
+        png_longjmp(png_ptr, 1);
+    }
+
+    start_extract_state(&extractor->state,
+                        png_get_image_width(png_ptr, png_info),
+                        png_get_image_height(png_ptr, png_info));
+    png_start_read_image(png_ptr);
+
+    //Only extract_data() starts out in the header phase, not verification or serving
+    if(stats_enabled && stats.phase == STATS_PHASE_HEADER){
+        stats.rows_total = png_get_image_height(png_ptr, png_info);
+        switch_stats_phase(STATS_PHASE_INFLATE);
+    }
+}
+
+void progressive_row_callback(png_structp png_ptr, png_bytep new_row, png_uint_32 row_num, int pass){
+    progressive_extractor* extractor = png_get_progressive_ptr(png_ptr);
+
+    if(new_row == NULL || extractor->state.done){
+        return;
+    }
+    bool timed = stats_enabled && stats.phase == STATS_PHASE_INFLATE;
+    if(timed){
+        stats.rows_decoded++;
+        switch_stats_phase(STATS_PHASE_EXTRACT);
+    }
+    if(!extract_row(&extractor->state, new_row, extractor->output)){
+        png_error(png_ptr, "Out of memory growing the message buffer");
+    }
+
+    if(extractor->stream != NULL){
+        memory_buffer* output = extractor->output;
+        switch_stats_phase(timed ? STATS_PHASE_IO : stats.phase);
+        if(fwrite(output->data, 1, output->length, extractor->stream) != output->length
+           || (extractor->flush_rows && fflush(extractor->stream) != 0)){
+            png_error(png_ptr, "Could not write the message");
+        }
+        extractor->streamed += output->length;
+        output->length = 0;
+    }
+    if(timed){
+        switch_stats_phase(STATS_PHASE_INFLATE);
+    }
+}
+
+bool reserve_memory_buffer(memory_buffer* buffer, size_t capacity){
+    if(capacity <= buffer->capacity){
+        return true;
+    }
+
+    //A memfd backed buffer grows the file and then the mapping over it
+    if(buffer->mapped){
+        void* mapping;
+        if(ftruncate(buffer->fd, capacity) == -1){
+            return false;
+        }
+        if(buffer->data == NULL){
+            mapping = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, buffer->fd, 0);
+        }else{
+            mapping = mremap(buffer->data, buffer->capacity, capacity, MREMAP_MAYMOVE);
+        }
+        if(mapping == MAP_FAILED){
+            return false;
+        }
+        count_allocation(ALLOC_COMPONENT_BUFFERS, capacity);
+        count_release(ALLOC_COMPONENT_BUFFERS, buffer->capacity);
+        buffer->data = mapping;
+        buffer->capacity = capacity;
+        return true;
+    }
+
+    //A moving realloc() has the old and new blocks live at once, so count it that way
+    png_bytep data = realloc(buffer->data, capacity);
+    if(data == NULL){
+        return false;
+    }
+    count_allocation(ALLOC_COMPONENT_BUFFERS, capacity);
+    count_release(ALLOC_COMPONENT_BUFFERS, buffer->capacity);
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+
+bool append_memory_buffer(memory_buffer* buffer, const png_byte* data, size_t length){
+    if(buffer->length + length > buffer->capacity){
+        //Double the buffer so a run of small appends stays linear
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        while(capacity < buffer->length + length){
+            capacity *= 2;
+        }
+        if(!reserve_memory_buffer(buffer, capacity)){
+            return false;
+        }
+    }
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return true;
+}
+
+void free_memory_buffer(memory_buffer* buffer){
+    count_release(ALLOC_COMPONENT_BUFFERS, buffer->capacity);
+
+    //Mapped buffers don't own their file descriptor
+    if(buffer->mapped){
+        if(buffer->data != NULL){
+            munmap(buffer->data, buffer->capacity);
+        }
+        buffer->mapped = false;
+    }else{
+        free(buffer->data);
+    }
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
+
+void output_embedded_png(){
+    FILE* output_png_fp;
+    output_png_fp = fopen(PNG_output_filename, "wb");
+    if(output_png_fp == NULL){
+        fprintf(stderr, "Error in output_embedded_png(): %s\n", strerror(errno));
+        exit_cleanly();
+    }
+
+    write_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+                                          NULL, account_png_malloc, account_png_free);
+    if(write_ptr == NULL){
+        fprintf(stderr, "Error in output_embedded_png(): png_create_write_struct() returned NULL\n");
+        exit_cleanly();
+    }
+
+    //Writes go through the stats callbacks if they are being timed
+    if(stats_enabled){
+        png_set_write_fn(write_ptr, output_png_fp, stats_write_data, stats_flush_data);
+    }else{
+        png_init_io(write_ptr, output_png_fp);
+    }
+    if(compact_embedding){
+        png_set_compression_level(write_ptr, Z_BEST_COMPRESSION);
+    }
+    png_set_rows(write_ptr, info_ptr, row_pointers);
+    switch_stats_phase(STATS_PHASE_DEFLATE);
+    png_write_png(write_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+    switch_stats_phase(STATS_PHASE_IO);
+    fclose(output_png_fp);
+    switch_stats_phase(STATS_PHASE_OTHER);
+}
+
+bool output_verified_png(const png_byte* payload, size_t payload_length){
+    memory_buffer encoded = {0};
+    memory_buffer extracted = {0};
+    struct stat st;
+
+    write_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+                                          NULL, account_png_malloc, account_png_free);
+    if(write_ptr == NULL){
+        fprintf(stderr, "Error in output_verified_png(): png_create_write_struct() returned NULL\n");
+        exit_cleanly();
+    }
+
+    //The encoded image is usually about the size of the original file
+    if(stat(PNG_filename, &st) == 0){
+        reserve_memory_buffer(&encoded, st.st_size + st.st_size / OUTPUT_SLACK_DIVISOR);
+    }
+    if(compact_embedding){
+        png_set_compression_level(write_ptr, Z_BEST_COMPRESSION);
+    }
+    png_set_rows(write_ptr, info_ptr, row_pointers);
+    switch_stats_phase(STATS_PHASE_DEFLATE);
+    if(!encode_png_memory(write_ptr, info_ptr, &encoded)){
+        free_memory_buffer(&encoded);
+        return false;
+    }
+
+    switch_stats_phase(STATS_PHASE_VERIFY);
+    bool verified = verify_embedded_png(&encoded, &extracted);
+    uLong expected = crc32(crc32(0L, Z_NULL, 0), payload, payload_length);
+    uLong found = crc32(crc32(0L, Z_NULL, 0), extracted.data, extracted.length);
+    verified = verified && extracted.length == payload_length && found == expected;
+    free_memory_buffer(&extracted);
+
+    //Nothing is written unless the message reads back intact
+    if(!verified){
+        fprintf(stderr, "Error in output_verified_png(): The encoded image doesn't hold the message,"
+                        " %s was not written\n", PNG_output_filename);
+        free_memory_buffer(&encoded);
+        return false;
+    }
+    switch_stats_phase(STATS_PHASE_IO);
+    if(!write_buffer_to_file(PNG_output_filename, &encoded)){
+        free_memory_buffer(&encoded);
+        return false;
+    }
+    switch_stats_phase(STATS_PHASE_OTHER);
+    stats.bytes_out += encoded.length;
+    fprintf(stdout, "Verified %zu bytes (CRC-32 %08lx) before writing %s\n",
+            payload_length, expected, PNG_output_filename);
+    free_memory_buffer(&encoded);
+    return true;
+}
+
+bool verify_embedded_png(const memory_buffer* encoded, memory_buffer* extracted){
+    progressive_extractor extractor;
+    size_t offset;
+
+    if(!start_progressive_extract(&extractor, extracted)){
+        return false;
+    }
+
+    //Feed in chunks so decoding stops soon after the last message row
+    for(offset = 0; offset < encoded->length && !extractor.state.done; offset += STREAM_CHUNK_LENGTH){
+        size_t length = encoded->length - offset < STREAM_CHUNK_LENGTH ? encoded->length - offset : STREAM_CHUNK_LENGTH;
+        if(!feed_progressive_extract(&extractor, encoded->data + offset, length)){
+            break;
+        }
+    }
+    finish_progressive_extract(&extractor);
+
+    //Interlaced rows aren't final until the last pass, so decode the whole image
+    if(extractor.interlaced){
+        return extract_buffer(encoded->data, encoded->length, extracted);
+    }
+    return extractor.state.done;
+}
+
+void calculate_available_space(png_structp read_ptr, png_infop info_ptr){
+    int width = png_get_image_width(read_ptr, info_ptr);
+    int height = png_get_image_height(read_ptr, info_ptr);
+
+    fprintf(stdout, "Image is %dpx x %dpx\n", width, height);
+
+    //One pixel is 3 bytes, we can store 1 bit per byte. So, we can store
+    // 3 bits per pixel, minus the bits used to store the message length.
+
+    available_space = payload_capacity(width, height);
+    float available_space_kb = available_space * 0.001;
+
+    fprintf(stdout, "Able to embed %d bytes (%.2f kilobytes) of data\n",
+                    available_space, available_space_kb);
+}
+
+bool check_message_size(){
+    struct stat st;
+    int err = stat(message_filename, &st);
+    if(err == -1){
+        fprintf(stderr, "Error in check_message_size(): %s\n", strerror(errno));
+        exit_cleanly();
+    }
+    message_length = st.st_size;
+
+    if(message_length > available_space){
+        fprintf(stderr, "Warning! Message is too large to embed in"
+                        " the provided image (%zu bytes too large).\nDo you"
+                        " wish to embed only the first %d bytes of the message"
+                        " instead? Y/N\n> ", message_length - available_space, available_space);
+        char input;
+        fscanf(stdin, " %c", &input);
+        getchar();
+        input = toupper(input);
+        if(input != 'Y'){
+            return false;
+        }
+
+        message_length = available_space;
+    }
+
+    return true;
+}
+
+void scan_data(int top_count){
+    scan_context context = {0};
+    scan_layout* layouts;
+    int i;
+
+    layouts = calloc(MAX_SCAN_LAYOUTS, sizeof(scan_layout));
+    if(layouts == NULL){
+        fprintf(stderr, "Error in scan_data(): %s\n", strerror(errno));
+        exit_cleanly();
+    }
+
+    context.layouts = layouts;
+    context.rows = row_pointers;
+    context.width = png_get_image_width(read_ptr, info_ptr);
+    context.height = png_get_image_height(read_ptr, info_ptr);
+    context.channels = png_get_channels(read_ptr, info_ptr);
+    context.count = build_scan_layouts(layouts, context.channels);
+
+    //Every hypothesis reads the same decoded rows, so they can be scored side by side
+    run_worker_threads(scan_worker, &context, context.count);
+
+    qsort(layouts, context.count, sizeof(scan_layout), compare_layout_scores);
+
+    if(top_count > context.count){
+        top_count = context.count;
+    }
+    fprintf(stdout, "Scored %d layouts, writing the top %d\n", context.count, top_count);
+    fprintf(stdout, "%-20s %8s %10s %8s  %s\n", "layout", "score", "printable", "entropy", "output");
+    for(i = 0; i < top_count; i++){
+        write_scan_layout(&context, &layouts[i]);
+    }
+
+    free(layouts);
+}
+
+int build_scan_layouts(scan_layout* layouts, int channels){
+    //Single channels, then all of them in order, then all of them reversed
+    static const char channel_names[] = "rgba";
+    int channel_sets[6][5];
+    int set_count = 0;
+    int count = 0;
+    int set;
+    int bit;
+    int order;
+    int traversal;
+    int c;
+
+    for(c = 0; c < channels; c++){
+        channel_sets[set_count][0] = 1;
+        channel_sets[set_count][1] = c;
+        set_count++;
+    }
+    channel_sets[set_count][0] = channels;
+    for(c = 0; c < channels; c++){
+        channel_sets[set_count][1 + c] = c;
+    }
+    set_count++;
+    channel_sets[set_count][0] = channels;
+    for(c = 0; c < channels; c++){
+        channel_sets[set_count][1 + c] = channels - 1 - c;
+    }
+    set_count++;
+
+    //This program's own layout comes first, read with its length field
+    strcpy(layouts[count].name, "pngstego");
+    layouts[count].native = true;
+    count++;
+
+    for(bit = 0; bit < BYTE_SIZE; bit++){
+        for(set = 0; set < set_count; set++){
+            for(order = 0; order < 2; order++){
+                for(traversal = 0; traversal < 2; traversal++){
+                    scan_layout* layout = &layouts[count++];
+                    char channel_text[5] = {0};
+
+                    layout->channel_count = channel_sets[set][0];
+                    for(c = 0; c < layout->channel_count; c++){
+                        layout->channels[c] = channel_sets[set][1 + c];
+                        channel_text[c] = channel_names[layout->channels[c]];
+                    }
+                    layout->bit = bit;
+                    layout->msb_first = order == 1;
+                    layout->column_major = traversal == 1;
+                    snprintf(layout->name, sizeof(layout->name), "b%d.%s.%s.%s", bit, channel_text,
+                             layout->msb_first ? "msb" : "lsb", layout->column_major ? "col" : "row");
+                }
+            }
+        }
+    }
+
+    return count;
+}
+
+void* scan_worker(void* arg){
+    scan_context* context = arg;
+    png_byte sample[SCAN_SAMPLE_LENGTH];
+    int index;
+
+    while((index = __atomic_fetch_add(&context->next, 1, __ATOMIC_RELAXED)) < context->count){
+        scan_layout* layout = &context->layouts[index];
+        size_t length = read_scan_layout(context, layout, sample, SCAN_SAMPLE_LENGTH);
+        score_scan_sample(layout, sample, length);
+    }
+
+    return NULL;
+}
+
+size_t read_scan_layout(const scan_context* context, const scan_layout* layout,
+                        png_bytep output, size_t max_length){
+    png_byte value = 0;
+    size_t length = 0;
+    int bits = 0;
+    int outer;
+    int inner;
+    int c;
+
+    if(layout->native){
+        memory_buffer message = {0};
+        extract_state state;
+        int row;
+
+        start_extract_state(&state, context->width, context->height);
+        for(row = 0; row < context->height && !state.done && message.length < max_length; row++){
+            if(!extract_row(&state, context->rows[row], &message)){
+                break;
+            }
+        }
+        length = message.length < max_length ? message.length : max_length;
+        if(length > 0){
+            memcpy(output, message.data, length);
+        }
+        free_memory_buffer(&message);
+        return length;
+    }
+
+    int outer_count = layout->column_major ? context->width : context->height;
+    int inner_count = layout->column_major ? context->height : context->width;
+    for(outer = 0; outer < outer_count; outer++){
+        for(inner = 0; inner < inner_count; inner++){
+            int x = layout->column_major ? outer : inner;
+            int y = layout->column_major ? inner : outer;
+            png_const_bytep pixel = context->rows[y] + (size_t)x * context->channels;
+
+            for(c = 0; c < layout->channel_count; c++){
+                int bit_value = (pixel[layout->channels[c]] >> layout->bit) & 1;
+                if(layout->msb_first){
+                    value |= bit_value << (BYTE_SIZE - 1 - bits);
+                }else{
+                    value |= bit_value << bits;
+                }
+
+                if(++bits == BYTE_SIZE){
+                    output[length++] = value;
+                    if(length == max_length){
+                        return length;
+                    }
+                    value = 0;
+                    bits = 0;
+                }
+            }
+        }
+    }
+
+    return length;
+}
+
+void score_scan_sample(scan_layout* layout, const png_byte* sample, size_t length){
+    size_t counts[256] = {0};
+    size_t printable = 0;
+    size_t distinct = 0;
+    size_t i;
+
+    layout->score = 0;
+    layout->printable_ratio = 0;
+    layout->entropy = 0;
+    layout->magic = NULL;
+    if(length == 0){
+        return;
+    }
+
+    for(i = 0; i < length; i++){
+        counts[sample[i]]++;
+        if(isprint(sample[i]) || isspace(sample[i])){
+            printable++;
+        }
+    }
+    for(i = 0; i < 256; i++){
+        if(counts[i] > 0){
+            double p = (double)counts[i] / length;
+            layout->entropy -= p * log2(p);
+            distinct++;
+        }
+    }
+    layout->printable_ratio = (double)printable / length;
+    layout->magic = identify_magic(sample, length);
+
+    //A flat region gives a run of nearly one byte, which is structured but holds nothing
+    if(layout->magic == NULL && (distinct <= 1 || layout->entropy < 1.0)){
+        return;
+    }
+
+    //Known file signatures win outright. After that, text-like samples and low
+    // entropy score higher, since LSBs of an untouched image look random.
+    layout->score = (layout->magic != NULL ? 100 : 0)
+                    + 10 * layout->printable_ratio
+                    + (BYTE_SIZE - layout->entropy);
+}
+
+const char* identify_magic(const png_byte* sample, size_t length){
+    static const struct {
+        const char* name;
+        const char* bytes;
+        size_t length;
+    } signatures[] = {
+        {"png", "\x89PNG\r\n\x1a\n", 8},
+        {"jpeg", "\xff\xd8\xff", 3},
+        {"gif", "GIF8", 4},
+        {"zip", "PK\x03\x04", 4},
+        {"gzip", "\x1f\x8b", 2},
+        {"bzip2", "BZh", 3},
+        {"7z", "7z\xbc\xaf\x27\x1c", 6},
+        {"pdf", "%PDF", 4},
+        {"elf", "\x7f" "ELF", 4},
+        {"rar", "Rar!", 4}
+    };
+    size_t i;
+
+    for(i = 0; i < sizeof(signatures) / sizeof(signatures[0]); i++){
+        if(length >= signatures[i].length && memcmp(sample, signatures[i].bytes, signatures[i].length) == 0){
+            return signatures[i].name;
+        }
+    }
+    return NULL;
+}
+
+int compare_layout_scores(const void* a, const void* b){
+    const scan_layout* first = a;
+    const scan_layout* second = b;
+
+    if(first->score != second->score){
+        return first->score < second->score ? 1 : -1;
+    }
+    return 0;
+}
+
+void write_scan_layout(const scan_context* context, const scan_layout* layout){
+    char filename[FILENAME_MAX_LENGTH];
+    const char* base = strrchr(PNG_filename, '/');
+    size_t directory_length = base != NULL ? (size_t)(base - PNG_filename) + 1 : 0;
+    size_t max_length = (size_t)context->width * context->height * context->channels / BYTE_SIZE;
+    png_bytep output;
+    FILE* fp;
+
+    //Write the output next to the image
+    base = PNG_filename + directory_length;
+    if(snprintf(filename, sizeof(filename), "%.*sextracted_%s.%s.bin", (int)directory_length,
+                PNG_filename, base, layout->name) >= (int)sizeof(filename)){
+        fprintf(stderr, "Error in write_scan_layout(): Output filename is too long\n");
+        return;
+    }
+
+    output = malloc(max_length > 0 ? max_length : 1);
+    if(output == NULL){
+        fprintf(stderr, "Error in write_scan_layout(): %s\n", strerror(errno));
+        return;
+    }
+    size_t length = read_scan_layout(context, layout, output, max_length);
+
+    fp = fopen(filename, "wb");
+    if(fp == NULL || fwrite(output, 1, length, fp) != length){
+        fprintf(stderr, "Error in write_scan_layout(): %s: %s\n", filename, strerror(errno));
+    }else{
+        fprintf(stdout, "%-20s %8.2f %10.3f %8.3f  %s%s%s\n", layout->name, layout->score,
+                layout->printable_ratio, layout->entropy, filename,
+                layout->magic != NULL ? " magic:" : "", layout->magic != NULL ? layout->magic : "");
+    }
+    if(fp != NULL){
+        fclose(fp);
+    }
+    free(output);
+}
+
+void analyze_data(int region_count){
+    analyze_context context = {0};
+    channel_statistics total;
+    int region;
+    int c;
+
+    context.rows = row_pointers;
+    context.width = png_get_image_width(read_ptr, info_ptr);
+    context.height = png_get_image_height(read_ptr, info_ptr);
+    context.channels = png_get_channels(read_ptr, info_ptr);
+    if(region_count < 1){
+        region_count = 1;
+    }
+    if(region_count > ANALYSIS_MAX_REGIONS){
+        region_count = ANALYSIS_MAX_REGIONS;
+    }
+    if(region_count > context.height){
+        region_count = context.height;
+    }
+    context.region_count = region_count;
+    context.statistics = calloc((size_t)region_count * context.channels, sizeof(channel_statistics));
+    if(context.statistics == NULL){
+        fprintf(stderr, "Error in analyze_data(): %s\n", strerror(errno));
+        exit_cleanly();
+    }
+    pthread_mutex_init(&context.lock, NULL);
+
+    //Every statistic is a sum over rows, so the rows can be counted side by side
+    int chunks = (context.height + ANALYSIS_ROW_CHUNK - 1) / ANALYSIS_ROW_CHUNK;
+    run_worker_threads(analyze_worker, &context, chunks);
+    pthread_mutex_destroy(&context.lock);
+    if(context.failed){
+        fprintf(stderr, "Error in analyze_data(): out of memory\n");
+        free(context.statistics);
+        exit_cleanly();
+    }
+
+    channel_statistics* statistics = context.statistics;
+    int channels = context.channels;
+    int height = context.height;
+    fprintf(stdout, "%-8s %-12s %-8s %12s %10s %10s\n",
+            "region", "rows", "channel", "chi-square p", "RS rate", "SPA rate");
+    for(c = 0; c < channels; c++){
+        memset(&total, 0, sizeof(total));
+        for(region = 0; region < region_count; region++){
+            merge_channel_statistics(&total, &statistics[region * channels + c]);
+        }
+        print_channel_statistics("all", 0, height - 1, c, &total);
+    }
+    if(region_count > 1){
+        for(region = 0; region < region_count; region++){
+            char name[16];
+            int first_row = (int)(((int64_t)region * height + region_count - 1) / region_count);
+            int last_row = (int)(((int64_t)(region + 1) * height + region_count - 1) / region_count) - 1;
+            snprintf(name, sizeof(name), "%d", region);
+            for(c = 0; c < channels; c++){
+                print_channel_statistics(name, first_row, last_row, c, &statistics[region * channels + c]);
+            }
+        }
+    }
+
+    free(statistics);
+}
+
+void* analyze_worker(void* arg){
+    analyze_context* context = arg;
+    size_t count = (size_t)context->region_count * context->channels;
+    channel_statistics* statistics = calloc(count, sizeof(channel_statistics));
+    png_bytep plane = malloc(context->width + ANALYSIS_PLANE_PADDING);
+    int first_row;
+    size_t i;
+
+    //Leave exiting to analyze_data(), which can free what the other threads share
+    if(statistics == NULL || plane == NULL){
+        free(plane);
+        free(statistics);
+        pthread_mutex_lock(&context->lock);
+        context->failed = true;
+        pthread_mutex_unlock(&context->lock);
+        return NULL;
+    }
+
+    while((first_row = __atomic_fetch_add(&context->next_row, ANALYSIS_ROW_CHUNK, __ATOMIC_RELAXED))
+          < context->height){
+        int last_row = first_row + ANALYSIS_ROW_CHUNK;
+        int row;
+        if(last_row > context->height){
+            last_row = context->height;
+        }
+
+        //Split each row into one contiguous plane per channel so every kernel runs
+        // over packed bytes, then count into the statistics for the row's region
+        for(row = first_row; row < last_row; row++){
+            int region = (int)((int64_t)row * context->region_count / context->height);
+            int c;
+            for(c = 0; c < context->channels; c++){
+                png_bytep samples = context->rows[row] + c;
+                int x;
+                for(x = 0; x < context->width; x++){
+                    plane[x] = samples[(size_t)x * context->channels];
+                }
+                count_plane_statistics(&statistics[region * context->channels + c], plane, context->width);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&context->lock);
+    for(i = 0; i < count; i++){
+        merge_channel_statistics(&context->statistics[i], &statistics[i]);
+    }
+    pthread_mutex_unlock(&context->lock);
+
+    free(plane);
+    free(statistics);
+    return NULL;
+}
+
+void count_plane_statistics(channel_statistics* statistics, const png_byte* plane, int width){
+    int x = 0;
+
+    //Four histograms break the dependency between neighbouring equal samples
+    for(; x + 4 <= width; x += 4){
+        statistics->histogram[0][plane[x]]++;
+        statistics->histogram[1][plane[x + 1]]++;
+        statistics->histogram[2][plane[x + 2]]++;
+        statistics->histogram[3][plane[x + 3]]++;
+    }
+    for(; x < width; x++){
+        statistics->histogram[0][plane[x]]++;
+    }
+
+    count_sample_pairs(statistics, plane, width);
+
+    //RS groups are four neighbouring samples that don't overlap
+    for(x = 0; x + 4 <= width; x += 4){
+        count_rs_group(statistics, plane + x);
+    }
+}
+
+void count_sample_pairs(channel_statistics* statistics, const png_byte* plane, int width){
+    int pairs = width - 1;
+    int x = 0;
+
+    if(pairs <= 0){
+        return;
+    }
+    statistics->spa_pairs += pairs;
+
+#ifdef __SSE2__
+    //Each lane of a comparison is 0xFF when it holds, so subtracting it counts by one.
+    // Lanes are emptied into 64 bit sums with psadbw before they can wrap.
+    const __m128i low_bit = _mm_set1_epi8(1);
+    const __m128i high_bits = _mm_set1_epi8((char)0xFE);
+    const __m128i zero = _mm_setzero_si128();
+    while(x + 16 <= pairs){
+        __m128i x_count = zero;
+        __m128i y_count = zero;
+        __m128i k_count = zero;
+        int block_end = x + 16 * 255;
+        if(block_end > pairs){
+            block_end = pairs;
+        }
+
+        for(; x + 16 <= block_end; x += 16){
+            __m128i r = _mm_loadu_si128((const __m128i*)(plane + x));
+            __m128i s = _mm_loadu_si128((const __m128i*)(plane + x + 1));
+            __m128i larger = _mm_max_epu8(r, s);
+            __m128i equal = _mm_cmpeq_epi8(r, s);
+            __m128i r_less = _mm_andnot_si128(equal, _mm_cmpeq_epi8(larger, s));
+            __m128i r_greater = _mm_andnot_si128(equal, _mm_cmpeq_epi8(larger, r));
+            __m128i s_odd = _mm_cmpeq_epi8(_mm_and_si128(s, low_bit), low_bit);
+
+            __m128i x_pair = _mm_or_si128(_mm_andnot_si128(s_odd, r_less), _mm_and_si128(s_odd, r_greater));
+            __m128i y_pair = _mm_or_si128(_mm_andnot_si128(s_odd, r_greater), _mm_and_si128(s_odd, r_less));
+            __m128i k_pair = _mm_cmpeq_epi8(_mm_and_si128(r, high_bits), _mm_and_si128(s, high_bits));
+
+            x_count = _mm_sub_epi8(x_count, x_pair);
+            y_count = _mm_sub_epi8(y_count, y_pair);
+            k_count = _mm_sub_epi8(k_count, k_pair);
+        }
+
+        __m128i x_sum = _mm_sad_epu8(x_count, zero);
+        __m128i y_sum = _mm_sad_epu8(y_count, zero);
+        __m128i k_sum = _mm_sad_epu8(k_count, zero);
+        statistics->spa_x += _mm_cvtsi128_si32(x_sum) + _mm_extract_epi16(x_sum, 4);
+        statistics->spa_y += _mm_cvtsi128_si32(y_sum) + _mm_extract_epi16(y_sum, 4);
+        statistics->spa_k += _mm_cvtsi128_si32(k_sum) + _mm_extract_epi16(k_sum, 4);
+    }
+#endif
+
+    for(; x < pairs; x++){
+        png_byte r = plane[x];
+        png_byte s = plane[x + 1];
+        if(((s & 1) == 0 && r < s) || ((s & 1) == 1 && r > s)){
+            statistics->spa_x++;
+        }
+        if(((s & 1) == 0 && r > s) || ((s & 1) == 1 && r < s)){
+            statistics->spa_y++;
+        }
+        if((r >> 1) == (s >> 1)){
+            statistics->spa_k++;
+        }
+    }
+}
+
+void count_rs_group(channel_statistics* statistics, const png_byte* group){
+    //The mask flips the middle two samples. F1 swaps 2k and 2k+1, F-1 swaps 2k-1 and 2k.
+    int flipped;
+
+    statistics->rs_groups++;
+
+    //The same group is classified again with every LSB flipped, as RS needs
+    for(flipped = 0; flipped < 2; flipped++){
+        int g0 = group[0] ^ flipped;
+        int g1 = group[1] ^ flipped;
+        int g2 = group[2] ^ flipped;
+        int g3 = group[3] ^ flipped;
+        int p1 = g1 ^ 1;
+        int p2 = g2 ^ 1;
+        int n1 = ((g1 + 1) ^ 1) - 1;
+        int n2 = ((g2 + 1) ^ 1) - 1;
+
+        int smoothness = abs(g1 - g0) + abs(g2 - g1) + abs(g3 - g2);
+        int positive_smoothness = abs(p1 - g0) + abs(p2 - p1) + abs(g3 - p2);
+        int negative_smoothness = abs(n1 - g0) + abs(n2 - n1) + abs(g3 - n2);
+
+        statistics->rs_regular[flipped][0] += positive_smoothness > smoothness;
+        statistics->rs_singular[flipped][0] += positive_smoothness < smoothness;
+        statistics->rs_regular[flipped][1] += negative_smoothness > smoothness;
+        statistics->rs_singular[flipped][1] += negative_smoothness < smoothness;
+    }
+}
+
+void merge_channel_statistics(channel_statistics* total, const channel_statistics* part){
+    int i;
+    int j;
+
+    for(i = 0; i < 4; i++){
+        for(j = 0; j < 256; j++){
+            total->histogram[i][j] += part->histogram[i][j];
+        }
+    }
+    total->spa_x += part->spa_x;
+    total->spa_y += part->spa_y;
+    total->spa_k += part->spa_k;
+    total->spa_pairs += part->spa_pairs;
+    total->rs_groups += part->rs_groups;
+    for(i = 0; i < 2; i++){
+        for(j = 0; j < 2; j++){
+            total->rs_regular[i][j] += part->rs_regular[i][j];
+            total->rs_singular[i][j] += part->rs_singular[i][j];
+        }
+    }
+}
+
+void print_channel_statistics(const char* region, int first_row, int last_row, int channel,
+                              const channel_statistics* statistics){
+    static const char* channel_names[] = {"red", "green", "blue", "alpha"};
+    char rows[32];
+
+    snprintf(rows, sizeof(rows), "%d-%d", first_row, last_row);
+    fprintf(stdout, "%-8s %-12s %-8s %12.4f %10.4f %10.4f\n", region, rows, channel_names[channel],
+            chi_square_probability(statistics), rs_embedding_rate(statistics),
+            spa_embedding_rate(statistics));
+}
+
+double chi_square_probability(const channel_statistics* statistics){
+    double chi_square = 0;
+    int degrees = -1;
+    int k;
+
+    //Embedding evens out each pair of values 2k and 2k+1. Pairs with too few
+    // samples to judge are left out, as in Westfeld and Pfitzmann's attack.
+    for(k = 0; k < 128; k++){
+        double even = 0;
+        double odd = 0;
+        int i;
+        for(i = 0; i < 4; i++){
+            even += statistics->histogram[i][2 * k];
+            odd += statistics->histogram[i][2 * k + 1];
+        }
+        double expected = (even + odd) / 2;
+        if(expected >= 5){
+            chi_square += (even - expected) * (even - expected) / expected;
+            degrees++;
+        }
+    }
+    if(degrees < 1){
+        return 0;
+    }
+
+    //The probability that the pairs are this even by chance, near 1 for embedded data
+    return 1 - regularized_gamma_p(degrees / 2.0, chi_square / 2);
+}
+
+double rs_embedding_rate(const channel_statistics* statistics){
+    double groups = statistics->rs_groups;
+    if(groups == 0){
+        return 0;
+    }
+
+    //Fridrich, Goljan and Du's quadratic in the differences between regular and
+    // singular groups, with and without all LSBs flipped
+    double d0 = (statistics->rs_regular[0][0] - (double)statistics->rs_singular[0][0]) / groups;
+    double d1 = (statistics->rs_regular[1][0] - (double)statistics->rs_singular[1][0]) / groups;
+    double n0 = (statistics->rs_regular[0][1] - (double)statistics->rs_singular[0][1]) / groups;
+    double n1 = (statistics->rs_regular[1][1] - (double)statistics->rs_singular[1][1]) / groups;
+    double a = 2 * (d1 + d0);
+    double b = n0 - n1 - d1 - 3 * d0;
+    double c = d0 - n0;
+    double x;
+
+    if(fabs(a) < 1e-12){
+        if(fabs(b) < 1e-12){
+            return 0;
+        }
+        x = -c / b;
+    }else{
+        double discriminant = b * b - 4 * a * c;
+        if(discriminant < 0){
+            discriminant = 0;
+        }
+        double root1 = (-b + sqrt(discriminant)) / (2 * a);
+        double root2 = (-b - sqrt(discriminant)) / (2 * a);
+        x = fabs(root1) < fabs(root2) ? root1 : root2;
+    }
+    if(fabs(x - 0.5) < 1e-12){
+        return 0;
+    }
+
+    double rate = x / (x - 0.5);
+    return rate < 0 ? 0 : rate > 1 ? 1 : rate;
+}
+
+double spa_embedding_rate(const channel_statistics* statistics){
+    //Dumitrescu, Wu and Wang's sample pair analysis, in the closed form used by
+    // most implementations
+    double a = 2.0 * statistics->spa_k;
+    double b = 2.0 * (2.0 * statistics->spa_x - statistics->spa_pairs);
+    double c = (double)statistics->spa_y - statistics->spa_x;
+
+    if(a == 0){
+        return 0;
+    }
+
+    double discriminant = b * b - 4 * a * c;
+    if(discriminant < 0){
+        discriminant = 0;
+    }
+    double root1 = (-b + sqrt(discriminant)) / (2 * a);
+    double root2 = (-b - sqrt(discriminant)) / (2 * a);
+    double changed = root1 < root2 ? root1 : root2;
+    if(changed < 0){
+        changed = fabs(root1) < fabs(root2) ? root1 : root2;
+    }
+
+    //The root is the fraction of LSBs changed, half the fraction embedded into
+    double rate = 2 * changed;
+    return rate < 0 ? 0 : rate > 1 ? 1 : rate;
+}
+
+double regularized_gamma_p(double a, double x){
+    double log_prefix;
+    int n;
+
+    if(x <= 0){
+        return 0;
+    }
+    log_prefix = -x + a * log(x) - lgamma(a);
+
+    //Series below a + 1, continued fraction above, as in Numerical Recipes
+    if(x < a + 1){
+        double term = 1 / a;
+        double sum = term;
+        for(n = 1; n < 1000; n++){
+            term *= x / (a + n);
+            sum += term;
+            if(fabs(term) < fabs(sum) * 1e-14){
+                break;
+            }
+        }
+        return sum * exp(log_prefix);
+    }
+
+    double b = x + 1 - a;
+    double c = 1 / 1e-300;
+    double d = 1 / b;
+    double h = d;
+    for(n = 1; n < 1000; n++){
+        double an = -n * (n - a);
+        b += 2;
+        d = an * d + b;
+        if(fabs(d) < 1e-300){
+            d = 1e-300;
+        }
+        c = b + an / c;
+        if(fabs(c) < 1e-300){
+            c = 1e-300;
+        }
+        d = 1 / d;
+        double delta = d * c;
+        h *= delta;
+        if(fabs(delta - 1) < 1e-14){
+            break;
+        }
+    }
+    return 1 - exp(log_prefix) * h;
+}
+
+bool sanitize_png(const char* input_filename, const char* output_filename, int planes, bool randomize){
+    png_infop write_info;
+    png_bytep volatile row = NULL;
+    png_bytep* volatile rows = NULL;
+    char partial[FILENAME_MAX_LENGTH];
+    png_uint_32 width;
+    png_uint_32 height;
+    int bit_depth;
+    int color_type;
+    int interlace_type;
+    png_byte mask[16];
+    uint64_t random_state[2] = {0, 0};
+    FILE* input_fp;
+    FILE* output_fp;
+    png_uint_32 y;
+    int i;
+
+    if(planes < 1 || planes > BYTE_SIZE){
+        fprintf(stderr, "Error in sanitize_png(): Between 1 and 8 bit planes can be sanitized\n");
+        exit_cleanly();
+    }
+
+    input_fp = fopen(input_filename, "rb");
+    if(input_fp == NULL){
+        fprintf(stderr, "Error in sanitize_png(): %s\n", strerror(errno));
+        exit_cleanly();
+    }
+    read_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info_ptr = read_ptr != NULL ? png_create_info_struct(read_ptr) : NULL;
+    if(info_ptr == NULL){
+        fprintf(stderr, "Error in sanitize_png(): libpng could not allocate a reader\n");
+        exit_cleanly();
+    }
+    if(setjmp(png_jmpbuf(read_ptr))){
+        fprintf(stderr, "Error in sanitize_png(): libpng could not decode the image\n");
+        exit_cleanly();
+    }
+    png_init_io(read_ptr, input_fp);
+    png_read_info(read_ptr, info_ptr);
+    png_get_IHDR(read_ptr, info_ptr, &width, &height, &bit_depth, &color_type, &interlace_type, NULL, NULL);
+
+    //Palette indices and packed samples don't have a low bit plane that can be
+    // changed without changing the picture, so only whole byte samples are handled
+    if((bit_depth != 8 && bit_depth != 16) || (color_type & PNG_COLOR_MASK_PALETTE)){
+        fprintf(stderr, "Error in sanitize_png(): Only 8 and 16 bit gray, gray and alpha,"
+                        " RGB and RGBA images can be sanitized\n");
+        exit_cleanly();
+    }
+
+    //16 bit samples are stored high byte first, so only every other byte is touched
+    for(i = 0; i < 16; i++){
+        mask[i] = (bit_depth == 16 && i % 2 == 0) ? 0 : (png_byte)((1 << planes) - 1);
+    }
+    if(randomize && getrandom(random_state, sizeof(random_state), 0) != sizeof(random_state)){
+        fprintf(stderr, "Error in sanitize_png(): %s\n", strerror(errno));
         exit_cleanly();
     }
+    //xorshift never leaves an all zero state
+    random_state[0] |= 1;
+    random_state[1] |= 1;
+
+    //The output only gets its name once it is complete, so a truncated input doesn't
+    // leave a truncated image behind
+    if(snprintf(partial, sizeof(partial), "%s%s", output_filename, SANITIZE_PARTIAL_SUFFIX) >= (int)sizeof(partial)){
+        fprintf(stderr, "Error in sanitize_png(): %s is too long\n", output_filename);
+        exit_cleanly();
+    }
+    output_fp = fopen(partial, "wb");
+    if(output_fp == NULL){
+        fprintf(stderr, "Error in sanitize_png(): %s\n", strerror(errno));
+        exit_cleanly();
+    }
+    write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    write_info = write_ptr != NULL ? png_create_info_struct(write_ptr) : NULL;
+    if(write_info == NULL){
+        fprintf(stderr, "Error in sanitize_png(): libpng could not allocate a writer\n");
+        fclose(output_fp);
+        unlink(partial);
+        exit_cleanly();
+    }
+
+    //From here on a decode error is raised while the output is half written, so
+    // both handlers take the partial file back
+    if(setjmp(png_jmpbuf(write_ptr))){
+        fprintf(stderr, "Error in sanitize_png(): libpng could not encode the image\n");
+        discard_sanitized_png(output_fp, partial, row, rows, &write_info);
+        fclose(input_fp);
+        return false;
+    }
+    if(setjmp(png_jmpbuf(read_ptr))){
+        fprintf(stderr, "Error in sanitize_png(): libpng could not decode the image\n");
+        discard_sanitized_png(output_fp, partial, row, rows, &write_info);
+        fclose(input_fp);
+        return false;
+    }
+    png_init_io(write_ptr, output_fp);
+    png_set_compression_level(write_ptr, SANITIZE_COMPRESSION_LEVEL);
+
+    //Only the chunks that change how the image looks are copied. Text and private
+    // chunks are somewhere else a payload could hide.
+    png_set_IHDR(write_ptr, write_info, width, height, bit_depth, color_type,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    copy_colour_chunks(read_ptr, info_ptr, write_ptr, write_info);
+    png_write_info(write_ptr, write_info);
+
+    size_t row_bytes = png_get_rowbytes(read_ptr, info_ptr);
+    if(interlace_type == PNG_INTERLACE_NONE){
+        //Rows go straight from the decoder to the encoder, one row of memory in all
+        row = malloc(row_bytes);
+        if(row == NULL){
+            fprintf(stderr, "Error in sanitize_png(): %s\n", strerror(errno));
+            discard_sanitized_png(output_fp, partial, row, rows, &write_info);
+            fclose(input_fp);
+            return false;
+        }
+        for(y = 0; y < height; y++){
+            png_read_row(read_ptr, row, NULL);
+            sanitize_row(row, row_bytes, mask, randomize ? random_state : NULL);
+            png_write_row(write_ptr, row);
+        }
+        free(row);
+        row = NULL;
+    }else{
+        //Interlaced rows aren't final until the last pass, so the whole image is read
+        rows = malloc(height * sizeof(png_bytep));
+        row = malloc(row_bytes * height);
+        if(rows == NULL || row == NULL){
+            fprintf(stderr, "Error in sanitize_png(): %s\n", strerror(errno));
+            discard_sanitized_png(output_fp, partial, row, rows, &write_info);
+            fclose(input_fp);
+            return false;
+        }
+        for(y = 0; y < height; y++){
+            rows[y] = row + row_bytes * y;
+        }
+        png_set_interlace_handling(read_ptr);
+        png_read_image(read_ptr, rows);
+        for(y = 0; y < height; y++){
+            sanitize_row(rows[y], row_bytes, mask, randomize ? random_state : NULL);
+            png_write_row(write_ptr, rows[y]);
+        }
+        free(rows);
+        free(row);
+        rows = NULL;
+        row = NULL;
+    }
+
+    png_write_end(write_ptr, NULL);
+    png_destroy_write_struct(&write_ptr, &write_info);
+    fclose(input_fp);
+    if(fclose(output_fp) != 0 || rename(partial, output_filename) != 0){
+        fprintf(stderr, "Error in sanitize_png(): %s: %s\n", output_filename, strerror(errno));
+        unlink(partial);
+        return false;
+    }
+
+    fprintf(stdout, "%s %d bit plane%s of %u rows, written to %s\n", randomize ? "Randomized" : "Cleared",
+            planes, planes == 1 ? "" : "s", height, output_filename);
+    return true;
+}
+
+void discard_sanitized_png(FILE* output_fp, const char* partial, png_bytep row, png_bytep* rows, png_infop* write_info){
+    png_destroy_write_struct(&write_ptr, write_info);
+    fclose(output_fp);
+    unlink(partial);
+    free(rows);
+    free(row);
+}
+
+void copy_colour_chunks(png_structp read_ptr, png_infop read_info, png_structp write_ptr, png_infop write_info){
+    double gamma;
+    int intent;
+    double white_x, white_y, red_x, red_y, green_x, green_y, blue_x, blue_y;
+    png_uint_32 x_resolution;
+    png_uint_32 y_resolution;
+    int unit;
+    png_bytep alpha;
+    int alpha_count;
+    png_color_16p transparent;
+
+    if(png_get_sRGB(read_ptr, read_info, &intent)){
+        png_set_sRGB(write_ptr, write_info, intent);
+    }
+    if(png_get_gAMA(read_ptr, read_info, &gamma)){
+        png_set_gAMA(write_ptr, write_info, gamma);
+    }
+    if(png_get_cHRM(read_ptr, read_info, &white_x, &white_y, &red_x, &red_y,
+                    &green_x, &green_y, &blue_x, &blue_y)){
+        png_set_cHRM(write_ptr, write_info, white_x, white_y, red_x, red_y,
+                     green_x, green_y, blue_x, blue_y);
+    }
+    if(png_get_pHYs(read_ptr, read_info, &x_resolution, &y_resolution, &unit)){
+        png_set_pHYs(write_ptr, write_info, x_resolution, y_resolution, unit);
+    }
+    if(png_get_tRNS(read_ptr, read_info, &alpha, &alpha_count, &transparent)){
+        png_set_tRNS(write_ptr, write_info, alpha, alpha_count, transparent);
+    }
+}
+
+void sanitize_row(png_bytep row, size_t length, const png_byte* mask, uint64_t* random_state){
+    size_t i = 0;
+
+#ifdef __SSE2__
+    //Two xorshift64 generators side by side give 16 random bytes a step
+    const __m128i planes = _mm_loadu_si128((const __m128i*)mask);
+    __m128i state = random_state != NULL
+                    ? _mm_set_epi64x((long long)random_state[1], (long long)random_state[0])
+                    : _mm_setzero_si128();
+    for(; i + 16 <= length; i += 16){
+        __m128i samples = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i bits = _mm_setzero_si128();
+        if(random_state != NULL){
+            state = _mm_xor_si128(state, _mm_slli_epi64(state, 13));
+            state = _mm_xor_si128(state, _mm_srli_epi64(state, 7));
+            state = _mm_xor_si128(state, _mm_slli_epi64(state, 17));
+            bits = _mm_and_si128(state, planes);
+        }
+        samples = _mm_or_si128(_mm_andnot_si128(planes, samples), bits);
+        _mm_storeu_si128((__m128i*)(row + i), samples);
+    }
+    if(random_state != NULL){
+        random_state[0] = (uint64_t)_mm_cvtsi128_si64(state);
+        random_state[1] = (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(state, state));
+    }
+#endif
+
+    //One xorshift64 step covers eight bytes, the mask repeats every sixteen
+    for(; i < length; i += 8){
+        uint64_t bits = 0;
+        size_t j;
+        if(random_state != NULL){
+            random_state[0] ^= random_state[0] << 13;
+            random_state[0] ^= random_state[0] >> 7;
+            random_state[0] ^= random_state[0] << 17;
+            bits = random_state[0];
+        }
+        for(j = 0; j < 8 && i + j < length; j++){
+            png_byte plane_mask = mask[(i + j) % 16];
+            row[i + j] = (row[i + j] & ~plane_mask) | ((bits >> (8 * j)) & plane_mask);
+        }
+    }
+}
+
+void export_bitplanes(const char* spec){
+    bitplane_context context = {0};
+    bitplane planes[4 * BYTE_SIZE];
+
+    context.planes = planes;
+    context.rows = row_pointers;
+    context.width = png_get_image_width(read_ptr, info_ptr);
+    context.height = png_get_image_height(read_ptr, info_ptr);
+    context.channels = png_get_channels(read_ptr, info_ptr);
+    context.count = parse_bitplane_spec(spec, context.channels, planes);
+    if(context.count == 0){
+        fprintf(stderr, "Error in export_bitplanes(): \"%s\" doesn't name any bit planes of this image."
+                        " Use a list like 0,r1,g7 or all\n", spec);
+        exit_cleanly();
+    }
+    pthread_mutex_init(&context.output_lock, NULL);
+
+    //Every plane reads the same decoded rows into its own file, so they can be written side by side
+    run_worker_threads(bitplane_worker, &context, context.count);
+    pthread_mutex_destroy(&context.output_lock);
+}
+
+int parse_bitplane_spec(const char* spec, int channels, bitplane* planes){
+    static const char channel_names[] = "rgba";
+    char list[FILENAME_MAX_LENGTH];
+    bool selected[4][BYTE_SIZE] = {{false}};
+    char* save;
+    char* item;
+    int count = 0;
+    int c;
+    int bit;
+
+    strncpy(list, spec, sizeof(list) - 1);
+    list[sizeof(list) - 1] = '\0';
+
+    //Each item is a bit on its own for every channel, a channel and a bit, or all
+    for(item = strtok_r(list, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)){
+        const char* channel = strchr(channel_names, tolower((unsigned char)item[0]));
+        if(strcasecmp(item, "all") == 0){
+            for(c = 0; c < channels; c++){
+                for(bit = 0; bit < BYTE_SIZE; bit++){
+                    selected[c][bit] = true;
+                }
+            }
+        }else if(item[0] != '\0' && channel != NULL && channel - channel_names < channels
+                 && isdigit((unsigned char)item[1]) && item[1] - '0' < BYTE_SIZE && item[2] == '\0'){
+            selected[channel - channel_names][item[1] - '0'] = true;
+        }else if(isdigit((unsigned char)item[0]) && item[0] - '0' < BYTE_SIZE && item[1] == '\0'){
+            for(c = 0; c < channels; c++){
+                selected[c][item[0] - '0'] = true;
+            }
+        }else{
+            return 0;
+        }
+    }
+
+    for(c = 0; c < channels; c++){
+        for(bit = 0; bit < BYTE_SIZE; bit++){
+            if(selected[c][bit]){
+                planes[count].channel = c;
+                planes[count].bit = bit;
+                snprintf(planes[count].name, sizeof(planes[count].name), "%c%d", channel_names[c], bit);
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+void* bitplane_worker(void* arg){
+    bitplane_context* context = arg;
+    png_bytep samples = malloc(context->width + ANALYSIS_PLANE_PADDING);
+    png_bytep packed = malloc(context->width / BYTE_SIZE + ANALYSIS_PLANE_PADDING);
+    int index;
+
+    if(samples == NULL || packed == NULL){
+        fprintf(stderr, "Error in bitplane_worker(): %s\n", strerror(errno));
+        free(samples);
+        free(packed);
+        return NULL;
+    }
+
+    while((index = __atomic_fetch_add(&context->next, 1, __ATOMIC_RELAXED)) < context->count){
+        write_bitplane(context, &context->planes[index], samples, packed);
+    }
+
+    free(samples);
+    free(packed);
+    return NULL;
+}
+
+void write_bitplane(bitplane_context* context, const bitplane* plane, png_bytep samples, png_bytep packed){
+    char filename[FILENAME_MAX_LENGTH];
+    const char* base = strrchr(PNG_filename, '/');
+    size_t directory_length = base != NULL ? (size_t)(base - PNG_filename) + 1 : 0;
+    png_structp png_ptr;
+    png_infop png_info;
+    FILE* fp;
+    int row;
+
+    //Write the output next to the image
+    base = PNG_filename + directory_length;
+    if(snprintf(filename, sizeof(filename), "%.*sbitplane_%s.%s.png", (int)directory_length,
+                PNG_filename, base, plane->name) >= (int)sizeof(filename)){
+        fprintf(stderr, "Error in write_bitplane(): Output filename is too long\n");
+        return;
+    }
+    fp = fopen(filename, "wb");
+    if(fp == NULL){
+        fprintf(stderr, "Error in write_bitplane(): %s: %s\n", filename, strerror(errno));
+        return;
+    }
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_info = png_ptr != NULL ? png_create_info_struct(png_ptr) : NULL;
+    if(png_info == NULL){
+        fprintf(stderr, "Error in write_bitplane(): libpng could not allocate a writer\n");
+        if(png_ptr != NULL){
+            png_destroy_write_struct(&png_ptr, NULL);
+        }
+        fclose(fp);
+        return;
+    }
+    if(setjmp(png_jmpbuf(png_ptr))){
+        fprintf(stderr, "Error in write_bitplane(): libpng could not write %s\n", filename);
+        png_destroy_write_struct(&png_ptr, &png_info);
+        fclose(fp);
+        return;
+    }
+
+    //Set bits are white. A plane of noise doesn't compress, so spend little time trying.
+    png_init_io(png_ptr, fp);
+    png_set_compression_level(png_ptr, BITPLANE_COMPRESSION_LEVEL);
+    png_set_IHDR(png_ptr, png_info, context->width, context->height, 1, PNG_COLOR_TYPE_GRAY,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_ptr, png_info);
+
+    for(row = 0; row < context->height; row++){
+        png_bytep pixels = context->rows[row] + plane->channel;
+        int x;
+        for(x = 0; x < context->width; x++){
+            samples[x] = pixels[(size_t)x * context->channels];
+        }
+        slice_bit_plane(samples, context->width, plane->bit, packed);
+        png_write_row(png_ptr, packed);
+    }
+
+    png_write_end(png_ptr, NULL);
+    png_destroy_write_struct(&png_ptr, &png_info);
+    fclose(fp);
+
+    pthread_mutex_lock(&context->output_lock);
+    fprintf(stdout, "%-4s %s\n", plane->name, filename);
+    pthread_mutex_unlock(&context->output_lock);
+}
+
+void slice_bit_plane(const png_byte* samples, int width, int bit, png_bytep packed){
+    //Reverses the bits of a byte: movemask puts the first sample lowest, PNG wants it highest
+#define R2(n) n, n + 2 * 64, n + 1 * 64, n + 3 * 64
+#define R4(n) R2(n), R2(n + 2 * 16), R2(n + 1 * 16), R2(n + 3 * 16)
+#define R6(n) R4(n), R4(n + 2 * 4), R4(n + 1 * 4), R4(n + 3 * 4)
+    static const png_byte reversed[256] = {R6(0), R6(2), R6(1), R6(3)};
+#undef R2
+#undef R4
+#undef R6
+    int x = 0;
+
+#ifdef __SSE2__
+    //Shift the wanted bit up to the top of each byte and gather the tops into a mask.
+    // The 16 bit shift carries bits across bytes, but never into a byte's top bit.
+    const __m128i shift = _mm_cvtsi32_si128(7 - bit);
+    for(; x + 16 <= width; x += 16){
+        __m128i v = _mm_sll_epi16(_mm_loadu_si128((const __m128i*)(samples + x)), shift);
+        int mask = _mm_movemask_epi8(v);
+        packed[x / BYTE_SIZE] = reversed[mask & 0xFF];
+        packed[x / BYTE_SIZE + 1] = reversed[mask >> BYTE_SIZE];
+    }
+#endif
+
+    //The last partial byte is padded with zero bits
+    for(; x < width; x += BYTE_SIZE){
+        png_byte byte = 0;
+        int j;
+        for(j = 0; j < BYTE_SIZE && x + j < width; j++){
+            byte |= ((samples[x + j] >> bit) & 1) << (7 - j);
+        }
+        packed[x / BYTE_SIZE] = byte;
+    }
+}
+
+void diff_png(const char* cover_filename, const char* stego_filename){
+    diff_reader cover = {0};
+    diff_reader stego = {0};
+    diff_summary summary = {0};
+    pthread_t thread;
+    int row;
+    int bit;
+    int i;
+
+    summary.first_sample = -1;
+    summary.range_start = -1;
+    if(!open_diff_reader(&cover, cover_filename) || !open_diff_reader(&stego, stego_filename)){
+        close_diff_reader(&cover);
+        close_diff_reader(&stego);
+        exit_cleanly();
+    }
+    if(cover.width != stego.width || cover.height != stego.height || cover.bit_depth != stego.bit_depth
+       || cover.color_type != stego.color_type){
+        fprintf(stderr, "Error in diff_png(): The images differ in size or format, only samples can be compared\n");
+        close_diff_reader(&cover);
+        close_diff_reader(&stego);
+        exit_cleanly();
+    }
+
+    //Interlaced rows aren't final until the last pass, so then both are read whole
+    int block_rows = cover.interlaced || stego.interlaced ? (int)cover.height : DIFF_BLOCK_ROWS;
+    if(!allocate_diff_rows(&cover, block_rows) || !allocate_diff_rows(&stego, block_rows)){
+        close_diff_reader(&cover);
+        close_diff_reader(&stego);
+        exit_cleanly();
+    }
+
+    //Each block of the stego image is decoded on a second thread while this one
+    // decodes the same block of the cover, then the two are compared
+    for(row = 0; row < (int)cover.height; row += block_rows){
+        int count = (int)cover.height - row < block_rows ? (int)cover.height - row : block_rows;
+        bool threaded;
+
+        cover.row_count = count;
+        stego.row_count = count;
+        threaded = pthread_create(&thread, NULL, read_diff_block, &stego) == 0;
+        if(!threaded){
+            read_diff_block(&stego);
+        }
+        read_diff_block(&cover);
+        if(threaded){
+            pthread_join(thread, NULL);
+        }
+        if(cover.failed || stego.failed){
+            fprintf(stderr, "Error in diff_png(): libpng could not decode %s\n",
+                    cover.failed ? cover_filename : stego_filename);
+            close_diff_reader(&cover);
+            close_diff_reader(&stego);
+            exit_cleanly();
+        }
+
+        for(i = 0; i < count; i++){
+            compare_diff_row(&summary, cover.rows[i], stego.rows[i], cover.row_bytes, row + i);
+        }
+    }
+    //Close the last run of changed rows
+    compare_diff_row(&summary, NULL, NULL, 0, (int)cover.height);
+
+    uint64_t samples = (uint64_t)cover.row_bytes * cover.height;
+    fprintf(stdout, "Images are %upx x %upx, %zu bytes a row\n", cover.width, cover.height, cover.row_bytes);
+    fprintf(stdout, "Changed samples: %" PRIu64 " of %" PRIu64 " (%.4f%%)\n",
+            summary.changed, samples, samples > 0 ? 100.0 * summary.changed / samples : 0);
+    close_diff_reader(&cover);
+    close_diff_reader(&stego);
+    if(summary.changed == 0){
+        return;
+    }
+
+    fprintf(stdout, "Changed bits:");
+    for(bit = 0; bit < BYTE_SIZE; bit++){
+        if(summary.bit_changes[bit] > 0){
+            fprintf(stdout, " bit %d: %" PRIu64, bit, summary.bit_changes[bit]);
+        }
+    }
+    fprintf(stdout, "\nChanged rows:");
+    for(i = 0; i < summary.range_count && i < DIFF_MAX_RANGES; i++){
+        if(summary.ranges[i][0] == summary.ranges[i][1]){
+            fprintf(stdout, " %d", summary.ranges[i][0]);
+        }else{
+            fprintf(stdout, " %d-%d", summary.ranges[i][0], summary.ranges[i][1]);
+        }
+    }
+    if(summary.range_count > DIFF_MAX_RANGES){
+        fprintf(stdout, " and %d more ranges", summary.range_count - DIFF_MAX_RANGES);
+    }
+    fprintf(stdout, "\nChanged span: row %" PRId64 " byte %" PRId64 " to row %" PRId64 " byte %" PRId64 "\n",
+            summary.first_sample / (int64_t)stego.row_bytes, summary.first_sample % (int64_t)stego.row_bytes,
+            summary.last_sample / (int64_t)stego.row_bytes, summary.last_sample % (int64_t)stego.row_bytes);
+
+    //The bits are read from the lowest plane that changed
+    for(bit = 0; summary.bit_changes[bit] == 0; bit++);
+    write_diff_bitstream(stego_filename, &summary, bit);
+}
+
+bool open_diff_reader(diff_reader* reader, const char* filename){
+    int interlace_type;
+
+    reader->filename = filename;
+    reader->fp = fopen(filename, "rb");
+    if(reader->fp == NULL){
+        fprintf(stderr, "Error in open_diff_reader(): %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    reader->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    reader->info_ptr = reader->png_ptr != NULL ? png_create_info_struct(reader->png_ptr) : NULL;
+    if(reader->info_ptr == NULL){
+        fprintf(stderr, "Error in open_diff_reader(): libpng could not allocate a reader\n");
+        return false;
+    }
+    if(setjmp(png_jmpbuf(reader->png_ptr))){
+        fprintf(stderr, "Error in open_diff_reader(): libpng could not decode %s\n", filename);
+        return false;
+    }
+
+    png_init_io(reader->png_ptr, reader->fp);
+    png_read_info(reader->png_ptr, reader->info_ptr);
+    png_get_IHDR(reader->png_ptr, reader->info_ptr, &reader->width, &reader->height,
+                 &reader->bit_depth, &reader->color_type, &interlace_type, NULL, NULL);
+    reader->interlaced = interlace_type != PNG_INTERLACE_NONE;
+    if(reader->interlaced){
+        png_set_interlace_handling(reader->png_ptr);
+    }
+    png_read_update_info(reader->png_ptr, reader->info_ptr);
+    reader->row_bytes = png_get_rowbytes(reader->png_ptr, reader->info_ptr);
+    return true;
+}
+
+bool allocate_diff_rows(diff_reader* reader, int block_rows){
+    int i;
+
+    reader->data = malloc(reader->row_bytes * block_rows + ANALYSIS_PLANE_PADDING);
+    reader->rows = malloc(block_rows * sizeof(png_bytep));
+    if(reader->data == NULL || reader->rows == NULL){
+        fprintf(stderr, "Error in allocate_diff_rows(): %s\n", strerror(errno));
+        return false;
+    }
+    for(i = 0; i < block_rows; i++){
+        reader->rows[i] = reader->data + reader->row_bytes * i;
+    }
+    return true;
+}
+
+void* read_diff_block(void* arg){
+    diff_reader* reader = arg;
+
+    if(setjmp(png_jmpbuf(reader->png_ptr))){
+        reader->failed = true;
+        return NULL;
+    }
+    if(reader->interlaced){
+        png_read_image(reader->png_ptr, reader->rows);
+    }else{
+        png_read_rows(reader->png_ptr, reader->rows, NULL, reader->row_count);
+    }
+    return NULL;
+}
+
+void close_diff_reader(diff_reader* reader){
+    if(reader->png_ptr != NULL){
+        png_destroy_read_struct(&reader->png_ptr, reader->info_ptr != NULL ? &reader->info_ptr : NULL, NULL);
+    }
+    if(reader->fp != NULL){
+        fclose(reader->fp);
+        reader->fp = NULL;
+    }
+    free(reader->rows);
+    free(reader->data);
+    reader->rows = NULL;
+    reader->data = NULL;
+}
+
+void compare_diff_row(diff_summary* summary, const png_byte* cover, const png_byte* stego, size_t length, int row){
+    size_t x = 0;
+    bool changed = false;
+
+#ifdef __SSE2__
+    //Identical runs of 16 bytes, the usual case, cost one compare and a movemask
+    const __m128i zero = _mm_setzero_si128();
+    for(; x + 16 <= length; x += 16){
+        __m128i difference = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(cover + x)),
+                                           _mm_loadu_si128((const __m128i*)(stego + x)));
+        int lanes = ~_mm_movemask_epi8(_mm_cmpeq_epi8(difference, zero)) & 0xFFFF;
+        while(lanes != 0){
+            int lane = __builtin_ctz(lanes);
+            count_diff_sample(summary, cover[x + lane] ^ stego[x + lane], (int64_t)row * length + x + lane);
+            lanes &= lanes - 1;
+            changed = true;
+        }
+    }
+#endif
+
+    for(; x < length; x++){
+        if(cover[x] != stego[x]){
+            count_diff_sample(summary, cover[x] ^ stego[x], (int64_t)row * length + x);
+            changed = true;
+        }
+    }
+
+    //Runs of changed rows are tracked as they go by, as rows aren't kept
+    if(changed && summary->range_start == -1){
+        summary->range_start = row;
+    }else if(!changed && summary->range_start != -1){
+        if(summary->range_count < DIFF_MAX_RANGES){
+            summary->ranges[summary->range_count][0] = summary->range_start;
+            summary->ranges[summary->range_count][1] = row - 1;
+        }
+        summary->range_count++;
+        summary->range_start = -1;
+    }
+}
+
+void count_diff_sample(diff_summary* summary, png_byte difference, int64_t sample){
+    int bit;
+
+    summary->changed++;
+    for(bit = 0; bit < BYTE_SIZE; bit++){
+        summary->bit_changes[bit] += (difference >> bit) & 1;
+    }
+    if(summary->first_sample == -1){
+        summary->first_sample = sample;
+    }
+    summary->last_sample = sample;
+}
+
+void write_diff_bitstream(const char* stego_filename, const diff_summary* summary, int bit){
+    char filename[FILENAME_MAX_LENGTH];
+    const char* base = strrchr(stego_filename, '/');
+    size_t directory_length = base != NULL ? (size_t)(base - stego_filename) + 1 : 0;
+    diff_reader stego = {0};
+    memory_buffer bits = {0};
+    png_byte byte = 0;
+    int64_t sample;
+    int row;
+    int i;
+
+    base = stego_filename + directory_length;
+    if(snprintf(filename, sizeof(filename), "%.*sdiff_%s.bin", (int)directory_length,
+                stego_filename, base) >= (int)sizeof(filename)){
+        fprintf(stderr, "Error in write_diff_bitstream(): Output filename is too long\n");
+        return;
+    }
+
+    //Decode the stego image again, but only as far as the last changed row
+    if(!open_diff_reader(&stego, stego_filename)
+       || !allocate_diff_rows(&stego, stego.interlaced ? (int)stego.height : DIFF_BLOCK_ROWS)){
+        close_diff_reader(&stego);
+        return;
+    }
+    int last_row = (int)(summary->last_sample / (int64_t)stego.row_bytes);
+
+    //Bits are packed least significant first, the order this program embeds in
+    sample = 0;
+    for(row = 0; row <= last_row; row += stego.interlaced ? (int)stego.height : DIFF_BLOCK_ROWS){
+        int block_rows = stego.interlaced ? (int)stego.height : DIFF_BLOCK_ROWS;
+        stego.row_count = (int)stego.height - row < block_rows ? (int)stego.height - row : block_rows;
+        read_diff_block(&stego);
+        if(stego.failed){
+            fprintf(stderr, "Error in write_diff_bitstream(): libpng could not decode %s\n", stego_filename);
+            break;
+        }
+        for(i = 0; i < stego.row_count && row + i <= last_row; i++){
+            size_t x;
+            for(x = 0; x < stego.row_bytes; x++, sample++){
+                if(sample < summary->first_sample || sample > summary->last_sample){
+                    continue;
+                }
+                int position = (int)((sample - summary->first_sample) % BYTE_SIZE);
+                byte |= ((stego.rows[i][x] >> bit) & 1) << position;
+                if(position == BYTE_SIZE - 1 || sample == summary->last_sample){
+                    if(!append_memory_buffer(&bits, &byte, 1)){
+                        fprintf(stderr, "Error in write_diff_bitstream(): %s\n", strerror(errno));
+                        stego.failed = true;
+                        break;
+                    }
+                    byte = 0;
+                }
+            }
+        }
+        if(stego.failed){
+            break;
+        }
+    }
+    close_diff_reader(&stego);
+
+    if(!stego.failed){
+        if(write_buffer_to_file(filename, &bits)){
+            fprintf(stdout, "Wrote %zu bytes of bit %d from the changed span to %s\n", bits.length, bit, filename);
+        }
+    }
+    free_memory_buffer(&bits);
+}
+
+void exit_cleanly(){
+    //Free memory
+    if(read_ptr && info_ptr){
+        fprintf(stdout, "Freeing Read Memory...\n");
+        png_destroy_read_struct(&read_ptr, &info_ptr, (png_infopp)NULL);
+    }
+    if(write_ptr){
+        fprintf(stdout, "Freeing Write Memory...\n");
+        png_destroy_write_struct(&write_ptr, (png_infopp)NULL);
+    }
+
+    fprintf(stderr, "Exiting...\n");
+    exit(EXIT_SUCCESS);
+}
+
+void run_worker_threads(void* (*worker)(void*), void* context, int max_threads){
+    int thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t* threads;
+    int i;
+
+    if(thread_count > max_threads){
+        thread_count = max_threads;
+    }
+    if(thread_count < 1){
+        thread_count = 1;
+    }
+    threads = calloc(thread_count, sizeof(pthread_t));
+    for(i = 0; threads != NULL && i < thread_count; i++){
+        if(pthread_create(&threads[i], NULL, worker, context) != 0){
+            break;
+        }
+    }
+    //If no thread could start, do the work on this one
+    if(i == 0){
+        worker(context);
+    }
+    thread_count = i;
+    for(i = 0; i < thread_count; i++){
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+int serve(const char* socket_path, int thread_count){
+    struct sockaddr_un address = {0};
+    struct sigaction action = {0};
+    sigset_t stop_signals;
+    sigset_t previous_signals;
+    worker_state* workers;
+    int listen_fd;
+    int i;
+
+    if(thread_count < 1){
+        thread_count = 1;
+    }
+    if(strlen(socket_path) >= sizeof(address.sun_path)){
+        fprintf(stderr, "Error in serve(): Socket path is too long\n");
+        return EXIT_FAILURE;
+    }
+
+    //Clients hanging up mid-reply should fail the write, not kill the server.
+    // The stop handler is installed without SA_RESTART so accept() returns.
+    signal(SIGPIPE, SIG_IGN);
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd == -1){
+        fprintf(stderr, "Error in serve(): %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+    unlink(socket_path);
+    if(bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) == -1
+       || listen(listen_fd, SERVE_QUEUE_LENGTH) == -1){
+        fprintf(stderr, "Error in serve(): %s\n", strerror(errno));
+        close(listen_fd);
+        return EXIT_FAILURE;
+    }
+
+    //Start the workers before accepting so the first request finds them warm
+    workers = calloc(thread_count, sizeof(worker_state));
+    if(workers == NULL){
+        fprintf(stderr, "Error in serve(): %s\n", strerror(errno));
+        close(listen_fd);
+        unlink(socket_path);
+        return EXIT_FAILURE;
+    }
+
+    //The workers start with the stop signals blocked, so they always land on this
+    // thread and interrupt accept()
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &previous_signals);
+    for(i = 0; i < thread_count; i++){
+        workers[i].client_fd = -1;
+        if(pthread_create(&workers[i].thread, NULL, serve_worker, &workers[i]) != 0){
+            fprintf(stderr, "Error in serve(): Could not start worker thread %d\n", i);
+            thread_count = i;
+            stop_serving = 1;
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &previous_signals, NULL);
+
+    fprintf(stdout, "Listening on %s with %d worker threads\n", socket_path, thread_count);
+    fflush(stdout);
+
+    while(!stop_serving){
+        int client_fd = accept(listen_fd, NULL, NULL);
+        if(client_fd == -1){
+            if(errno != EINTR){
+                fprintf(stderr, "Error in serve(): %s\n", strerror(errno));
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&pending_connections.lock);
+        while(pending_connections.count == SERVE_QUEUE_LENGTH){
+            pthread_cond_wait(&pending_connections.not_full, &pending_connections.lock);
+        }
+        pending_connections.fds[(pending_connections.head + pending_connections.count) % SERVE_QUEUE_LENGTH] = client_fd;
+        pending_connections.count++;
+        pthread_cond_signal(&pending_connections.not_empty);
+        pthread_mutex_unlock(&pending_connections.lock);
+    }
+
+    //Let the workers finish what is queued, then wait for them
+    close(listen_fd);
+    unlink(socket_path);
+    pthread_mutex_lock(&pending_connections.lock);
+    pending_connections.closing = true;
+
+    //Workers waiting on idle clients would never finish otherwise. Only reading is
+    // shut down, so requests already sent are still answered.
+    for(i = 0; i < thread_count; i++){
+        if(workers[i].client_fd != -1){
+            shutdown(workers[i].client_fd, SHUT_RD);
+        }
+    }
+    pthread_cond_broadcast(&pending_connections.not_empty);
+    pthread_mutex_unlock(&pending_connections.lock);
+
+    for(i = 0; i < thread_count; i++){
+        pthread_join(workers[i].thread, NULL);
+        free_memory_buffer(&workers[i].carrier);
+        free_memory_buffer(&workers[i].payload);
+        free_memory_buffer(&workers[i].output);
+    }
+    free(workers);
+
+    fprintf(stderr, "Exiting...\n");
+    return EXIT_SUCCESS;
+}
+
+void* serve_worker(void* arg){
+    worker_state* worker = arg;
+
+    while(true){
+        int fd;
+
+        pthread_mutex_lock(&pending_connections.lock);
+        while(pending_connections.count == 0 && !pending_connections.closing){
+            pthread_cond_wait(&pending_connections.not_empty, &pending_connections.lock);
+        }
+        if(pending_connections.count == 0){
+            pthread_mutex_unlock(&pending_connections.lock);
+            return NULL;
+        }
+        fd = pending_connections.fds[pending_connections.head];
+        pending_connections.head = (pending_connections.head + 1) % SERVE_QUEUE_LENGTH;
+        pending_connections.count--;
+        worker->client_fd = fd;
+        if(pending_connections.closing){
+            shutdown(fd, SHUT_RD);
+        }
+        pthread_cond_signal(&pending_connections.not_full);
+        pthread_mutex_unlock(&pending_connections.lock);
+
+        handle_connection(worker, fd);
+    }
+}
+
+void handle_connection(worker_state* worker, int fd){
+    connection* client = malloc(sizeof(connection));
+    char* line;
+
+    if(client == NULL){
+        pthread_mutex_lock(&pending_connections.lock);
+        worker->client_fd = -1;
+        pthread_mutex_unlock(&pending_connections.lock);
+        close(fd);
+        return;
+    }
+    client->fd = fd;
+    client->start = 0;
+    client->end = 0;
+    client->passed_fd_count = 0;
+
+    while(read_request_line(client, &line)){
+        bool keep_open = handle_request(worker, client, line);
+        recycle_worker_buffers(worker);
+
+        //Descriptors the request didn't use must not pile up in the server
+        close_passed_fds(client);
+        if(!keep_open){
+            break;
+        }
+    }
+
+    close_passed_fds(client);
+
+    //serve() must not shut down the descriptor once it may have been reused
+    pthread_mutex_lock(&pending_connections.lock);
+    worker->client_fd = -1;
+    pthread_mutex_unlock(&pending_connections.lock);
+    close(fd);
+    free(client);
+}
+
+bool handle_request(worker_state* worker, connection* client, char* line){
+    char reply[64];
+    char* save;
+    char* command;
+    char* args[3];
+    int arg_count = 0;
+    bool success;
+
+    command = strtok_r(line, " \t\r", &save);
+    if(command == NULL){
+        return true;
+    }
+    while(arg_count < 3 && (args[arg_count] = strtok_r(NULL, " \t\r", &save)) != NULL){
+        arg_count++;
+    }
+
+    if(strcasecmp(command, "EMBED") == 0 && arg_count == 3){
+        success = read_file_into_buffer(args[0], &worker->carrier)
+                  && read_file_into_buffer(args[1], &worker->payload)
+                  && embed_buffer(worker->carrier.data, worker->carrier.length,
+                                  worker->payload.data, worker->payload.length, &worker->output)
+                  && write_buffer_to_file(args[2], &worker->output);
+        snprintf(reply, sizeof(reply), success ? "OK %zu\n" : "ERROR embed failed\n", worker->payload.length);
+        return send_reply(client, reply, -1);
+    }
+    if(strcasecmp(command, "EXTRACT") == 0 && arg_count == 2){
+        success = read_file_into_buffer(args[0], &worker->carrier)
+                  && extract_buffer(worker->carrier.data, worker->carrier.length, &worker->output)
+                  && write_buffer_to_file(args[1], &worker->output);
+        snprintf(reply, sizeof(reply), success ? "OK %zu\n" : "ERROR extract failed\n", worker->output.length);
+        return send_reply(client, reply, -1);
+    }
+    if(strcasecmp(command, "EMBED_FD") == 0 && arg_count == 0){
+        return handle_fd_request(client, true);
+    }
+    if(strcasecmp(command, "EXTRACT_FD") == 0 && arg_count == 0){
+        return handle_fd_request(client, false);
+    }
+    if(strcasecmp(command, "EMBED_BYTES") == 0 && arg_count == 2){
+        size_t carrier_length = strtoull(args[0], NULL, 10);
+        size_t payload_length = strtoull(args[1], NULL, 10);
+
+        //Refused bytes would have to be read to keep the stream in step, so hang up instead
+        if(carrier_length > SERVE_MAX_REQUEST_LENGTH || payload_length > SERVE_MAX_REQUEST_LENGTH){
+            send_reply(client, "ERROR request too large\n", -1);
+            return false;
+        }
+
+        //The bytes have to be consumed even if the embed fails, or the stream is lost
+        if(!read_exact(client, &worker->carrier, carrier_length)
+           || !read_exact(client, &worker->payload, payload_length)){
+            send_reply(client, "ERROR short read\n", -1);
+            return false;
+        }
+        success = embed_buffer(worker->carrier.data, worker->carrier.length,
+                               worker->payload.data, worker->payload.length, &worker->output);
+    }else if(strcasecmp(command, "EXTRACT_BYTES") == 0 && arg_count == 1){
+        size_t carrier_length = strtoull(args[0], NULL, 10);
+        if(carrier_length > SERVE_MAX_REQUEST_LENGTH){
+            send_reply(client, "ERROR request too large\n", -1);
+            return false;
+        }
+        return handle_streamed_extract(worker, client, carrier_length);
+    }else{
+        return send_reply(client, "ERROR unknown request\n", -1);
+    }
+
+    if(!success){
+        return send_reply(client, "ERROR request failed\n", -1);
+    }
+    snprintf(reply, sizeof(reply), "OK %zu\n", worker->output.length);
+    return send_reply(client, reply, -1)
+           && write_all(client->fd, worker->output.data, worker->output.length);
+}
+
+bool handle_fd_request(connection* client, bool embedding){
+    memory_buffer carrier = {0};
+    memory_buffer payload = {0};
+    memory_buffer output = {0};
+    int inputs = embedding ? 2 : 1;
+    bool client_output = client->passed_fd_count > inputs;
+    char reply[64];
+    bool success;
+
+    if(client->passed_fd_count != inputs && client->passed_fd_count != inputs + 1){
+        return send_reply(client, "ERROR wrong number of file descriptors\n", -1);
+    }
+    if(passed_fd_unsealed(client->passed_fds[0], F_SEAL_SHRINK | F_SEAL_WRITE)
+       || (embedding && passed_fd_unsealed(client->passed_fds[1], F_SEAL_SHRINK))){
+        return send_reply(client, "ERROR memfd is not sealed\n", -1);
+    }
+
+    //The result is always written into the worker's own memfd. The client's output
+    // memfd is optional, and only gets a copy of it.
+    success = map_passed_fd(client->passed_fds[0], &carrier)
+              && (!embedding || map_passed_fd(client->passed_fds[1], &payload))
+              && map_output_fd(&output);
+    if(success && embedding){
+        success = embed_buffer(carrier.data, carrier.length, payload.data, payload.length, &output);
+    }else if(success){
+        success = extract_buffer(carrier.data, carrier.length, &output);
+    }
+    if(success && client_output){
+        success = copy_to_passed_fd(client->passed_fds[inputs], &output);
+    }
+
+    free_memory_buffer(&carrier);
+    free_memory_buffer(&payload);
+
+    int output_fd = output.mapped ? seal_output_fd(&output) : -1;
+    if(success && output_fd != -1){
+        snprintf(reply, sizeof(reply), "OK %zu\n", output.length);
+        success = send_reply(client, reply, client_output ? client->passed_fds[inputs] : output_fd);
+    }else{
+        success = send_reply(client, "ERROR request failed\n", -1);
+    }
+
+    //A memfd the client passed is closed with the rest in close_passed_fds()
+    if(output_fd != -1){
+        close(output_fd);
+    }
+    return success;
+}
+
+bool handle_streamed_extract(worker_state* worker, connection* client, size_t carrier_length){
+    progressive_extractor extractor;
+    memory_buffer* chunk = &worker->carrier;
+    bool replied = false;
+    bool keep_open = true;
+    char reply[64];
+
+    if(!reserve_memory_buffer(chunk, STREAM_CHUNK_LENGTH)
+       || !start_progressive_extract(&extractor, &worker->output)){
+        send_reply(client, "ERROR request failed\n", -1);
+        return false;
+    }
+
+    while(carrier_length > 0){
+        //Use up what is already buffered, then receive the rest a chunk at a time
+        size_t buffered = client->end - client->start;
+        const png_byte* data;
+        size_t length;
+
+        if(buffered > 0){
+            length = buffered < carrier_length ? buffered : carrier_length;
+            data = (const png_byte*)client->buffer + client->start;
+            client->start += length;
+        }else{
+            ssize_t received = recv(client->fd, chunk->data,
+                                    carrier_length < chunk->capacity ? carrier_length : chunk->capacity, 0);
+            if(received == -1 && errno == EINTR){
+                continue;
+            }
+            if(received <= 0){
+                keep_open = false;
+                break;
+            }
+            data = chunk->data;
+            length = received;
+        }
+        carrier_length -= length;
+
+        feed_progressive_extract(&extractor, data, length);
+
+        //Reply as soon as the last message row is decoded, the rest is only drained
+        if(extractor.state.done && !replied){
+            snprintf(reply, sizeof(reply), "OK %zu\n", worker->output.length);
+            keep_open = send_reply(client, reply, -1)
+                        && write_all(client->fd, worker->output.data, worker->output.length);
+            replied = true;
+        }
+    }
+
+    if(!replied){
+        send_reply(client, keep_open ? "ERROR request failed\n" : "ERROR short read\n", -1);
+    }
+    finish_progressive_extract(&extractor);
+    return keep_open;
+}
+
+bool map_passed_fd(int fd, memory_buffer* buffer){
+    struct stat st;
+
+    if(fstat(fd, &st) == -1){
+        fprintf(stderr, "Error in map_passed_fd(): %s\n", strerror(errno));
+        return false;
+    }
+
+    //Only a sealed memfd can be mapped safely, anything else is read in
+    if(fcntl(fd, F_GET_SEALS) == -1){
+        if((size_t)st.st_size > SERVE_MAX_REQUEST_LENGTH){
+            fprintf(stderr, "Error in map_passed_fd(): File is too large\n");
+            return false;
+        }
+        if(!reserve_memory_buffer(buffer, st.st_size > 0 ? st.st_size : 1)){
+            fprintf(stderr, "Error in map_passed_fd(): %s\n", strerror(errno));
+            return false;
+        }
+        buffer->length = 0;
+        while(buffer->length < (size_t)st.st_size){
+            ssize_t result = pread(fd, buffer->data + buffer->length, st.st_size - buffer->length, buffer->length);
+            if(result == -1 && errno == EINTR){
+                continue;
+            }
+            if(result <= 0){
+                fprintf(stderr, "Error in map_passed_fd(): Could not read the file\n");
+                return false;
+            }
+            buffer->length += result;
+        }
+        return true;
+    }
+
+    //mmap() refuses empty mappings, an empty message needs no memory anyway
+    buffer->length = st.st_size;
+    buffer->capacity = st.st_size;
+    if(st.st_size == 0){
+        return true;
+    }
+
+    buffer->data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(buffer->data == MAP_FAILED){
+        fprintf(stderr, "Error in map_passed_fd(): %s\n", strerror(errno));
+        buffer->data = NULL;
+        return false;
+    }
+    buffer->mapped = true;
+    buffer->fd = fd;
+    return true;
+}
+
+bool passed_fd_unsealed(int fd, int seals){
+    int present = fcntl(fd, F_GET_SEALS);
+    return present != -1 && (present & seals) != seals;
+}
+
+bool map_output_fd(memory_buffer* buffer){
+    int fd = memfd_create("pngstego-output", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if(fd == -1){
+        fprintf(stderr, "Error in map_output_fd(): %s\n", strerror(errno));
+        return false;
+    }
+
+    //The mapping is created by the first reserve_memory_buffer()
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+    buffer->mapped = true;
+    buffer->fd = fd;
+    return true;
+}
+
+int seal_output_fd(memory_buffer* buffer){
+    int fd = buffer->fd;
+
+    //F_SEAL_WRITE is refused while a writable mapping exists
+    if(buffer->data != NULL){
+        munmap(buffer->data, buffer->capacity);
+    }
+    buffer->data = NULL;
+    buffer->capacity = 0;
+    buffer->mapped = false;
+
+    if(ftruncate(fd, buffer->length) == -1){
+        fprintf(stderr, "Error in seal_output_fd(): %s\n", strerror(errno));
+        return fd;
+    }
+
+    if(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1){
+        fprintf(stderr, "Error in seal_output_fd(): %s\n", strerror(errno));
+    }
+    return fd;
+}
+
+bool copy_to_passed_fd(int fd, const memory_buffer* buffer){
+    size_t written = 0;
+
+    if(ftruncate(fd, buffer->length) == -1){
+        fprintf(stderr, "Error in copy_to_passed_fd(): %s\n", strerror(errno));
+        return false;
+    }
+    while(written < buffer->length){
+        ssize_t result = pwrite(fd, buffer->data + written, buffer->length - written, written);
+        if(result == -1 && errno == EINTR){
+            continue;
+        }
+        if(result <= 0){
+            fprintf(stderr, "Error in copy_to_passed_fd(): %s\n", result == -1 ? strerror(errno) : "Short write");
+            return false;
+        }
+        written += result;
+    }
+
+    //A client memfd made without MFD_ALLOW_SEALING can't be sealed, but is still usable
+    if(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1
+       && errno != EPERM){
+        fprintf(stderr, "Error in copy_to_passed_fd(): %s\n", strerror(errno));
+    }
+    return true;
+}
+
+bool read_request_line(connection* client, char** line){
+    while(true){
+        char* newline = memchr(client->buffer + client->start, '\n', client->end - client->start);
+        if(newline != NULL){
+            *newline = '\0';
+            *line = client->buffer + client->start;
+            client->start = newline - client->buffer + 1;
+            return true;
+        }
+
+        //Slide the partial line to the front to make room for the rest of it
+        if(client->start > 0){
+            memmove(client->buffer, client->buffer + client->start, client->end - client->start);
+            client->end -= client->start;
+            client->start = 0;
+        }
+        if(client->end == sizeof(client->buffer)){
+            send_reply(client, "ERROR request line too long\n", -1);
+            return false;
+        }
+        if(!read_connection(client)){
+            return false;
+        }
+    }
+}
+
+bool read_connection(connection* client){
+    union {
+        char data[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {client->buffer + client->end, sizeof(client->buffer) - client->end};
+    struct msghdr message = {0};
+    struct cmsghdr* header;
+    ssize_t received;
+
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data;
+    message.msg_controllen = sizeof(control.data);
+
+    do{
+        received = recvmsg(client->fd, &message, MSG_CMSG_CLOEXEC);
+    }while(received == -1 && errno == EINTR);
+    if(received <= 0){
+        return false;
+    }
+    client->end += received;
+
+    for(header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)){
+        if(header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS){
+            continue;
+        }
+        int* fds = (int*)CMSG_DATA(header);
+        size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        size_t i;
+        for(i = 0; i < count; i++){
+            if(client->passed_fd_count < MAX_PASSED_FDS){
+                client->passed_fds[client->passed_fd_count++] = fds[i];
+            }else{
+                close(fds[i]);
+            }
+        }
+    }
+    return true;
+}
+
+void close_passed_fds(connection* client){
+    int i;
+    for(i = 0; i < client->passed_fd_count; i++){
+        close(client->passed_fds[i]);
+    }
+    client->passed_fd_count = 0;
+}
+
+bool send_reply(connection* client, const char* reply, int passed_fd){
+    union {
+        char data[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {(void*)reply, strlen(reply)};
+    struct msghdr message = {0};
+    ssize_t sent;
+
+    if(passed_fd == -1){
+        return write_all(client->fd, reply, strlen(reply));
+    }
+
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data;
+    message.msg_controllen = sizeof(control.data);
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &passed_fd, sizeof(int));
+
+    //Replies are short, so the line and the descriptor go out in one sendmsg()
+    do{
+        sent = sendmsg(client->fd, &message, MSG_NOSIGNAL);
+    }while(sent == -1 && errno == EINTR);
+    return sent == (ssize_t)strlen(reply);
+}
+
+void recycle_worker_buffers(worker_state* worker){
+    memory_buffer* buffers[] = {&worker->carrier, &worker->payload, &worker->output};
+    int i;
+
+    for(i = 0; i < 3; i++){
+        if(buffers[i]->capacity > WORKER_BUFFER_RETAIN_LIMIT){
+            free_memory_buffer(buffers[i]);
+        }
+        buffers[i]->length = 0;
+    }
+}
+
+bool read_file_into_buffer(const char* filename, memory_buffer* buffer){
+    struct stat st;
+    FILE* fp = fopen(filename, "rb");
+    if(fp == NULL){
+        fprintf(stderr, "Error in read_file_into_buffer(): %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+
+    buffer->length = 0;
+    bool success = fstat(fileno(fp), &st) == 0
+                   && reserve_memory_buffer(buffer, st.st_size > 0 ? st.st_size : 1)
+                   && (buffer->length = fread(buffer->data, 1, st.st_size, fp)) == (size_t)st.st_size;
+    if(!success){
+        fprintf(stderr, "Error in read_file_into_buffer(): Could not read %s\n", filename);
+    }
+    fclose(fp);
+    return success;
+}
+
+bool write_buffer_to_file(const char* filename, const memory_buffer* buffer){
+    FILE* fp = fopen(filename, "wb");
+    if(fp == NULL){
+        fprintf(stderr, "Error in write_buffer_to_file(): %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+
+    bool success = fwrite(buffer->data, 1, buffer->length, fp) == buffer->length;
+    if(fclose(fp) != 0 || !success){
+        fprintf(stderr, "Error in write_buffer_to_file(): Could not write %s\n", filename);
+        return false;
+    }
+    return true;
+}
+
+bool read_exact(connection* client, memory_buffer* buffer, size_t length){
+    buffer->length = 0;
+    if(!reserve_memory_buffer(buffer, length > 0 ? length : 1)){
+        return false;
+    }
+
+    //Use up what is already buffered, then receive the rest straight into place
+    size_t buffered = client->end - client->start;
+    if(buffered > length){
+        buffered = length;
+    }
+    memcpy(buffer->data, client->buffer + client->start, buffered);
+    client->start += buffered;
+    buffer->length = buffered;
+
+    while(buffer->length < length){
+        ssize_t received = recv(client->fd, buffer->data + buffer->length, length - buffer->length, 0);
+        if(received == -1 && errno == EINTR){
+            continue;
+        }
+        if(received <= 0){
+            return false;
+        }
+        buffer->length += received;
+    }
+    return true;
+}
+
+bool write_all(int fd, const void* data, size_t length){
+    const png_byte* next = data;
+    while(length > 0){
+        ssize_t written = write(fd, next, length);
+        if(written == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return false;
+        }
+        next += written;
+        length -= written;
+    }
+    return true;
+}
+
+void handle_stop_signal(int signal_number){
+    stop_serving = 1;
+}
+
+int run_batch(int argc, char* argv[]){
+    batch_context context = {0};
+    int first_image = 1;
+    int i;
+
+    if(argc >= 1 && strncmp(argv[0], TRACE_FLAG, strlen(TRACE_FLAG)) == 0){
+        start_trace(argv[0] + strlen(TRACE_FLAG));
+        argc--;
+        argv++;
+    }
+
+    //Get the method being requested (embed or extract)
+    if(argc >= 3 && strncasecmp(argv[0], EMBED_TEXT, strlen(EMBED_TEXT)) == 0){
+        context.embedding = true;
+        first_image = 2;
+        if(!read_file_into_buffer(argv[1], &context.payload)){
+            return EXIT_FAILURE;
+        }
+    }else if(argc < 2 || strncasecmp(argv[0], EXTRACT_TEXT, strlen(EXTRACT_TEXT)) != 0){
+        fprintf(stderr, "Usage: \t$ ./pngstego batch [--trace=trace_filename] embed message_filename filename.png...\n"
+                        "\t$ ./pngstego batch [--trace=trace_filename] extract filename.png...\n");
+        return EXIT_FAILURE;
+    }
+
+    if(!start_batch(&context)){
+        free_memory_buffer(&context.payload);
+        return EXIT_FAILURE;
+    }
+
+    for(i = first_image; i < argc; i++){
+        add_batch_job(&context, argv[i]);
+    }
+    while(context.finished < context.added){
+        wait_for_batch(&context, -1, -1);
+    }
+
+    fprintf(stdout, "Processed %d images (%d failed)\n", context.finished, context.failed);
+
+    int failed = context.failed;
+    stop_batch(&context);
+    if(tracing && !write_trace()){
+        failed++;
+    }
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool start_batch(batch_context* context){
+    int i;
+
+    context->thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(context->thread_count < 1){
+        context->thread_count = 1;
+    }
+    context->threads = calloc(context->thread_count, sizeof(pthread_t));
+    if(context->threads == NULL){
+        fprintf(stderr, "Error in start_batch(): %s\n", strerror(errno));
+        return false;
+    }
+
+    pthread_mutex_init(&context->waiting.lock, NULL);
+    pthread_cond_init(&context->waiting.not_empty, NULL);
+    pthread_mutex_init(&context->work.lock, NULL);
+    pthread_cond_init(&context->work.not_empty, NULL);
+    pthread_mutex_init(&context->done.lock, NULL);
+    pthread_cond_init(&context->done.not_empty, NULL);
+
+    //Workers tell this thread about finished images through the eventfd, which the
+    // ring also watches, so one wait covers both IO and CPU work.
+    context->event_fd = eventfd(0, EFD_CLOEXEC);
+    if(context->event_fd == -1){
+        fprintf(stderr, "Error in start_batch(): %s\n", strerror(errno));
+        free(context->threads);
+        return false;
+    }
+
+    //Every live image has at most one IO in flight, plus the eventfd read
+    context->live_limit = BATCH_PREFETCH_DEPTH + context->thread_count;
+    context->use_ring = setup_io_ring(&context->ring, context->live_limit + 1);
+    if(!context->use_ring){
+        fprintf(stderr, "io_uring is unavailable, falling back to blocking IO\n");
+    }else{
+        arm_batch_event(context);
+    }
+
+    for(i = 0; i < context->thread_count; i++){
+        if(pthread_create(&context->threads[i], NULL, batch_worker, context) != 0){
+            fprintf(stderr, "Error in start_batch(): Could not start worker thread %d\n", i);
+            break;
+        }
+    }
+    context->thread_count = i;
+    if(context->thread_count == 0){
+        stop_batch(context);
+        return false;
+    }
+
+    return true;
+}
+
+void stop_batch(batch_context* context){
+    int i;
+
+    //Let the workers run out of work, then wait for them
+    pthread_mutex_lock(&context->work.lock);
+    context->work.closing = true;
+    pthread_cond_broadcast(&context->work.not_empty);
+    pthread_mutex_unlock(&context->work.lock);
+    for(i = 0; i < context->thread_count; i++){
+        pthread_join(context->threads[i], NULL);
+    }
+
+    if(context->use_ring){
+        close_io_ring(&context->ring);
+    }
+    close(context->event_fd);
+    free_memory_buffer(&context->payload);
+    free(context->threads);
+}
+
+void add_batch_job(batch_context* context, const char* filename){
+    batch_job* job = calloc(1, sizeof(batch_job));
+
+    context->added++;
+    if(job == NULL || strlen(filename) >= FILENAME_MAX_LENGTH){
+        fprintf(stderr, "Error in add_batch_job(): Could not queue %s\n", filename);
+        free(job);
+        context->finished++;
+        context->failed++;
+        return;
+    }
+    strcpy(job->input_filename, filename);
+    job->fd = -1;
+    push_batch_job(&context->waiting, job);
+}
+
+bool wait_for_batch(batch_context* context, int watch_fd, int timeout){
+    struct pollfd fds[2];
+    batch_job* job;
+    bool workers_finished = false;
+    bool watch_ready = false;
+
+    //Keep the next images reading while the workers are busy with earlier ones
+    while(context->live < context->live_limit
+          && (job = pop_batch_job(&context->waiting, false)) != NULL){
+        context->live++;
+        start_batch_read(context, job);
+    }
+    if(context->finished == context->added && watch_fd == -1){
+        return false;
+    }
+
+    //With nothing else to watch, the ring can do the waiting itself. Otherwise
+    // poll() waits on the ring (or the eventfd) and the watched descriptor together.
+    record_trace_event(TRACE_BEGIN, "wait", NULL);
+    if(context->use_ring && watch_fd == -1){
+        if(!submit_io_ring(&context->ring, 1)){
+            record_trace_event(TRACE_END, "wait", NULL);
+            fprintf(stderr, "Error in wait_for_batch(): %s\n", strerror(errno));
+            return false;
+        }
+    }else{
+        if(context->use_ring && !submit_io_ring(&context->ring, 0)){
+            record_trace_event(TRACE_END, "wait", NULL);
+            fprintf(stderr, "Error in wait_for_batch(): %s\n", strerror(errno));
+            return false;
+        }
+        fds[0].fd = context->use_ring ? context->ring.fd : context->event_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = watch_fd;
+        fds[1].events = POLLIN;
+        if(poll(fds, watch_fd == -1 ? 1 : 2, timeout) > 0){
+            watch_ready = watch_fd != -1 && (fds[1].revents & POLLIN);
+        }
+    }
+    record_trace_event(TRACE_END, "wait", NULL);
+
+    if(context->use_ring){
+        struct io_uring_cqe completion;
+        while(next_io_completion(&context->ring, &completion)){
+            if(completion.user_data == 0){
+                workers_finished = true;
+            }else{
+                continue_batch_io(context, (batch_job*)(uintptr_t)completion.user_data, completion.res);
+            }
+        }
+        if(workers_finished){
+            arm_batch_event(context);
+        }
+    }else{
+        uint64_t count;
+        struct pollfd event = {context->event_fd, POLLIN, 0};
+        if(poll(&event, 1, 0) > 0 && read(context->event_fd, &count, sizeof(count)) == sizeof(count)){
+            workers_finished = true;
+        }
+    }
+    if(workers_finished){
+        drain_batch_done(context);
+    }
+
+    return watch_ready;
+}
+
+void* batch_worker(void* arg){
+    batch_context* context = arg;
+    batch_job* job;
+    uint64_t one = 1;
+
+    while((job = pop_batch_job(&context->work, true)) != NULL){
+        record_trace_event(TRACE_ASYNC_END, "queued for worker", job);
+        if(context->embedding){
+            job->success = embed_buffer(job->input.data, job->input.length,
+                                        context->payload.data, context->payload.length, &job->output);
+        }else{
+            job->success = extract_buffer(job->input.data, job->input.length, &job->output);
+        }
+
+        //The carrier is no longer needed, so don't hold it while the output is written
+        free_memory_buffer(&job->input);
+
+        record_trace_event(TRACE_ASYNC_BEGIN, "queued for write", job);
+        push_batch_job(&context->done, job);
+        if(write(context->event_fd, &one, sizeof(one)) != sizeof(one)){
+            fprintf(stderr, "Error in batch_worker(): %s\n", strerror(errno));
+        }
+    }
+
+    return NULL;
+}
+
+void start_batch_read(batch_context* context, batch_job* job){
+    struct stat st;
+
+    job->fd = open(job->input_filename, O_RDONLY | O_CLOEXEC);
+    if(job->fd == -1 || fstat(job->fd, &st) == -1
+       || !reserve_memory_buffer(&job->input, st.st_size > 0 ? st.st_size : 1)){
+        fprintf(stderr, "Error in start_batch_read(): %s: %s\n", job->input_filename, strerror(errno));
+        finish_batch_job(context, job, false);
+        return;
+    }
+    job->writing = false;
+    job->offset = 0;
+    job->input.length = st.st_size;
+
+    if(context->use_ring){
+        record_trace_event(TRACE_ASYNC_BEGIN, "read", job);
+        queue_batch_io(context, job);
+        return;
+    }
+
+    //Without a ring the read happens right here
+    record_trace_event(TRACE_BEGIN, "read", NULL);
+    while(job->offset < job->input.length){
+        ssize_t result = read(job->fd, job->input.data + job->offset, job->input.length - job->offset);
+        if(result == -1 && errno == EINTR){
+            continue;
+        }
+        if(result <= 0){
+            record_trace_event(TRACE_END, "read", NULL);
+            fprintf(stderr, "Error in start_batch_read(): Could not read %s\n", job->input_filename);
+            finish_batch_job(context, job, false);
+            return;
+        }
+        job->offset += result;
+    }
+    record_trace_event(TRACE_END, "read", NULL);
+    close(job->fd);
+    job->fd = -1;
+    record_trace_event(TRACE_ASYNC_BEGIN, "queued for worker", job);
+    push_batch_job(&context->work, job);
+}
+
+void start_batch_write(batch_context* context, batch_job* job){
+    job->fd = open(job->output_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(job->fd == -1){
+        fprintf(stderr, "Error in start_batch_write(): %s: %s\n", job->output_filename, strerror(errno));
+        finish_batch_job(context, job, false);
+        return;
+    }
+    job->writing = true;
+    job->offset = 0;
+
+    if(context->use_ring && job->output.length > 0){
+        record_trace_event(TRACE_ASYNC_BEGIN, "write", job);
+        queue_batch_io(context, job);
+        return;
+    }
+
+    //Without a ring the write happens right here
+    record_trace_event(TRACE_BEGIN, "write", NULL);
+    bool success = write_all(job->fd, job->output.data, job->output.length);
+    record_trace_event(TRACE_END, "write", NULL);
+    if(!success){
+        fprintf(stderr, "Error in start_batch_write(): Could not write %s\n", job->output_filename);
+    }
+    finish_batch_job(context, job, success);
+}
+
+void queue_batch_io(batch_context* context, batch_job* job){
+    struct io_uring_sqe* entry = next_io_submission(&context->ring);
+    memory_buffer* buffer = job->writing ? &job->output : &job->input;
+
+    entry->opcode = job->writing ? IORING_OP_WRITE : IORING_OP_READ;
+    entry->fd = job->fd;
+    entry->addr = (uintptr_t)(buffer->data + job->offset);
+    entry->len = buffer->length - job->offset;
+    entry->off = job->offset;
+    entry->user_data = (uintptr_t)job;
+}
+
+void continue_batch_io(batch_context* context, batch_job* job, int result){
+    memory_buffer* buffer = job->writing ? &job->output : &job->input;
+
+    //A zero length read means the file shrank since it was measured
+    if(result <= 0){
+        record_trace_event(TRACE_ASYNC_END, job->writing ? "write" : "read", job);
+        fprintf(stderr, "Error in continue_batch_io(): Could not %s %s: %s\n",
+                        job->writing ? "write" : "read",
+                        job->writing ? job->output_filename : job->input_filename,
+                        result < 0 ? strerror(-result) : "unexpected end of file");
+        finish_batch_job(context, job, false);
+        return;
+    }
+
+    //Short transfers are resubmitted for the remainder
+    job->offset += result;
+    if(job->offset < buffer->length){
+        queue_batch_io(context, job);
+        return;
+    }
+
+    record_trace_event(TRACE_ASYNC_END, job->writing ? "write" : "read", job);
+    if(job->writing){
+        finish_batch_job(context, job, true);
+    }else{
+        close(job->fd);
+        job->fd = -1;
+        record_trace_event(TRACE_ASYNC_BEGIN, "queued for worker", job);
+        push_batch_job(&context->work, job);
+    }
+}
+
+void drain_batch_done(batch_context* context){
+    batch_job* job;
+
+    while((job = pop_batch_job(&context->done, false)) != NULL){
+        record_trace_event(TRACE_ASYNC_END, "queued for write", job);
+
+        //Create the output filename next to the input
+        const char* base = strrchr(job->input_filename, '/');
+        size_t directory_length = base != NULL ? (size_t)(base - job->input_filename) + 1 : 0;
+        base = job->input_filename + directory_length;
+        int length = snprintf(job->output_filename, FILENAME_MAX_LENGTH, "%.*s%s%s%s",
+                              (int)directory_length, job->input_filename,
+                              context->embedding ? "embedded_" : "extracted_", base,
+                              context->embedding ? "" : ".txt");
+
+        if(!job->success || length >= FILENAME_MAX_LENGTH){
+            fprintf(stderr, "Error in drain_batch_done(): Could not process %s\n", job->input_filename);
+            finish_batch_job(context, job, false);
+        }else{
+            start_batch_write(context, job);
+        }
+    }
+}
+
+void finish_batch_job(batch_context* context, batch_job* job, bool success){
+    if(job->fd != -1){
+        close(job->fd);
+        job->fd = -1;
+    }
+    if(success){
+        fprintf(stdout, "%s: %zu bytes %s\n", job->output_filename,
+                context->embedding ? context->payload.length : job->output.length,
+                context->embedding ? "embedded" : "extracted");
+        fflush(stdout);
+    }else{
+        context->failed++;
+    }
+
+    free_memory_buffer(&job->input);
+    free_memory_buffer(&job->output);
+    free(job);
+    context->live--;
+    context->finished++;
+}
+
+void arm_batch_event(batch_context* context){
+    struct io_uring_sqe* entry = next_io_submission(&context->ring);
+
+    entry->opcode = IORING_OP_READ;
+    entry->fd = context->event_fd;
+    entry->addr = (uintptr_t)&context->event_count;
+    entry->len = sizeof(context->event_count);
+    entry->off = 0;
+    entry->user_data = 0;
+}
+
+void push_batch_job(job_queue* queue, batch_job* job){
+    pthread_mutex_lock(&queue->lock);
+    job->next = NULL;
+    if(queue->tail != NULL){
+        queue->tail->next = job;
+    }else{
+        queue->head = job;
+    }
+    queue->tail = job;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+batch_job* pop_batch_job(job_queue* queue, bool wait){
+    batch_job* job;
+
+    if(wait){
+        record_trace_event(TRACE_BEGIN, "wait for work", NULL);
+    }
+    pthread_mutex_lock(&queue->lock);
+    while(wait && queue->head == NULL && !queue->closing){
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    job = queue->head;
+    if(job != NULL){
+        queue->head = job->next;
+        if(queue->head == NULL){
+            queue->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if(wait){
+        record_trace_event(TRACE_END, "wait for work", NULL);
+    }
+    return job;
+}
+
+void start_trace(const char* filename){
+    trace_filename = filename;
+    trace_start = monotonic_nanoseconds();
+    tracing = true;
+}
+
+void record_trace_event(char phase, const char* name, const void* id){
+    if(!tracing){
+        return;
+    }
+
+    //A thread's buffer is made, and put on the list, the first time it records
+    if(thread_trace == NULL){
+        thread_trace = malloc(sizeof(trace_buffer));
+        if(thread_trace == NULL){
+            return;
+        }
+        thread_trace->count = 0;
+        thread_trace->tid = syscall(SYS_gettid);
+        pthread_mutex_lock(&trace_lock);
+        thread_trace->next = trace_buffers;
+        trace_buffers = thread_trace;
+        pthread_mutex_unlock(&trace_lock);
+    }
+
+    trace_event* event = &thread_trace->events[thread_trace->count % TRACE_BUFFER_EVENTS];
+    event->name = name;
+    event->id = id;
+    event->timestamp = monotonic_nanoseconds();
+    event->phase = phase;
+    thread_trace->count++;
+}
+
+bool write_trace(){
+    FILE* fp = fopen(trace_filename, "w");
+    trace_buffer* buffer;
+    pid_t pid = getpid();
+    bool success = fp != NULL;
+
+    tracing = false;
+    if(fp == NULL){
+        fprintf(stderr, "Error in write_trace(): %s: %s\n", trace_filename, strerror(errno));
+    }else{
+        fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"pngstego\"}}",
+                pid, pid);
+    }
+
+    while((buffer = trace_buffers) != NULL){
+        uint64_t first = 0;
+        int depth = 0;
+        uint64_t i;
+
+        if(buffer->count > TRACE_BUFFER_EVENTS){
+            first = buffer->count - TRACE_BUFFER_EVENTS;
+            fprintf(stderr, "Trace of thread %d dropped its oldest %" PRIu64 " events\n", buffer->tid, first);
+        }
+
+        //The thread that started tracing is the IO thread, the rest are workers
+        if(fp != NULL){
+            fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    pid, buffer->tid, buffer->tid == pid ? "io" : "worker");
+        }
+        for(i = first; fp != NULL && i < buffer->count; i++){
+            trace_event* event = &buffer->events[i % TRACE_BUFFER_EVENTS];
+
+            //A wrapped ring can start part way through a span, whose end then has no beginning
+            if(event->phase == TRACE_BEGIN){
+                depth++;
+            }else if(event->phase == TRACE_END){
+                if(depth == 0){
+                    continue;
+                }
+                depth--;
+            }
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"batch\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+                    event->name, event->phase, (event->timestamp - trace_start) / 1000.0, pid, buffer->tid);
+            if(event->id != NULL){
+                fprintf(fp, ",\"id\":\"%p\"", event->id);
+            }
+            fprintf(fp, "}");
+        }
+
+        trace_buffers = buffer->next;
+        free(buffer);
+    }
+    thread_trace = NULL;
+
+    if(fp != NULL){
+        fprintf(fp, "\n]}\n");
+        if(fclose(fp) != 0){
+            fprintf(stderr, "Error in write_trace(): %s: %s\n", trace_filename, strerror(errno));
+            success = false;
+        }
+    }
+    return success;
+}
+
+uint64_t monotonic_nanoseconds(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+bool setup_io_ring(io_ring* ring, unsigned entries){
+    struct io_uring_params params = {0};
+    png_bytep sq_map;
+    png_bytep cq_map;
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd == -1){
+        return false;
+    }
+
+    //Older kernels map the two rings separately
+    ring->sq_map_length = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_length = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        if(ring->cq_map_length > ring->sq_map_length){
+            ring->sq_map_length = ring->cq_map_length;
+        }
+        ring->cq_map_length = 0;
+    }
+
+    sq_map = mmap(NULL, ring->sq_map_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring->fd, IORING_OFF_SQ_RING);
+    if(sq_map == MAP_FAILED){
+        close(ring->fd);
+        return false;
+    }
+    cq_map = sq_map;
+    if(ring->cq_map_length > 0){
+        cq_map = mmap(NULL, ring->cq_map_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_CQ_RING);
+        if(cq_map == MAP_FAILED){
+            munmap(sq_map, ring->sq_map_length);
+            close(ring->fd);
+            return false;
+        }
+    }
+    ring->sqes_length = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED){
+        if(ring->cq_map_length > 0){
+            munmap(cq_map, ring->cq_map_length);
+        }
+        munmap(sq_map, ring->sq_map_length);
+        close(ring->fd);
+        return false;
+    }
+
+    ring->sq_map = sq_map;
+    ring->cq_map = cq_map;
+    ring->sq_head = (unsigned*)(sq_map + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq_map + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq_map + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq_map + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq_map + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq_map + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq_map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq_map + params.cq_off.cqes);
+    ring->to_submit = 0;
+    return true;
+}
+
+struct io_uring_sqe* next_io_submission(io_ring* ring){
+    //Only this thread touches the submission tail, the kernel only reads it
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* entry = &ring->sqes[index];
+
+    memset(entry, 0, sizeof(*entry));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return entry;
+}
+
+bool submit_io_ring(io_ring* ring, unsigned wait_for){
+    int result;
+
+    do{
+        result = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_for,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+    }while(result == -1 && errno == EINTR);
+    if(result == -1){
+        return false;
+    }
+
+    ring->to_submit -= result;
+    return true;
+}
+
+bool next_io_completion(io_ring* ring, struct io_uring_cqe* completion){
+    unsigned head = *ring->cq_head;
+
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)){
+        return false;
+    }
+    *completion = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void close_io_ring(io_ring* ring){
+    munmap(ring->sqes, ring->sqes_length);
+    if(ring->cq_map_length > 0){
+        munmap(ring->cq_map, ring->cq_map_length);
+    }
+    munmap(ring->sq_map, ring->sq_map_length);
+    close(ring->fd);
+}
+
+int run_watch(int argc, char* argv[]){
+    batch_context context = {0};
+    struct sigaction action = {0};
+    char buffer[WATCH_EVENT_BUFFER_LENGTH] __attribute__((aligned(__alignof__(struct inotify_event))));
+    watched_file* pending = NULL;
+    const char* directory;
+    int inotify_fd;
+
+    if(argc >= 1 && strncmp(argv[0], TRACE_FLAG, strlen(TRACE_FLAG)) == 0){
+        start_trace(argv[0] + strlen(TRACE_FLAG));
+        argc--;
+        argv++;
+    }
+
+    //Get the method being requested (embed or extract)
+    if(argc >= 3 && strncasecmp(argv[1], EMBED_TEXT, strlen(EMBED_TEXT)) == 0){
+        context.embedding = true;
+        if(!read_file_into_buffer(argv[2], &context.payload)){
+            return EXIT_FAILURE;
+        }
+    }else if(argc < 2 || strncasecmp(argv[1], EXTRACT_TEXT, strlen(EXTRACT_TEXT)) != 0){
+        fprintf(stderr, "Usage: \t$ ./pngstego watch [--trace=trace_filename] directory embed message_filename\n"
+                        "\t$ ./pngstego watch [--trace=trace_filename] directory extract\n");
+        return EXIT_FAILURE;
+    }
+    directory = argv[0];
+
+    //A finished write shows up as either a close after writing or a rename into place
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(inotify_fd == -1 || inotify_add_watch(inotify_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) == -1){
+        fprintf(stderr, "Error in run_watch(): %s: %s\n", directory, strerror(errno));
+        free_memory_buffer(&context.payload);
+        return EXIT_FAILURE;
+    }
+
+    if(!start_batch(&context)){
+        close(inotify_fd);
+        free_memory_buffer(&context.payload);
+        return EXIT_FAILURE;
+    }
+
+    //The stop handler is installed without SA_RESTART so poll() returns
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    fprintf(stdout, "Watching %s\n", directory);
+    fflush(stdout);
+
+    while(!stop_serving){
+        long now = monotonic_milliseconds();
+        int timeout = -1;
+        watched_file** link = &pending;
+
+        //Queue the files that have been quiet for WATCH_DEBOUNCE_MILLISECONDS
+        while(*link != NULL){
+            watched_file* file = *link;
+            if(file->due <= now){
+                *link = file->next;
+                add_batch_job(&context, file->filename);
+                free(file);
+            }else{
+                if(timeout == -1 || file->due - now < timeout){
+                    timeout = file->due - now;
+                }
+                link = &file->next;
+            }
+        }
+
+        if(!wait_for_batch(&context, inotify_fd, timeout)){
+            continue;
+        }
+
+        ssize_t length;
+        while((length = read(inotify_fd, buffer, sizeof(buffer))) > 0){
+            char* next = buffer;
+            while(next < buffer + length){
+                struct inotify_event* event = (struct inotify_event*)next;
+                next += sizeof(struct inotify_event) + event->len;
+                if(event->len > 0 && is_watched_png(event->name, context.embedding)){
+                    pending = debounce_watched_file(pending, directory, event->name);
+                }
+            }
+        }
+    }
+
+    //Finish what was already started before exiting
+    while(context.finished < context.added){
+        wait_for_batch(&context, -1, -1);
+    }
+    while(pending != NULL){
+        watched_file* file = pending;
+        pending = file->next;
+        free(file);
+    }
+
+    fprintf(stdout, "Processed %d images (%d failed)\n", context.finished, context.failed);
+    stop_batch(&context);
+    if(tracing){
+        write_trace();
+    }
+    close(inotify_fd);
+    fprintf(stderr, "Exiting...\n");
+    return EXIT_SUCCESS;
+}
+
+bool is_watched_png(const char* name, bool embedding){
+    size_t length = strlen(name);
+
+    //Our own outputs land in the same directory and must not be picked up again
+    if(length < 4 || strcasecmp(name + length - 4, ".png") != 0){
+        return false;
+    }
+    return !embedding || strncmp(name, "embedded_", strlen("embedded_")) != 0;
+}
+
+watched_file* debounce_watched_file(watched_file* pending, const char* directory, const char* name){
+    char filename[FILENAME_MAX_LENGTH];
+    watched_file* file;
+
+    if(snprintf(filename, sizeof(filename), "%s/%s", directory, name) >= (int)sizeof(filename)){
+        fprintf(stderr, "Error in debounce_watched_file(): %s/%s is too long\n", directory, name);
+        return pending;
+    }
+
+    //A file written again before it was queued just has its wait restarted
+    for(file = pending; file != NULL; file = file->next){
+        if(strcmp(file->filename, filename) == 0){
+            file->due = monotonic_milliseconds() + WATCH_DEBOUNCE_MILLISECONDS;
+            return pending;
+        }
+    }
+
+    file = malloc(sizeof(watched_file));
+    if(file == NULL){
+        fprintf(stderr, "Error in debounce_watched_file(): %s\n", strerror(errno));
+        return pending;
+    }
+    strcpy(file->filename, filename);
+    file->due = monotonic_milliseconds() + WATCH_DEBOUNCE_MILLISECONDS;
+    file->next = pending;
+    return file;
+}
+
+long monotonic_milliseconds(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int run_probe(int argc, char* argv[]){
+    probe_context context = {0};
+
+    if(argc < 1){
+        fprintf(stderr, "Usage: \t$ ./pngstego probe filename.png...\n");
+        return EXIT_FAILURE;
+    }
+
+    context.filenames = argv;
+    context.count = argc;
+    pthread_mutex_init(&context.output_lock, NULL);
+    run_worker_threads(probe_worker, &context, argc);
+
+    fprintf(stderr, "Probed %d files, %d plausible\n", context.count, context.plausible);
+    return EXIT_SUCCESS;
+}
+
+void* probe_worker(void* arg){
+    probe_context* context = arg;
+    png_bytep chunk = malloc(PROBE_CHUNK_LENGTH);
+    int index;
+
+    if(chunk == NULL){
+        fprintf(stderr, "Error in probe_worker(): %s\n", strerror(errno));
+        return NULL;
+    }
+
+    //Files are handed out one at a time so a slow one doesn't hold up a whole share
+    while((index = __atomic_fetch_add(&context->next, 1, __ATOMIC_RELAXED)) < context->count){
+        probe_result result;
+        probe_file(context->filenames[index], chunk, &result);
+
+        //One line per file, whole lines only
+        pthread_mutex_lock(&context->output_lock);
+        print_probe_result(stdout, context->filenames[index], &result);
+        if(result.plausible){
+            context->plausible++;
+        }
+        pthread_mutex_unlock(&context->output_lock);
+    }
+
+    free(chunk);
+    return NULL;
+}
+
+void probe_file(const char* filename, png_bytep chunk, probe_result* result){
+    progressive_extractor extractor;
+    memory_buffer sample = {0};
+    FILE* PNG_file;
+    size_t length;
+
+    memset(result, 0, sizeof(probe_result));
+    result->reason = "could not decode the image";
+
+    PNG_file = fopen(filename, "rb");
+    if(PNG_file == NULL){
+        result->reason = strerror_r(errno, result->error, sizeof(result->error));
+        return;
+    }
+    if(!start_progressive_extract(&extractor, &sample)){
+        fclose(PNG_file);
+        return;
+    }
+
+    //Feed the file until the length is known and the sample is in, and no further
+    while((length = fread(chunk, 1, PROBE_CHUNK_LENGTH, PNG_file)) > 0){
+        if(!feed_progressive_extract(&extractor, chunk, length)
+           || probe_sample_complete(&extractor.state, &sample)){
+            break;
+        }
+    }
+    fclose(PNG_file);
+    finish_progressive_extract(&extractor);
+
+    if(extractor.interlaced){
+        //Interlaced rows aren't final until the last pass, so decode the whole image
+        png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+        png_infop png_info = png_ptr != NULL ? png_create_info_struct(png_ptr) : NULL;
+        memory_buffer carrier = {0};
+
+        sample.length = 0;
+        if(png_info != NULL && read_file_into_buffer(filename, &carrier)){
+            memory_source source = {carrier.data, carrier.length, 0};
+            if(decode_png_memory(png_ptr, png_info, &source)){
+                png_bytep* rows = png_get_rows(png_ptr, png_info);
+                int row;
+                start_extract_state(&extractor.state,
+                                    png_get_image_width(png_ptr, png_info),
+                                    png_get_image_height(png_ptr, png_info));
+                for(row = 0; row < extractor.state.height; row++){
+                    if(!extract_row(&extractor.state, rows[row], &sample)
+                       || probe_sample_complete(&extractor.state, &sample)){
+                        break;
+                    }
+                }
+            }
+        }
+        free_memory_buffer(&carrier);
+        if(png_ptr != NULL){
+            png_destroy_read_struct(&png_ptr, png_info != NULL ? &png_info : NULL, NULL);
+        }
+    }
+
+    if(extractor.state.length_known){
+        size_t i;
+        size_t printable = 0;
+
+        result->decoded = true;
+        result->width = extractor.state.width;
+        result->height = extractor.state.height;
+        result->capacity = payload_capacity(extractor.state.width, extractor.state.height);
+        result->length = extractor.state.length;
+
+        //Whole rows are decoded, so there may be more than the sample
+        result->sample_length = sample.length < PROBE_SAMPLE_LENGTH ? sample.length : PROBE_SAMPLE_LENGTH;
+        for(i = 0; i < result->sample_length; i++){
+            if(isprint(sample.data[i]) || isspace(sample.data[i])){
+                printable++;
+            }
+        }
+        result->printable_ratio = result->sample_length > 0 ? (double)printable / result->sample_length : 0;
+
+        //Without a magic number or checksum in the format, the length is the only thing
+        // to check. In an image that was never embedded it is noise, and almost always
+        // larger than the image could hold.
+        if(result->length == 0){
+            result->reason = "stored length is zero";
+        }else if(result->length > result->capacity){
+            result->reason = "stored length is larger than the image can hold";
+        }else{
+            result->plausible = true;
+            result->reason = NULL;
+        }
+    }else if(extractor.state.done){
+        result->reason = "image is too small to hold a message";
+    }
+
+    free_memory_buffer(&sample);
+}
+
+bool probe_sample_complete(const extract_state* state, const memory_buffer* sample){
+    size_t capacity;
+    size_t wanted;
+
+    if(state->done){
+        return true;
+    }
+    if(!state->length_known){
+        return false;
+    }
+
+    //A length the image can't hold is already an answer
+    capacity = payload_capacity(state->width, state->height);
+    if(state->length > capacity){
+        return true;
+    }
+    wanted = state->length < PROBE_SAMPLE_LENGTH ? state->length : PROBE_SAMPLE_LENGTH;
+    return sample->length >= wanted;
+}
+
+void print_probe_result(FILE* fp, const char* filename, const probe_result* result){
+    fprintf(fp, "{\"file\":");
+    print_json_string(fp, filename);
+    if(result->decoded){
+        fprintf(fp, ",\"width\":%d,\"height\":%d,\"capacity\":%zu,\"length\":%zu,"
+                    "\"sample_bytes\":%zu,\"printable_ratio\":%.3f",
+                    result->width, result->height, result->capacity, result->length,
+                    result->sample_length, result->printable_ratio);
+    }
+    fprintf(fp, ",\"plausible\":%s", result->plausible ? "true" : "false");
+    if(result->reason != NULL){
+        fprintf(fp, ",\"reason\":");
+        print_json_string(fp, result->reason);
+    }
+    fprintf(fp, "}\n");
+}
+
+void print_json_string(FILE* fp, const char* text){
+    const unsigned char* next;
+
+    fputc('"', fp);
+    for(next = (const unsigned char*)text; *next != '\0'; next++){
+        if(*next == '"' || *next == '\\'){
+            fprintf(fp, "\\%c", *next);
+        }else if(*next < 0x20){
+            fprintf(fp, "\\u%04x", *next);
+        }else{
+            fputc(*next, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+int run_triage(int argc, char* argv[]){
+    triage_context context = {0};
+
+    if(argc < 1){
+        fprintf(stderr, "Usage: \t$ ./pngstego triage filename.png...\n");
+        return EXIT_FAILURE;
+    }
+
+    context.filenames = argv;
+    context.count = argc;
+    pthread_mutex_init(&context.output_lock, NULL);
+    run_worker_threads(triage_worker, &context, argc);
+
+    fprintf(stderr, "Triaged %d files, %d flagged (%d unreadable)\n", context.count, context.flagged, context.unreadable);
+    return context.unreadable == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void* triage_worker(void* arg){
+    triage_context* context = arg;
+    png_bytep chunk = malloc(PROBE_CHUNK_LENGTH);
+    triage_state* state = malloc(sizeof(triage_state));
+    int index;
+
+    if(chunk == NULL || state == NULL){
+        fprintf(stderr, "Error in triage_worker(): %s\n", strerror(errno));
+        free(chunk);
+        free(state);
+        return NULL;
+    }
+
+    while((index = __atomic_fetch_add(&context->next, 1, __ATOMIC_RELAXED)) < context->count){
+        triage_result result;
+        triage_file(context->filenames[index], chunk, state, &result);
+
+        pthread_mutex_lock(&context->output_lock);
+        print_triage_result(stdout, context->filenames[index], &result);
+        if(result.flagged){
+            context->flagged++;
+        }
+        if(!result.decoded && result.width == 0){
+            context->unreadable++;
+        }
+        pthread_mutex_unlock(&context->output_lock);
+    }
+
+    free(state);
+    free(chunk);
+    return NULL;
+}
+
+void triage_file(const char* filename, png_bytep chunk, triage_state* state, triage_result* result){
+    FILE* PNG_file;
+    size_t length;
+
+    memset(result, 0, sizeof(triage_result));
+    memset(state, 0, sizeof(triage_state));
+
+    //A file that can't be checked mustn't pass, so it is flagged until it is cleared
+    result->flagged = true;
+    result->reason = "could not decode the image";
+
+    PNG_file = fopen(filename, "rb");
+    if(PNG_file == NULL){
+        result->reason = strerror_r(errno, result->error, sizeof(result->error));
+        return;
+    }
+    state->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    state->info_ptr = state->png_ptr != NULL ? png_create_info_struct(state->png_ptr) : NULL;
+    if(state->info_ptr == NULL){
+        fprintf(stderr, "Error in triage_file(): libpng could not allocate a reader\n");
+        if(state->png_ptr != NULL){
+            png_destroy_read_struct(&state->png_ptr, NULL, NULL);
+        }
+        fclose(PNG_file);
+        return;
+    }
+    png_set_progressive_read_fn(state->png_ptr, state, triage_info_callback, triage_row_callback, NULL);
+
+    //Feed the file until the sample is in, and no further. PNG has no index into
+    // its compressed data, so the sample is the rows at the top of the image.
+    if(setjmp(png_jmpbuf(state->png_ptr)) == 0){
+        while(!state->done && (length = fread(chunk, 1, PROBE_CHUNK_LENGTH, PNG_file)) > 0){
+            png_process_data(state->png_ptr, state->info_ptr, chunk, length);
+        }
+    }
+    fclose(PNG_file);
+    png_destroy_read_struct(&state->png_ptr, &state->info_ptr, NULL);
+    free(state->plane);
+
+    if(state->interlaced){
+        //Interlaced rows aren't final until the last pass, so a cheap sample isn't possible
+        result->width = state->width;
+        result->height = state->height;
+        result->flagged = true;
+        result->reason = "interlaced images need a full analysis";
+    }else if(state->rows_seen > 0){
+        //A truncated file is judged on the rows it has
+        result->decoded = true;
+        result->width = state->width;
+        result->height = state->height;
+        result->rows = state->rows_seen;
+        result->reason = NULL;
+        estimate_triage_result(state, result);
+    }
+}
+
+void triage_info_callback(png_structp png_ptr, png_infop png_info){
+    triage_state* state = png_get_progressive_ptr(png_ptr);
+    size_t row_samples;
+
+    if(png_get_bit_depth(png_ptr, png_info) != BYTE_SIZE){
+        png_error(png_ptr, "Only 8 bit depths are supported");
+    }
+    int color_type = png_get_color_type(png_ptr, png_info);
+    if(color_type != PNG_COLOR_TYPE_RGB && color_type != PNG_COLOR_TYPE_RGB_ALPHA){
+        png_error(png_ptr, "Only RGB and RGBA images are supported");
+    }
+
+    state->width = png_get_image_width(png_ptr, png_info);
+    state->height = png_get_image_height(png_ptr, png_info);
+    state->channels = png_get_channels(png_ptr, png_info);
+    if(png_get_interlace_type(png_ptr, png_info) != PNG_INTERLACE_NONE){
+        state->interlaced = true;
+        png_longjmp(png_ptr, 1);
+    }
 
-    //Initialize IO
-    png_init_io(read_ptr, PNG_file);
+    //Enough rows for the sample, unless the image is smaller
+    row_samples = (size_t)state->width * state->channels;
+    state->rows_wanted = (int)((TRIAGE_SAMPLE_LENGTH + row_samples - 1) / row_samples);
+    if(state->rows_wanted > state->height){
+        state->rows_wanted = state->height;
+    }
 
-    //HEADER_LENGTH bytes were read at the beginning, we must let libpng know.
-    png_set_sig_bytes(read_ptr, HEADER_LENGTH);
+    state->plane = malloc(state->width + ANALYSIS_PLANE_PADDING);
+    if(state->plane == NULL){
+        png_error(png_ptr, "Out of memory for the sample plane");
+    }
+    png_start_read_image(png_ptr);
+}
 
-    //Read entire PNG into memory
-    png_read_png(read_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+void triage_row_callback(png_structp png_ptr, png_bytep new_row, png_uint_32 row_num, int pass){
+    triage_state* state = png_get_progressive_ptr(png_ptr);
+    int run_length = TRIAGE_SAMPLE_LENGTH / TRIAGE_BLOCK_COUNT;
+    int c;
 
-    row_pointers = png_get_rows(read_ptr, info_ptr);
+    if(new_row == NULL || state->done){
+        return;
+    }
 
-    //Only accept PNGs with depths of 8 bits
-    int bit_depth = png_get_bit_depth(read_ptr, info_ptr);
-    if(bit_depth != BYTE_SIZE){
-        fprintf(stderr, "Error in open_png_file(): File's bit depth is not valid."
-                        " Provided image's bit depth is %d, only 8 bit depths are supported\n",
-                        bit_depth);
-        exit_cleanly();
+    //Runs are dealt out in turn, so the blocks stay even however wide the rows are
+    for(c = 0; c < state->channels; c++){
+        int x;
+        for(x = 0; x < state->width; x++){
+            state->plane[x] = new_row[(size_t)x * state->channels + c];
+        }
+        for(x = 0; x < state->width; x += run_length){
+            int length = state->width - x < run_length ? state->width - x : run_length;
+            channel_statistics* block = &state->blocks[state->next_block];
+            state->next_block = (state->next_block + 1) % TRIAGE_BLOCK_COUNT;
+            count_plane_statistics(block, state->plane + x, length);
+        }
+    }
+
+    state->rows_seen++;
+    if(state->rows_seen >= state->rows_wanted){
+        state->done = true;
     }
+}
 
+void estimate_triage_result(const triage_state* state, triage_result* result){
+    channel_statistics* total = calloc(1, sizeof(channel_statistics));
+    double sum = 0;
+    double sum_of_squares = 0;
+    int blocks = 0;
+    int i;
 
-    fclose(PNG_file);
+    if(total == NULL){
+        result->flagged = true;
+        result->reason = "out of memory";
+        return;
+    }
+    for(i = 0; i < TRIAGE_BLOCK_COUNT; i++){
+        if(state->blocks[i].spa_pairs == 0){
+            continue;
+        }
+        double rate = spa_embedding_rate(&state->blocks[i]);
+        sum += rate;
+        sum_of_squares += rate * rate;
+        blocks++;
+        merge_channel_statistics(total, &state->blocks[i]);
+    }
+    result->rate = spa_embedding_rate(total);
+    result->chi_square = chi_square_probability(total);
+    free(total);
+
+    //The spread of the block estimates gives the standard error of their mean.
+    // With too few blocks to tell, nothing is ruled out.
+    result->low = 0;
+    result->high = 1;
+    if(blocks > 1){
+        double mean = sum / blocks;
+        double variance = (sum_of_squares - blocks * mean * mean) / (blocks - 1);
+        double margin = 1.96 * sqrt(variance > 0 ? variance : 0) / sqrt(blocks);
+        result->low = result->rate - margin < 0 ? 0 : result->rate - margin;
+        result->high = result->rate + margin > 1 ? 1 : result->rate + margin;
+    }
+
+    //Only images that can be ruled out pass, anything else is escalated
+    result->flagged = result->high >= TRIAGE_FLAG_RATE || result->chi_square >= TRIAGE_FLAG_PROBABILITY;
 }
 
-void embed_data(){
+void print_triage_result(FILE* fp, const char* filename, const triage_result* result){
+    fprintf(fp, "{\"file\":");
+    print_json_string(fp, filename);
+    if(result->width > 0){
+        fprintf(fp, ",\"width\":%d,\"height\":%d", result->width, result->height);
+    }
+    if(result->decoded){
+        fprintf(fp, ",\"sample_rows\":%d,\"rate\":%.4f,\"low\":%.4f,\"high\":%.4f,\"chi_square\":%.4f",
+                result->rows, result->rate, result->low, result->high, result->chi_square);
+    }
+    fprintf(fp, ",\"flagged\":%s", result->flagged ? "true" : "false");
+    if(result->reason != NULL){
+        fprintf(fp, ",\"reason\":");
+        print_json_string(fp, result->reason);
+    }
+    fprintf(fp, "}\n");
+}
 
-    int row;
-    int max_rows = png_get_image_height(read_ptr, info_ptr);
-    int max_cols = png_get_image_width(read_ptr, info_ptr);
-    char buffer = 0;
-    int bits_embedded = 0;
-
-    for(row = 0; row < max_rows; row++){
-        int col = 0;
-        //Write the size of the message (bytes) into the first BITS_NEEDED_TO_STORE_MESSAGE_LENGTH
-        // bytes of the image. If 32 bits are needed to store the message, then
-        // 32 bytes of the image will be filled.
-        if(row == 0){
-            for(col; col < BITS_NEEDED_TO_STORE_MESSAGE_LENGTH; col++){
-                //Loops over each bit in message_length and puts that bit into
-                // the LSB of the current byte.
-                if(message_length & (int)pow(2, col)){
-                    *(row_pointers[row] + col) |= 1; //Set the LSB using bitwise or
-                }else{
-                    *(row_pointers[row] + col) &= 0xFE; //Sets the LSB to 0
-                }
-            }
+int run_select(int argc, char* argv[]){
+    select_context context = {0};
+    cover_candidate* candidates;
+    int i;
+
+    if(argc >= 1 && strcmp(argv[0], SELECT_TEXTURE_FLAG) == 0){
+        context.with_texture = true;
+        argc--;
+        argv++;
+    }
+    if(argc < 2){
+        fprintf(stderr, "Usage: \t$ ./pngstego select [--texture] message_filename|bytes filename.png...\n");
+        return EXIT_FAILURE;
+    }
+
+    if(!parse_payload_length(argv[0], &context.payload_length)){
+        return EXIT_FAILURE;
+    }
+    argc--;
+    argv++;
+
+    candidates = calloc(argc, sizeof(cover_candidate));
+    if(candidates == NULL){
+        fprintf(stderr, "Error in run_select(): %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    for(i = 0; i < argc; i++){
+        candidates[i].filename = argv[i];
+    }
+    context.candidates = candidates;
+    context.count = argc;
+    run_worker_threads(select_worker, &context, argc);
+
+    qsort(candidates, argc, sizeof(cover_candidate), compare_cover_candidates);
+
+    fprintf(stdout, "%-32s %11s %10s %6s %8s %6s %7s\n",
+            "cover", "size", "capacity", "fill", "raw MB", "hint", "texture");
+    for(i = 0; i < argc && i < SELECT_TOP_COUNT; i++){
+        cover_candidate* candidate = &candidates[i];
+        char size[24];
+        if(!candidate->usable){
+            fprintf(stdout, "%-32s %s\n", candidate->filename,
+                    candidate->error != 0 ? strerror(candidate->error) : candidate->reason);
+            continue;
+        }
+        snprintf(size, sizeof(size), "%dx%d", candidate->width, candidate->height);
+        fprintf(stdout, "%-32s %11s %10zu %5.1f%% %8.2f %6.3f ", candidate->filename, size,
+                candidate->capacity, 100 * candidate->fill, candidate->raw_bytes / 1e6, candidate->hint);
+        if(candidate->texture >= 0){
+            fprintf(stdout, "%7.2f\n", candidate->texture);
+        }else{
+            fprintf(stdout, "%7s\n", "-");
         }
+    }
 
-        //We need the width to be in bytes, but max_cols is in pixels. So, we
-        // multiply it by 3 since there are 3 bytes in a pixel
-        for(col; col < max_cols * 3; col++){
-            if(col % BYTE_SIZE == 0){
-                //If we've encoded 8 bits it is time to read the next byte
-                if(!fread(&buffer, 1, 1, message_fp)){
-                    break;
-                }
-            }
+    int status = EXIT_SUCCESS;
+    if(argc > 0 && candidates[0].usable){
+        fprintf(stdout, "Best fit for %zu bytes: %s\n", context.payload_length, candidates[0].filename);
+    }else{
+        fprintf(stderr, "No cover can hold %zu bytes\n", context.payload_length);
+        status = EXIT_FAILURE;
+    }
+    free(candidates);
+    return status;
+}
 
-            //Do the actual embedding
-            if(buffer & (int)pow(2, col % BYTE_SIZE)){
-                *(row_pointers[row] + col) |= 1;
-            }else{
-                *(row_pointers[row] + col) &= 0xFE;
-            }
-            bits_embedded++;
+void* select_worker(void* arg){
+    select_context* context = arg;
+    int index;
+
+    while((index = __atomic_fetch_add(&context->next, 1, __ATOMIC_RELAXED)) < context->count){
+        evaluate_cover(&context->candidates[index], context->payload_length, context->with_texture);
+    }
+    return NULL;
+}
+
+void evaluate_cover(cover_candidate* candidate, size_t payload_length, bool with_texture){
+    png_byte header[HEADER_LENGTH + 8 + 13];
+    struct stat st;
+    FILE* fp;
+
+    candidate->texture = -1;
+    candidate->reason = "could not read the header";
+    fp = fopen(candidate->filename, "rb");
+    if(fp == NULL){
+        candidate->error = errno;
+        return;
+    }
+    bool read = fread(header, 1, sizeof(header), fp) == sizeof(header) && fstat(fileno(fp), &st) == 0;
+    fclose(fp);
+
+    //The signature, then IHDR's length and type, then its fields, all big endian
+    if(!read || png_sig_cmp(header, 0, HEADER_LENGTH) != 0 || memcmp(header + HEADER_LENGTH + 4, "IHDR", 4) != 0){
+        return;
+    }
+    const png_byte* fields = header + HEADER_LENGTH + 8;
+    png_uint_32 width = png_get_uint_32(fields);
+    png_uint_32 height = png_get_uint_32(fields + 4);
+    int bit_depth = fields[8];
+    int color_type = fields[9];
+    int interlace_type = fields[12];
+
+    if(bit_depth != BYTE_SIZE || (color_type != PNG_COLOR_TYPE_RGB && color_type != PNG_COLOR_TYPE_RGB_ALPHA)){
+        candidate->reason = "only 8 bit RGB and RGBA images can carry a message";
+        return;
+    }
+    if(width > INT_MAX / 4 || height > INT_MAX){
+        candidate->reason = "image is too large";
+        return;
+    }
+    candidate->width = width;
+    candidate->height = height;
+    candidate->channels = color_type == PNG_COLOR_TYPE_RGB ? 3 : 4;
+    candidate->interlaced = interlace_type != PNG_INTERLACE_NONE;
+    candidate->capacity = payload_capacity(width, height);
+
+    //Decoding and re-encoding cost grows with the raw pixel data. How well the file
+    // compressed is a free hint at how noisy, and so how good a hiding place, it is.
+    candidate->raw_bytes = (uint64_t)width * height * candidate->channels;
+    candidate->file_bytes = st.st_size;
+    candidate->hint = candidate->raw_bytes > 0 ? (double)st.st_size / candidate->raw_bytes : 0;
+    candidate->fill = candidate->capacity > 0 ? (double)payload_length / candidate->capacity : 1;
+    if(candidate->capacity < payload_length){
+        candidate->reason = "too small for the message";
+        return;
+    }
+    candidate->usable = true;
+    candidate->reason = NULL;
+
+    if(with_texture && interlace_type == PNG_INTERLACE_NONE){
+        candidate->texture = sample_cover_texture(candidate->filename);
+    }
+}
+
+double sample_cover_texture(const char* filename){
+    png_structp png_ptr;
+    png_infop png_info;
+    //These change after setjmp() and are used after a longjmp(), so they have to be volatile
+    png_bytep volatile row = NULL;
+    volatile uint64_t difference = 0;
+    volatile uint64_t pairs = 0;
+    FILE* fp;
+    int rows;
+    int y;
+
+    fp = fopen(filename, "rb");
+    if(fp == NULL){
+        return -1;
+    }
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_info = png_ptr != NULL ? png_create_info_struct(png_ptr) : NULL;
+    if(png_info == NULL){
+        if(png_ptr != NULL){
+            png_destroy_read_struct(&png_ptr, NULL, NULL);
         }
+        fclose(fp);
+        return -1;
+    }
+    if(setjmp(png_jmpbuf(png_ptr))){
+        png_destroy_read_struct(&png_ptr, &png_info, NULL);
+        free(row);
+        fclose(fp);
+        return pairs > 0 ? (double)difference / pairs : -1;
     }
 
-    fprintf(stdout, "Message has been embedded!\n%d bytes embedded\n", (int)(bits_embedded/BYTE_SIZE));
+    png_init_io(png_ptr, fp);
+    png_read_info(png_ptr, png_info);
+    size_t row_bytes = png_get_rowbytes(png_ptr, png_info);
+    int channels = png_get_channels(png_ptr, png_info);
+    int height = png_get_image_height(png_ptr, png_info);
+    row = malloc(row_bytes);
+    if(row == NULL){
+        png_error(png_ptr, "Out of memory for the sample row");
+    }
 
-    fclose(message_fp);
-    output_embedded_png();
+    //Rows are read in order and the reader is dropped after the sample, so the
+    // rest of the file is never decoded
+    rows = (int)((SELECT_TEXTURE_SAMPLE_LENGTH + row_bytes - 1) / row_bytes);
+    rows = rows < height ? rows : height;
+    for(y = 0; y < rows; y++){
+        uint64_t row_difference = 0;
+        size_t x;
+        png_read_row(png_ptr, row, NULL);
+        for(x = channels; x < row_bytes; x++){
+            row_difference += abs(row[x] - row[x - channels]);
+        }
+        difference += row_difference;
+        pairs += row_bytes - channels;
+    }
+
+    png_destroy_read_struct(&png_ptr, &png_info, NULL);
+    free(row);
+    fclose(fp);
+    return pairs > 0 ? (double)difference / pairs : -1;
 }
 
-void extract_data(){
-    int row;
-    int max_rows = png_get_image_height(read_ptr, info_ptr);
-    int max_cols = png_get_image_width(read_ptr, info_ptr);
-    char buffer = 0;
-    int bits_extracted = 0;
-    bool done_extracting = false;
+int compare_cover_candidates(const void* a, const void* b){
+    const cover_candidate* first = a;
+    const cover_candidate* second = b;
 
-    for(row = 0; row < max_rows; row++){
-        if(done_extracting){
-            break;
+    //Covers that fit come first, then covers the message won't crowd or that aren't
+    // too flat to hide LSB noise, then the cheapest size class, then the noisiest
+    if(first->usable != second->usable){
+        return first->usable ? -1 : 1;
+    }
+    if(!first->usable){
+        return 0;
+    }
+    bool first_exposed = first->fill > SELECT_MAX_FILL || (first->texture >= 0 && first->texture < SELECT_MIN_TEXTURE);
+    bool second_exposed = second->fill > SELECT_MAX_FILL || (second->texture >= 0 && second->texture < SELECT_MIN_TEXTURE);
+    if(first_exposed != second_exposed){
+        return first_exposed ? 1 : -1;
+    }
+    int first_class = (int)floor(log((double)first->raw_bytes + 1) / log(SELECT_SIZE_CLASS_RATIO));
+    int second_class = (int)floor(log((double)second->raw_bytes + 1) / log(SELECT_SIZE_CLASS_RATIO));
+    if(first_class != second_class){
+        return first_class < second_class ? -1 : 1;
+    }
+
+    //Texture and the compressed size hint are on different scales, so only like is
+    // compared with like. Measured covers come first, as the ones that couldn't be
+    // measured are interlaced, costing a whole decode, or failed to decode.
+    bool first_measured = first->texture >= 0;
+    bool second_measured = second->texture >= 0;
+    if(first_measured != second_measured){
+        return first_measured ? -1 : 1;
+    }
+    double first_noise = first_measured ? first->texture : first->hint;
+    double second_noise = second_measured ? second->texture : second->hint;
+    if(first_noise != second_noise){
+        return first_noise > second_noise ? -1 : 1;
+    }
+    return (first->raw_bytes > second->raw_bytes) - (first->raw_bytes < second->raw_bytes);
+}
+
+bool parse_payload_length(const char* argument, size_t* length){
+    struct stat st;
+    char* end;
+
+    //The payload is a message file, or just its size
+    if(stat(argument, &st) == 0){
+        *length = st.st_size;
+        return true;
+    }
+    *length = strtoull(argument, &end, 10);
+    if(*end != '\0' || end == argument){
+        fprintf(stderr, "Error in parse_payload_length(): %s: %s\n", argument, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+int run_plan(int argc, char* argv[]){
+    select_context context = {0};
+    throughput_model model;
+    plan_estimate total = {0};
+    uint64_t largest_memory = 0;
+    uint64_t total_raw = 0;
+    size_t total_capacity = 0;
+    int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int readable = 0;
+    int fitting = 0;
+    int i;
+
+    if(argc < 2){
+        fprintf(stderr, "Usage: \t$ ./pngstego plan message_filename|bytes filename.png...\n");
+        return EXIT_FAILURE;
+    }
+    if(cores < 1){
+        cores = 1;
+    }
+
+    if(!parse_payload_length(argv[0], &context.payload_length)){
+        return EXIT_FAILURE;
+    }
+    argc--;
+    argv++;
+
+    context.candidates = calloc(argc, sizeof(cover_candidate));
+    if(context.candidates == NULL){
+        fprintf(stderr, "Error in run_plan(): %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    for(i = 0; i < argc; i++){
+        context.candidates[i].filename = argv[i];
+    }
+    context.count = argc;
+
+    //Only headers are read, the same way select reads them
+    run_worker_threads(select_worker, &context, argc);
+
+    if(!calibrate_throughput(&model)){
+        free(context.candidates);
+        return EXIT_FAILURE;
+    }
+    fprintf(stdout, "Throughput on this host, in MB/s of pixels, for files compressed to %.0f%% and %.0f%%:"
+                    " decode %.0f and %.0f, encode %.0f and %.0f, embed %.0f\n",
+            100 * model.noise_ratio, 100 * model.smooth_ratio,
+            plan_throughput(model.decode_raw, model.decode_compressed, model.noise_ratio),
+            plan_throughput(model.decode_raw, model.decode_compressed, model.smooth_ratio),
+            plan_throughput(model.encode_raw, model.encode_compressed, model.noise_ratio),
+            plan_throughput(model.encode_raw, model.encode_compressed, model.smooth_ratio),
+            plan_throughput(model.embed, 0, 0));
+
+    fprintf(stdout, "%-32s %11s %10s %6s %7s %9s %9s %8s %8s %8s %8s\n",
+            "file", "size", "capacity", "fill", "rows", "memory MB", "verify MB",
+            "decode s", "embed s", "encode s", "extract s");
+    for(i = 0; i < argc; i++){
+        cover_candidate* candidate = &context.candidates[i];
+        plan_estimate estimate;
+        char size[24];
+
+        //A readable header always has a size, even if the message won't fit
+        if(candidate->width == 0){
+            fprintf(stdout, "%-32s %s\n", candidate->filename,
+                    candidate->error != 0 ? strerror(candidate->error) : candidate->reason);
+            continue;
         }
-        int col = 0;
-        if(row == 0){
-            //Extract the size of the message from the first BITS_NEEDED_TO_STORE_MESSAGE_LENGTH bytes
-            for(col; col < BITS_NEEDED_TO_STORE_MESSAGE_LENGTH; col++){
-                message_length |= ((*(row_pointers[0] + col) & 1) << col);
+        readable++;
+        estimate_plan_job(candidate, &model, context.payload_length, &estimate);
+        snprintf(size, sizeof(size), "%dx%d", candidate->width, candidate->height);
+        fprintf(stdout, "%-32s %11s %10zu %5.1f%% %7d %9.2f %9.2f %8.3f %8.3f %8.3f %8.3f%s\n",
+                candidate->filename, size, candidate->capacity, 100 * candidate->fill, estimate.rows,
+                estimate.embed_memory / 1e6, estimate.verify_memory / 1e6,
+                estimate.decode, estimate.embed, estimate.encode, estimate.extract,
+                candidate->usable ? "" : " (too small)");
+
+        total_raw += candidate->raw_bytes;
+        total_capacity += candidate->capacity;
+        if(!candidate->usable){
+            continue;
+        }
+        fitting++;
+        total.embed_memory += estimate.embed_memory;
+        total.verify_memory += estimate.verify_memory;
+        total.decode += estimate.decode;
+        total.embed += estimate.embed;
+        total.encode += estimate.encode;
+        total.extract += estimate.extract;
+        if(estimate.verify_memory > largest_memory){
+            largest_memory = estimate.verify_memory;
+        }
+    }
+
+    //Batch runs a job per core, so a core's worth of the largest jobs can be live at once
+    double embed_time = total.decode + total.embed + total.encode;
+    fprintf(stdout, "Total: %d of %d files readable, %d can hold %zu bytes\n",
+            readable, argc, fitting, context.payload_length);
+    fprintf(stdout, "  %.2f MB of pixels, %zu bytes of capacity\n", total_raw / 1e6, total_capacity);
+    fprintf(stdout, "  embed memory %.2f MB summed, %.2f MB with --verify, largest job %.2f MB,"
+                    " up to %.2f MB with %d at once\n",
+            total.embed_memory / 1e6, total.verify_memory / 1e6, largest_memory / 1e6,
+            (double)largest_memory * (cores < fitting ? cores : fitting) / 1e6, cores);
+    fprintf(stdout, "  embed %.2f s (decode %.2f, embed %.2f, encode %.2f), about %.2f s on %d core%s\n",
+            embed_time, total.decode, total.embed, total.encode, embed_time / cores, cores, cores == 1 ? "" : "s");
+    fprintf(stdout, "  extract %.2f s, about %.2f s on %d core%s\n",
+            total.extract, total.extract / cores, cores, cores == 1 ? "" : "s");
+
+    free(context.candidates);
+    return fitting == argc ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void estimate_plan_job(const cover_candidate* candidate, const throughput_model* model, size_t payload_length,
+                       plan_estimate* estimate){
+    uint64_t row_bytes = (uint64_t)candidate->width * candidate->channels;
+    size_t embedded = payload_length < candidate->capacity ? payload_length : candidate->capacity;
+    double touched;
+
+    estimate->rows = embedded_row_count(candidate->width, candidate->height, embedded);
+    touched = candidate->height > 0 ? (double)estimate->rows / candidate->height : 0;
+
+    //open_png_file() keeps every row, and encoding adds deflate's state and
+    // libpng's filter rows. --verify also keeps the encoded file and the read back message.
+    estimate->embed_memory = candidate->raw_bytes + (uint64_t)candidate->height * sizeof(png_bytep)
+                             + row_bytes * PLAN_FILTER_ROWS + PLAN_CODEC_MEMORY + embedded;
+    estimate->verify_memory = estimate->embed_memory + candidate->file_bytes
+                              + candidate->file_bytes / OUTPUT_SLACK_DIVISOR + embedded;
+
+    //The output is taken to compress about as well as the cover did
+    estimate->decode = candidate->raw_bytes * model->decode_raw + candidate->file_bytes * model->decode_compressed;
+    estimate->encode = candidate->raw_bytes * model->encode_raw + candidate->file_bytes * model->encode_compressed;
+    estimate->decode = estimate->decode > 0 ? estimate->decode : 0;
+    estimate->encode = estimate->encode > 0 ? estimate->encode : 0;
+    estimate->embed = estimate->rows * row_bytes * model->embed;
+
+    //Extract stops decoding after the last message row, unless the image is interlaced
+    estimate->extract = candidate->interlaced ? estimate->decode : estimate->decode * touched;
+}
+
+bool calibrate_throughput(throughput_model* model){
+    const int width = PLAN_CALIBRATION_WIDTH;
+    const int height = PLAN_CALIBRATION_HEIGHT;
+    size_t row_bytes = (size_t)width * 3;
+    double decode_time[2];
+    double encode_time[2];
+    double compressed[2];
+    double embed_time = 0;
+    png_bytep pixels;
+    png_bytep payload;
+    png_bytep rows[PLAN_CALIBRATION_HEIGHT];
+    uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+    size_t capacity = payload_capacity(width, height);
+    int content;
+    int y;
+
+    pixels = malloc(row_bytes * height);
+    payload = malloc(capacity);
+    if(pixels == NULL || payload == NULL){
+        fprintf(stderr, "Error in calibrate_throughput(): %s\n", strerror(errno));
+        free(pixels);
+        free(payload);
+        return false;
+    }
+    for(y = 0; y < height; y++){
+        rows[y] = pixels + row_bytes * y;
+    }
+    memset(payload, 0xA5, capacity);
+
+    //Noise compresses not at all and a noisy gradient about as well as a photo, which
+    // separates the cost per raw byte from the cost per compressed byte
+    for(content = 0; content < 2; content++){
+        memory_buffer encoded = {0};
+        int run;
+
+        for(y = 0; y < height; y++){
+            size_t x;
+            for(x = 0; x < row_bytes; x++){
+                random_state ^= random_state << 13;
+                random_state ^= random_state >> 7;
+                random_state ^= random_state << 17;
+                rows[y][x] = content == 0 ? (png_byte)random_state
+                                          : (png_byte)((x / 3 + y) / 4 + (random_state & 7));
             }
         }
 
-        //Extract the actual message
-        for(col; col < max_cols * 3; col++){
-            //If we're beyond the size metadata and we've extracted 8 bits, write the byte to the file
-            if((col > BITS_NEEDED_TO_STORE_MESSAGE_LENGTH || row > 0) && col % BYTE_SIZE == 0){
-                fwrite(&buffer, 1, 1, output_fp);
-                buffer = 0;
+        decode_time[content] = encode_time[content] = -1;
+        for(run = 0; run < PLAN_CALIBRATION_RUNS; run++){
+            png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+            png_infop png_info = png_ptr != NULL ? png_create_info_struct(png_ptr) : NULL;
+            bool success = png_info != NULL;
+
+            encoded.length = 0;
+            double start = monotonic_seconds();
+            if(success){
+                png_set_IHDR(png_ptr, png_info, width, height, BYTE_SIZE, PNG_COLOR_TYPE_RGB,
+                             PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+                png_set_rows(png_ptr, png_info, rows);
+                success = encode_png_memory(png_ptr, png_info, &encoded);
             }
+            double elapsed = monotonic_seconds() - start;
+            png_destroy_write_struct(&png_ptr, &png_info);
+            if(!success){
+                free_memory_buffer(&encoded);
+                free(pixels);
+                free(payload);
+                return false;
+            }
+            if(encode_time[content] < 0 || elapsed < encode_time[content]){
+                encode_time[content] = elapsed;
+            }
+        }
+        compressed[content] = encoded.length;
 
-            //Check if all the data has been extracted
-            int bytes_read = (max_cols * row) * 3 + col;
-            if(bytes_read == (message_length * BYTE_SIZE) + BITS_NEEDED_TO_STORE_MESSAGE_LENGTH){
-                done_extracting = true;
-                break;
+        for(run = 0; run < PLAN_CALIBRATION_RUNS; run++){
+            memory_source source = {encoded.data, encoded.length, 0};
+            png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+            png_infop png_info = png_ptr != NULL ? png_create_info_struct(png_ptr) : NULL;
+
+            double start = monotonic_seconds();
+            bool success = png_info != NULL && decode_png_memory(png_ptr, png_info, &source);
+            double elapsed = monotonic_seconds() - start;
+            png_destroy_read_struct(&png_ptr, &png_info, NULL);
+            if(!success){
+                free_memory_buffer(&encoded);
+                free(pixels);
+                free(payload);
+                return false;
+            }
+            if(decode_time[content] < 0 || elapsed < decode_time[content]){
+                decode_time[content] = elapsed;
             }
+        }
+        free_memory_buffer(&encoded);
+    }
 
-            //Do the actual extracting
-            buffer |= ((*(row_pointers[row] + col) & 1) << col % BYTE_SIZE);
-            bits_extracted++;
+    for(y = 0; y < PLAN_CALIBRATION_RUNS; y++){
+        double start = monotonic_seconds();
+        embed_rows(rows, width, height, payload, capacity);
+        double elapsed = monotonic_seconds() - start;
+        if(y == 0 || elapsed < embed_time){
+            embed_time = elapsed;
         }
     }
+    free(pixels);
+    free(payload);
 
-    fprintf(stdout, "Done extracting!\n%d bytes extracted\n", (int)(bits_extracted / BYTE_SIZE));
-    fclose(output_fp);
+    //Both images have the same raw size, so the difference in time is down to the
+    // difference in compressed size. zlib spends longer on data with matches to find
+    // and copy, so the cost per compressed byte usually comes out negative.
+    double raw = (double)row_bytes * height;
+    double spread = compressed[0] - compressed[1];
+    model->decode_compressed = spread > 0 ? (decode_time[0] - decode_time[1]) / spread : 0;
+    model->encode_compressed = spread > 0 ? (encode_time[0] - encode_time[1]) / spread : 0;
+    model->decode_raw = (decode_time[1] - compressed[1] * model->decode_compressed) / raw;
+    model->encode_raw = (encode_time[1] - compressed[1] * model->encode_compressed) / raw;
+    model->embed = embed_time / raw;
+    model->noise_ratio = compressed[0] / raw;
+    model->smooth_ratio = compressed[1] / raw;
+    return true;
 }
 
-void output_embedded_png(){
-    FILE* output_png_fp;
-    output_png_fp = fopen(PNG_output_filename, "wb");
-    if(output_png_fp == NULL){
-        fprintf(stderr, "Error in output_embedded_png(): %s\n", strerror(errno));
-        exit_cleanly();
-    }
+double plan_throughput(double raw_cost, double compressed_cost, double ratio){
+    double cost = raw_cost + compressed_cost * ratio;
+    return cost > 0 ? 1e-6 / cost : 0;
+}
 
-    write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if(write_ptr == NULL){
-        fprintf(stderr, "Error in output_embedded_png(): png_create_write_struct() returned NULL\n");
-        exit_cleanly();
+double monotonic_seconds(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+int run_bench(int argc, char* argv[]){
+    int status = EXIT_SUCCESS;
+    int i;
+
+    if(argc >= 2 && strcasecmp(argv[0], BENCH_CORPUS_TEXT) == 0){
+        return generate_bench_corpus(argv[1], argc >= 3 ? atof(argv[2]) : BENCH_DEFAULT_MEGAPIXELS);
     }
 
-    png_init_io(write_ptr, output_png_fp);
-    png_set_rows(write_ptr, info_ptr, row_pointers);
-    png_write_png(write_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
-    fclose(output_png_fp);
+    fprintf(stdout, "file\twidth\theight\tchannels\traw_bytes\tfile_bytes\tpayload_bytes"
+                    "\topen_s\topen_MBps\tembed_s\tembed_MBps\toutput_s\toutput_MBps"
+                    "\textract_s\textract_MBps\timages_per_s\tpeak_rss_kB\n");
+    fflush(stdout);
+
+    //Each image runs in its own process, so the globals start clean, a failure only
+    // loses its row, and the peak RSS is that image's alone
+    for(i = 0; i < argc; i++){
+        char row[BENCH_ROW_MAX_LENGTH];
+        ssize_t length = 0;
+        ssize_t got;
+        int pipe_fds[2];
+        pid_t pid;
+
+        if(pipe(pipe_fds) != 0){
+            fprintf(stderr, "Error in run_bench(): %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        pid = fork();
+        if(pid < 0){
+            fprintf(stderr, "Error in run_bench(): %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        if(pid == 0){
+            close(pipe_fds[0]);
+            bench_image(argv[i], pipe_fds[1]);
+            exit(EXIT_SUCCESS);
+        }
+
+        close(pipe_fds[1]);
+        while(length < (ssize_t)sizeof(row) - 1
+              && (got = read(pipe_fds[0], row + length, sizeof(row) - 1 - length)) > 0){
+            length += got;
+        }
+        close(pipe_fds[0]);
+        waitpid(pid, NULL, 0);
+
+        if(length > 0){
+            row[length] = '\0';
+            fputs(row, stdout);
+        }else{
+            fprintf(stderr, "Error in run_bench(): %s failed\n", argv[i]);
+            status = EXIT_FAILURE;
+        }
+        fflush(stdout);
+    }
+    return status;
 }
 
-void calculate_available_space(png_structp read_ptr, png_infop info_ptr){
+void bench_image(const char* filename, int result_fd){
+    char scratch[FILENAME_MAX_LENGTH];
+    char row[BENCH_ROW_MAX_LENGTH];
+    uint64_t random_state = BENCH_SEED;
+    struct rusage usage;
+    struct stat st;
+    png_bytep payload;
+    size_t bytes_embedded;
+    size_t i;
+    int null_fd;
+
+    //The steps print as they go, which isn't part of the table
+    null_fd = open("/dev/null", O_WRONLY);
+    if(null_fd >= 0){
+        fflush(stdout);
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+    PNG_filename = filename;
+
+    double start = monotonic_seconds();
+    open_png_file(filename);
+    double open_time = monotonic_seconds() - start;
+
     int width = png_get_image_width(read_ptr, info_ptr);
     int height = png_get_image_height(read_ptr, info_ptr);
+    int channels = png_get_channels(read_ptr, info_ptr);
+    double raw = (double)width * height * channels;
+    calculate_available_space(read_ptr, info_ptr);
 
-    fprintf(stdout, "Image is %dpx x %dpx\n", width, height);
+    //Fill the image with a message that looks encrypted, so every row is touched
+    message_length = available_space;
+    payload = malloc(message_length > 0 ? message_length : 1);
+    if(payload == NULL){
+        fprintf(stderr, "Error in bench_image(): %s\n", strerror(errno));
+        exit_cleanly();
+    }
+    for(i = 0; i < message_length; i++){
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 7;
+        random_state ^= random_state << 17;
+        payload[i] = (png_byte)random_state;
+    }
+    message_fp = fmemopen(payload, message_length > 0 ? message_length : 1, "rb");
+    if(message_fp == NULL){
+        fprintf(stderr, "Error in bench_image(): %s\n", strerror(errno));
+        exit_cleanly();
+    }
+    //The scratch file is created here, so its name can't already be someone else's symlink
+    strcpy(scratch, BENCH_SCRATCH_TEMPLATE);
+    int scratch_fd = mkstemps(scratch, strlen(".png"));
+    if(scratch_fd == -1){
+        fprintf(stderr, "Error in bench_image(): %s\n", strerror(errno));
+        exit_cleanly();
+    }
+    close(scratch_fd);
+    PNG_output_filename = scratch;
 
-    //One pixel is 3 bytes, we can store 1 bit per byte. So, we can store
-    // 3 bits per pixel.
+    start = monotonic_seconds();
+    png_bytep message = embed_data(&bytes_embedded);
+    double embed_time = monotonic_seconds() - start;
+    free(message);
+    free(payload);
 
-    available_space = (width * height) * 3;
-    float available_space_kb = available_space * 0.000125;
+    start = monotonic_seconds();
+    output_embedded_png();
+    double output_time = monotonic_seconds() - start;
 
-    fprintf(stdout, "Able to embed %d bytes (%.2f kilobytes) of data\n",
-                    available_space, available_space_kb);
+    PNG_filename = scratch;
+    output_fp = fopen("/dev/null", "wb");
+    if(output_fp == NULL){
+        fprintf(stderr, "Error in bench_image(): %s\n", strerror(errno));
+        unlink(scratch);
+        exit_cleanly();
+    }
+    start = monotonic_seconds();
+    bool extracted = extract_data();
+    double extract_time = monotonic_seconds() - start;
+    unlink(scratch);
+    if(!extracted){
+        exit_cleanly();
+    }
+
+    double total = open_time + embed_time + output_time + extract_time;
+    getrusage(RUSAGE_SELF, &usage);
+    int length = snprintf(row, sizeof(row),
+                          "%s\t%d\t%d\t%d\t%.0f\t%lld\t%zu\t%.6f\t%.1f\t%.6f\t%.1f\t%.6f\t%.1f\t%.6f\t%.1f\t%.3f\t%ld\n",
+                          filename, width, height, channels, raw,
+                          stat(filename, &st) == 0 ? (long long)st.st_size : -1LL, bytes_embedded,
+                          open_time, bench_rate(raw, open_time), embed_time, bench_rate(raw, embed_time),
+                          output_time, bench_rate(raw, output_time), extract_time, bench_rate(raw, extract_time),
+                          total > 0 ? 1 / total : 0, usage.ru_maxrss);
+    if(length > 0 && !write_all(result_fd, row, length < (int)sizeof(row) ? length : (int)sizeof(row) - 1)){
+        fprintf(stderr, "Error in bench_image(): %s\n", strerror(errno));
+    }
+    close(result_fd);
 }
 
-bool check_message_size(){
-    struct stat st;
-    int err = stat(message_filename, &st);
-    if(err == -1){
-        fprintf(stderr, "Error in check_message_size(): %s\n", strerror(errno));
-        exit_cleanly();
+double bench_rate(double bytes, double seconds){
+    return seconds > 0 ? bytes / seconds / 1e6 : 0;
+}
+
+int generate_bench_corpus(const char* directory, double max_megapixels){
+    //The largest sizes are whole megapixels, so a max_megapixels of 16 or 200 keeps them
+    static const int sizes[][2] = {{32, 32}, {256, 256}, {1024, 1024}, {4000, 4000}, {16000, 12500}};
+    static const char* contents[BENCH_CONTENT_COUNT] = {"noise", "gradient", "flat", "photo"};
+    int size;
+    int content;
+    int channels;
+
+    if(mkdir(directory, 0755) != 0 && errno != EEXIST){
+        fprintf(stderr, "Error in generate_bench_corpus(): %s: %s\n", directory, strerror(errno));
+        return EXIT_FAILURE;
     }
-    message_length = st.st_size;
 
-    if(message_length > available_space){
-        fprintf(stderr, "Warning! Message is too large to embed in"
-                        " the provided image (%zu bytes too large).\nDo you"
-                        " wish to embed only the first %d bytes of the message"
-                        " instead? Y/N\n> ", message_length - available_space, available_space);
-        char input;
-        fscanf(stdin, " %c", &input);
-        getchar();
-        input = toupper(input);
-        if(input != 'Y'){
-            return false;
+    for(size = 0; size < (int)(sizeof(sizes) / sizeof(sizes[0])); size++){
+        int width = sizes[size][0];
+        int height = sizes[size][1];
+        if((double)width * height > max_megapixels * 1e6){
+            continue;
         }
+        for(content = 0; content < BENCH_CONTENT_COUNT; content++){
+            //The 200 MP covers are photo-like only, or the corpus would run to gigabytes
+            if(size == (int)(sizeof(sizes) / sizeof(sizes[0])) - 1 && content != BENCH_CONTENT_COUNT - 1){
+                continue;
+            }
+            for(channels = 3; channels <= 4; channels++){
+                char filename[FILENAME_MAX_LENGTH];
+                struct stat st;
 
-        message_length = available_space;
-    }
+                snprintf(filename, sizeof(filename), "%s/%s_%s_%dx%d.png", directory, contents[content],
+                         channels == 3 ? "rgb" : "rgba", width, height);
 
-    return true;
+                //The corpus is the same every time, so it is only made once
+                if(stat(filename, &st) == 0){
+                    continue;
+                }
+                if(!write_bench_cover(filename, width, height, channels, content)){
+                    return EXIT_FAILURE;
+                }
+                fprintf(stdout, "Generated %s\n", filename);
+            }
+        }
+    }
+    return EXIT_SUCCESS;
 }
 
-void exit_cleanly(){
-    //Free memory
-    if(read_ptr && info_ptr){
-        fprintf(stdout, "Freeing Read Memory...\n");
-        png_destroy_read_struct(&read_ptr, &info_ptr, (png_infopp)NULL);
+bool write_bench_cover(const char* filename, int width, int height, int channels, int content){
+    size_t row_bytes = (size_t)width * channels;
+    uint64_t random_state = BENCH_SEED ^ ((uint64_t)width << 32) ^ ((uint64_t)height << 8) ^ (channels << 4) ^ content;
+    png_structp png_ptr;
+    png_infop png_info;
+    char partial[FILENAME_MAX_LENGTH];
+    png_bytep row;
+    double* waves;
+    FILE* fp;
+    int y;
+
+    //The cover only gets its name once it is complete, so an interrupted run doesn't
+    // leave a truncated file that generate_bench_corpus() would skip from then on
+    if(snprintf(partial, sizeof(partial), "%s%s", filename, BENCH_PARTIAL_SUFFIX) >= (int)sizeof(partial)){
+        fprintf(stderr, "Error in write_bench_cover(): %s is too long\n", filename);
+        return false;
     }
-    if(write_ptr){
-        fprintf(stdout, "Freeing Write Memory...\n");
-        png_destroy_write_struct(&write_ptr, (png_infopp)NULL);
+
+    //These are allocated before setjmp() so the error handler frees what it was given
+    row = malloc(row_bytes);
+    waves = malloc(row_bytes * sizeof(double));
+    if(row == NULL || waves == NULL){
+        fprintf(stderr, "Error in write_bench_cover(): %s\n", strerror(errno));
+        free(row);
+        free(waves);
+        return false;
     }
 
-    fprintf(stderr, "Exiting...\n");
-    exit(EXIT_SUCCESS);
+    fp = fopen(partial, "wb");
+    if(fp == NULL){
+        fprintf(stderr, "Error in write_bench_cover(): %s: %s\n", filename, strerror(errno));
+        free(row);
+        free(waves);
+        return false;
+    }
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_info = png_ptr != NULL ? png_create_info_struct(png_ptr) : NULL;
+    if(png_info == NULL){
+        fprintf(stderr, "Error in write_bench_cover(): libpng could not start writing %s\n", filename);
+        png_destroy_write_struct(&png_ptr, NULL);
+        free(row);
+        free(waves);
+        fclose(fp);
+        unlink(partial);
+        return false;
+    }
+    if(setjmp(png_jmpbuf(png_ptr))){
+        fprintf(stderr, "Error in write_bench_cover(): libpng could not write %s\n", filename);
+        png_destroy_write_struct(&png_ptr, &png_info);
+        free(row);
+        free(waves);
+        fclose(fp);
+        unlink(partial);
+        return false;
+    }
+
+    //Photo-like covers are a smooth field made of waves across and down, so only
+    // these are worked out per column ahead of time
+    for(size_t x = 0; x < row_bytes; x++){
+        waves[x] = 50 * sin((x / channels) * 0.013 + (x % channels));
+    }
+
+    png_init_io(png_ptr, fp);
+    png_set_compression_level(png_ptr, Z_BEST_SPEED);
+    png_set_IHDR(png_ptr, png_info, width, height, BYTE_SIZE,
+                 channels == 3 ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_ptr, png_info);
+
+    for(y = 0; y < height; y++){
+        double wave = 40 * cos(y * 0.021);
+        size_t x;
+        for(x = 0; x < row_bytes; x++){
+            int channel = x % channels;
+            int column = x / channels;
+            int value;
+
+            random_state ^= random_state << 13;
+            random_state ^= random_state >> 7;
+            random_state ^= random_state << 17;
+            if(content == 0){
+                value = random_state & 0xFF;
+            }else if(channel == 3){
+                value = 255;
+            }else if(content == 1){
+                value = (int)(((int64_t)column * 255 / width + (int64_t)y * 255 / height) / 2) + channel * 16;
+            }else if(content == 2){
+                value = 96 + channel * 32;
+            }else{
+                //Smooth shading, hard edges between tiles and a little sensor noise
+                value = 128 + (int)(waves[x] + wave) + (((column / 128 + y / 128) & 1) ? 20 : -20)
+                        + (int)(random_state & 7) - 4;
+            }
+            row[x] = value < 0 ? 0 : value > 255 ? 255 : value;
+        }
+        png_write_row(png_ptr, row);
+    }
+
+    png_write_end(png_ptr, png_info);
+    png_destroy_write_struct(&png_ptr, &png_info);
+    free(row);
+    free(waves);
+    if(fclose(fp) != 0 || rename(partial, filename) != 0){
+        fprintf(stderr, "Error in write_bench_cover(): %s: %s\n", filename, strerror(errno));
+        unlink(partial);
+        return false;
+    }
+    return true;
 }